@@ -0,0 +1,1123 @@
+// usage:  hp-timetest-analyze [-j,  --jobs #(default=number of online CPUs)]
+//         [-W,  --window #(default=60 seconds; 0 for no per-window summary)]
+//         [-f,  --format "csv"|"xml"|"freeform"(default=freeform)]
+//         [-P,  --periods (group spikes into bursts and look for periodic noise sources)]
+//         [-G,  --burst-gap #(default=100 usecs; spikes closer than this are one burst)]
+//         [-v#, --verbose[=#(default=1)] [-b, --brief]
+//         [-? -h, --help]
+//         FILE...
+
+/* Offline analysis of HP-TimeTest spike output.
+
+Each FILE may be the output of a run with "-f csv" or "-f xml", or a binary spike log written
+with "--log" (see HP-TimeTest-log.h); the kind is recognized from the contents.  Every file is mapped, cut
+into chunks of about CHUNK_BYTES on line (or record) boundaries, and the chunks are handed out to worker
+threads.  Each worker keeps its own histograms and window totals, so nothing is shared while the chunks are
+parsed; once all of them are done the per-worker histograms are merged and the gaps that straddle chunk
+boundaries are filled in.
+
+Reported are the number of spikes, their percentiles and maximum, the same for the gaps between successive
+spikes on the same CPU of the same run, and a summary for each window of elapsed time.  Spikes are reported in
+nanoseconds when the input allows (TIME runs, or CYCLES runs with a calibrated TSC); spikes that are known
+only in cycles are reported separately.
+
+With "--periods" the nanosecond spikes of all the files are also kept, put in time order and grouped into
+bursts: a spike that starts within "--burst-gap" of the end of the burst before it (on any CPU) belongs to
+that burst, so an SMI that stalls every CPU at once is one burst.  The burst start times are then binned at
+PERIOD_BIN_NSEC and cut into segments of PERIOD_BINS bins (about 33 seconds), and each segment is
+Hann-windowed and Fourier transformed; the magnitudes are summed over the segments, so a source whose period
+drifts a little over a long run still adds up.  Two spectra come out of one complex FFT: one of the burst
+arrivals and one weighted by each burst's stall time.  Each is normalized so that 1.0 means every burst (or
+every nanosecond of stall) lines up with that frequency.  Peaks well above the noise floor of either are
+reported as periods, after dropping the harmonics of a lower peak, with the fraction of the bursts they
+explain (their amplitude) and the fraction of the stall time.  Periods from 0.5 msecs to about 10 seconds
+can be found: a 1 kHz tick, a 1 second SMI or a 5 second writeback flush.  The files are taken to share one
+time base, as the FILE.<cpu> logs of one "--cpus" run do.
+*/
+
+// gcc -W -Wall -O2 -pthread -o hp-timetest-analyze HP-TimeTest-analyze.c -lm
+
+/* Edit history:
+2026 10 16	1.0			Initial version.
+2026 10 16	1.1			Add "--periods": bursts of spikes and the periods of the noise sources, from
+					segmented FFTs of the burst arrivals and of their stall time.  Link with -lm.
+
+YYYY MM DD	V.V	F.N. L.N.	!!! UPDATE THE Version VARIABLE BELOW !!!
+*/
+
+#define _GNU_SOURCE
+# include <stdio.h>
+# include <stdlib.h>
+# include <stdint.h>
+# include <unistd.h>
+# include <string.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <fcntl.h>
+# include <limits.h>
+# include <getopt.h>
+# include <errno.h>
+# include <time.h>
+# include <sched.h>
+# include <pthread.h>
+# include <math.h>
+# include "HP-TimeTest-log.h"
+# include "HP-TimeTest-hist.h"
+
+typedef struct Version_struct {
+   unsigned int major;
+   unsigned int minor;
+} Version_struct;
+static Version_struct Version={1,1};
+
+#define CSV_FORMAT      1
+#define XML_FORMAT      2
+#define FREEFORM_FORMAT 3
+static int format=FREEFORM_FORMAT;
+static int chatty=1;
+
+#define CHUNK_BYTES   (32UL<<20)
+/* Streams are the CPUs of one run; slot 0 is the unpinned sampler (CPU -1) */
+#define MAX_STREAMS   (CPU_SETSIZE+1)
+
+/* Spikes whose length is known in nanoseconds and those known only in cycles are kept apart */
+#define NSEC_UNIT     0
+#define CYCLE_UNIT    1
+#define UNITS         2
+static const char *unit_names[UNITS]={"nsec", "cycle"};
+
+#define BINARY_FILE   1
+#define CSV_FILE      2
+#define XML_FILE      3
+
+typedef struct input_file {
+   const char *path;
+   const char *map;
+   size_t size;
+   int kind;
+   int cpu_column;                     /* text: the data lines start with the CPU */
+   int nsec_column;                    /* text: a "latency spike (nsec)" column follows the spike */
+   int migration_column;               /* CSV: the field number of the "migration" column, or -1 */
+   unsigned long spike_scale;          /* multiplier that turns a spike into nsecs (usec files: 1000) */
+   int unit;                           /* NSEC_UNIT or CYCLE_UNIT */
+   double nsec_per_cycle;              /* binary CYCLES logs with a calibrated TSC */
+   size_t data_offset;                 /* first byte that can hold a spike */
+   unsigned long spikes;
+} input_file_struct;
+
+/* The first and last spike a chunk saw on one stream; the gap between the last spike of one chunk and
+   the first of the next chunk of the same file can only be worked out once both are parsed.
+*/
+typedef struct stream_edge {
+   int stream;
+   int unit;
+   unsigned long first;
+   unsigned long last;
+} stream_edge_struct;
+
+typedef struct chunk {
+   int file;
+   size_t begin;
+   size_t end;
+   unsigned long spikes;
+   int edge_count;
+   stream_edge_struct *edges;
+} chunk_struct;
+
+typedef struct window {
+   unsigned long count[UNITS];
+   unsigned long max[UNITS];
+} window_struct;
+
+/* A spike kept for "--periods": its elapsed time at the end of the spike and its length, in nsecs */
+typedef struct event {
+   unsigned long time;
+   unsigned long spike;
+} event_struct;
+
+/* Spikes that follow each other within burst_gap_nsec, on whatever CPU */
+typedef struct burst {
+   unsigned long start;
+   unsigned long end;
+   unsigned long stall;                /* the spikes' lengths added up */
+   unsigned long spikes;
+} burst_struct;
+
+/* Everything a worker writes lives in its own worker_struct */
+typedef struct worker {
+   histogram_struct spikes[UNITS];
+   histogram_struct gaps[UNITS];
+   unsigned long spike_count[UNITS];
+   unsigned long max_spike[UNITS];
+   unsigned long gap_count[UNITS];
+   unsigned long max_gap[UNITS];
+   window_struct *windows;
+   unsigned long window_count;
+   event_struct *events;               /* "--periods": every nsec spike */
+   unsigned long event_count;
+   unsigned long event_size;
+/* scratch for the chunk being parsed */
+   unsigned long last[MAX_STREAMS];
+   unsigned long first[MAX_STREAMS];
+   int unit[MAX_STREAMS];
+   int seen[MAX_STREAMS];
+   int seen_list[MAX_STREAMS];
+   int seen_count;
+   pthread_t thread;
+} __attribute__ ((aligned (CACHE_LINE_SIZE))) worker_struct;
+
+static input_file_struct *files;
+static int file_count;
+static chunk_struct *chunks;
+static int chunk_count;
+static int next_chunk;
+static unsigned long window_nsec=60UL*1000000000UL;
+static int periods_flag=0;
+static unsigned long burst_gap_nsec=100000UL;
+
+static inline void record_event(worker_struct *w, unsigned long time, unsigned long spike) {
+   if (w->event_count >= w->event_size) {
+      unsigned long size=(w->event_size == 0) ? 65536 : 2*w->event_size;
+      event_struct *events=(event_struct *)realloc(w->events, size*sizeof(event_struct));
+      if (events == NULL) return;
+      w->events=events;
+      w->event_size=size;
+   }
+   w->events[w->event_count].time=time;
+   w->events[w->event_count].spike=spike;
+   w->event_count++;
+}
+
+static inline void record_spike(worker_struct *w, int stream, int unit, unsigned long time, unsigned long spike) {
+   unsigned long gap, ndx;
+   if (stream < 0) stream=0;
+   else if (++stream >= MAX_STREAMS) stream=MAX_STREAMS-1;
+   hist_record(&w->spikes[unit], spike);
+   w->spike_count[unit]++;
+   if (periods_flag && (unit == NSEC_UNIT)) record_event(w, time, spike);
+   if (spike > w->max_spike[unit]) w->max_spike[unit]=spike;
+   if (w->seen[stream] == 0) {
+      w->seen[stream]=1;
+      w->seen_list[w->seen_count++]=stream;
+      w->first[stream]=time;
+      w->unit[stream]=unit;
+   } else if (time >= w->last[stream]) {
+      gap=time-w->last[stream];
+      hist_record(&w->gaps[unit], gap);
+      w->gap_count[unit]++;
+      if (gap > w->max_gap[unit]) w->max_gap[unit]=gap;
+   }
+   w->last[stream]=time;
+   if (window_nsec == 0) return;
+   ndx=time/window_nsec;
+   if (ndx >= w->window_count) {
+      unsigned long count=(ndx+1 > 2*w->window_count) ? ndx+1 : 2*w->window_count;
+      window_struct *windows=(window_struct *)realloc(w->windows, count*sizeof(window_struct));
+      if (windows == NULL) return;
+      memset(&windows[w->window_count], 0, (count-w->window_count)*sizeof(window_struct));
+      w->windows=windows;
+      w->window_count=count;
+   }
+   w->windows[ndx].count[unit]++;
+   if (spike > w->windows[ndx].max[unit]) w->windows[ndx].max[unit]=spike;
+}
+
+/* Number parsing for the text formats; strtoul() and friends spend most of their time on locale
+   and base handling we don't need.
+*/
+static inline const char *parse_ulong(const char *ptr, const char *end, unsigned long *value, int *ok) {
+   unsigned long v=0L;
+   const char *start;
+   while ((ptr < end) && (*ptr == ' ')) ptr++;
+   start=ptr;
+   while ((ptr < end) && (*ptr >= '0') && (*ptr <= '9')) v=v*10+(unsigned long)(*ptr++ - '0');
+   *ok=(ptr != start);
+   *value=v;
+   return ptr;
+}
+
+/* Elapsed time as printed by print_spike(): seconds, a '.', and 6 or 9 digits */
+static inline const char *parse_elapsed(const char *ptr, const char *end, unsigned long *nsec, int *ok) {
+   unsigned long seconds, fraction=0L;
+   int digits=0;
+   ptr=parse_ulong(ptr, end, &seconds, ok);
+   if ((*ok == 0) || (ptr >= end) || (*ptr != '.')) {
+      *ok=0;
+      return ptr;
+   }
+   for (ptr++; (ptr < end) && (*ptr >= '0') && (*ptr <= '9'); ptr++) {
+      if (digits++ < 9) fraction=fraction*10+(unsigned long)(*ptr - '0');
+   }
+   for (; digits < 9; digits++) fraction*=10;
+   *nsec=seconds*1000000000UL+fraction;
+   return ptr;
+}
+
+static inline void parse_csv_line(worker_struct *w, input_file_struct *f, const char *ptr, const char *end) {
+   unsigned long cpu=0L, time, spike, nsec;
+   int ok, stream=-1, field;
+   const char *flag;
+/* A migration's "spike" is the difference between two CPUs' TSCs, not a latency */
+   if (f->migration_column >= 0) {
+      for (flag=ptr, field=0; (flag < end) && (field < f->migration_column); flag++) if (*flag == ',') field++;
+      if ((flag < end) && (*flag == '1')) return;
+   }
+   if (f->cpu_column) {
+      ptr=parse_ulong(ptr, end, &cpu, &ok);
+      if ((ok == 0) || (ptr >= end) || (*ptr++ != ',')) return;
+      stream=(int)cpu;
+   }
+   ptr=parse_elapsed(ptr, end, &time, &ok);
+   if ((ok == 0) || (ptr >= end) || (*ptr++ != ',')) return;
+   ptr=parse_ulong(ptr, end, &spike, &ok);
+   if (ok == 0) return;
+   if (f->nsec_column) {
+      if ((ptr >= end) || (*ptr++ != ',')) return;
+      parse_ulong(ptr, end, &nsec, &ok);
+      if (ok == 0) return;
+      spike=nsec;
+   }
+   record_spike(w, stream, f->unit, time, spike*f->spike_scale);
+}
+
+static inline const char *find_tag(const char *ptr, const char *end, const char *tag, size_t len) {
+   const char *found=(const char *)memmem(ptr, end-ptr, tag, len);
+   return (found == NULL) ? NULL : found+len;
+}
+
+static inline void parse_xml_line(worker_struct *w, input_file_struct *f, const char *ptr, const char *end) {
+   unsigned long cpu, time, spike, nsec;
+   const char *field;
+   int ok, stream=-1;
+   if (find_tag(ptr, end, "<migration>1<", 12) != NULL) return;
+   if ((field=find_tag(ptr, end, "<elapsed>", 9)) == NULL) return;
+   parse_elapsed(field, end, &time, &ok);
+   if (ok == 0) return;
+   if ((field=find_tag(ptr, end, "<spike>", 7)) == NULL) return;
+   parse_ulong(field, end, &spike, &ok);
+   if (ok == 0) return;
+   if ((f->nsec_column) && ((field=find_tag(ptr, end, "<spike_nsec>", 12)) != NULL)) {
+      parse_ulong(field, end, &nsec, &ok);
+      if (ok) spike=nsec;
+   }
+   if ((f->cpu_column) && ((field=find_tag(ptr, end, "<cpu>", 5)) != NULL)) {
+      parse_ulong(field, end, &cpu, &ok);
+      if (ok) stream=(int)cpu;
+   }
+   record_spike(w, stream, f->unit, time, spike*f->spike_scale);
+}
+
+static void parse_chunk(worker_struct *w, chunk_struct *c) {
+   input_file_struct *f=&files[c->file];
+   const char *ptr=f->map+c->begin, *end=f->map+c->end, *eol;
+   unsigned long before=w->spike_count[NSEC_UNIT]+w->spike_count[CYCLE_UNIT];
+   int ndx;
+   w->seen_count=0;
+   if (f->kind == BINARY_FILE) {
+      const spike_data_struct *spike;
+      for (spike=(const spike_data_struct *)ptr; spike<(const spike_data_struct *)end; spike++) {
+/* A migration's "spike" is the difference between two CPUs' TSCs, not a latency */
+         if (spike->flags & SPIKE_FLAG_MIGRATION) continue;
+         if (f->nsec_per_cycle > 0.0)
+            record_spike(w, (int)spike->cpu, NSEC_UNIT, spike->time, (unsigned long)(spike->spike*f->nsec_per_cycle+0.5));
+         else
+            record_spike(w, (int)spike->cpu, f->unit, spike->time, spike->spike);
+      }
+   } else {
+/* A line belongs to the chunk its first byte is in */
+      if (c->begin > f->data_offset) {
+         while ((ptr < end) && (ptr[-1] != '\n')) ptr++;
+      }
+      end=f->map+f->size;
+      while (ptr < f->map+c->end) {
+         eol=(const char *)memchr(ptr, '\n', end-ptr);
+         if (eol == NULL) eol=end;
+         if (f->kind == CSV_FILE) {
+            if ((*ptr == ' ') || ((*ptr >= '0') && (*ptr <= '9'))) parse_csv_line(w, f, ptr, eol);
+         } else {
+            if ((eol-ptr > 20) && (memchr(ptr, '<', eol-ptr) != NULL)) parse_xml_line(w, f, ptr, eol);
+         }
+         ptr=eol+1;
+      }
+   }
+   c->spikes=w->spike_count[NSEC_UNIT]+w->spike_count[CYCLE_UNIT]-before;
+   c->edge_count=w->seen_count;
+   c->edges=(stream_edge_struct *)malloc(w->seen_count*sizeof(stream_edge_struct));
+   for (ndx=0; ndx<w->seen_count; ndx++) {
+      int stream=w->seen_list[ndx];
+      if (c->edges != NULL) {
+         c->edges[ndx].stream=stream;
+         c->edges[ndx].unit=w->unit[stream];
+         c->edges[ndx].first=w->first[stream];
+         c->edges[ndx].last=w->last[stream];
+      }
+      w->seen[stream]=0;
+   }
+   if (c->edges == NULL) c->edge_count=0;
+}
+
+static void *worker_thread(void *arg) {
+   worker_struct *w=(worker_struct *)arg;
+   int this;
+   while ((this=__atomic_fetch_add(&next_chunk, 1, __ATOMIC_RELAXED)) < chunk_count) parse_chunk(w, &chunks[this]);
+   return NULL;
+}
+
+/* Work out what kind of file this is and where its spikes are, and cut it into chunks */
+static int open_input(input_file_struct *f, const char *path) {
+   struct stat st;
+   const char *header, *ptr;
+   int fd;
+   memset(f, 0, sizeof(input_file_struct));
+   f->path=path;
+   fd=open(path, O_RDONLY);
+   if ((fd < 0) || (fstat(fd, &st) != 0)) {
+      fprintf(stderr, "unable to open \"%s\": %s\n", path, strerror(errno));
+      if (fd >= 0) close(fd);
+      return -1;
+   }
+   f->size=st.st_size;
+   if (f->size == 0) {
+      close(fd);
+      return 0;
+   }
+   f->map=(const char *)mmap(NULL, f->size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (f->map == MAP_FAILED) {
+      fprintf(stderr, "unable to map \"%s\": %s\n", path, strerror(errno));
+      f->map=NULL;
+      return -1;
+   }
+   madvise((void *)f->map, f->size, MADV_SEQUENTIAL|MADV_WILLNEED);
+   f->unit=NSEC_UNIT;
+   f->spike_scale=1;
+   f->migration_column=-1;
+   if ((f->size >= SPIKE_LOG_HEADER_SIZE) && (memcmp(f->map, SPIKE_LOG_MAGIC, sizeof(SPIKE_LOG_MAGIC)) == 0)) {
+      const spike_log_header_struct *h=(const spike_log_header_struct *)f->map;
+      unsigned long records;
+      if ((h->version != SPIKE_LOG_VERSION) || (h->record_size != sizeof(spike_data_struct))) {
+         fprintf(stderr, "\"%s\" is a version %u spike log with %u-byte records; only version %d is understood\n", path, h->version, h->record_size, SPIKE_LOG_VERSION);
+         return -1;
+      }
+      f->kind=BINARY_FILE;
+      f->data_offset=h->header_size;
+/* A log from a run that was killed is still mapped out to the end of its last extent */
+      records=(f->size-h->header_size)/sizeof(spike_data_struct);
+      if (h->records < records) records=h->records;
+      f->size=h->header_size+records*sizeof(spike_data_struct);
+      if (strcmp(h->spike_unit, "cycle") == 0) {
+         f->unit=CYCLE_UNIT;
+         f->nsec_per_cycle=h->nsec_per_cycle;
+      }
+      return 0;
+   }
+   for (ptr=f->map; (ptr < f->map+f->size) && ((*ptr == ' ') || (*ptr == '\n')); ptr++) ;
+   f->kind=((ptr < f->map+f->size) && (*ptr == '<')) ? XML_FILE : CSV_FILE;
+/* print_spike_header() comes before the first spike, in both formats */
+   header=(const char *)memmem(f->map, f->size, "Elapsed time (seconds),latency spike (", 38);
+   if (header == NULL) {
+      f->data_offset=f->size;
+      return 0;
+   }
+   f->cpu_column=((header-f->map >= 4) && (memcmp(header-4, "CPU,", 4) == 0));
+   ptr=header+38;
+   if (strncmp(ptr, "usec)", 5) == 0) f->spike_scale=1000;
+   else if (strncmp(ptr, "cycle)", 6) == 0) f->unit=CYCLE_UNIT;
+   f->nsec_column=(strncmp(strchr(ptr, ')'), "),latency spike (nsec)", 22) == 0);
+   if (f->nsec_column) f->unit=NSEC_UNIT;
+   ptr=(const char *)memchr(header, '\n', f->size-(header-f->map));
+   f->data_offset=(ptr == NULL) ? f->size : (size_t)(ptr+1-f->map);
+/* The cycles and memchase methods add a "migration" column; count the fields before it */
+   if (f->kind == CSV_FILE) {
+      const char *line=f->cpu_column ? header-4 : header, *eol=(ptr == NULL) ? f->map+f->size : ptr, *column;
+      int field=0;
+      column=(const char *)memmem(line, eol-line, ",migration,", 11);
+      if (column != NULL) {
+         for (; line <= column; line++) if (*line == ',') field++;
+         f->migration_column=field;
+      }
+   }
+   return 0;
+}
+
+static int add_chunks(int file) {
+   input_file_struct *f=&files[file];
+   size_t begin, step=CHUNK_BYTES;
+   chunk_struct *more;
+   if (f->kind == BINARY_FILE) step-=step%sizeof(spike_data_struct);
+   for (begin=f->data_offset; begin<f->size; begin+=step) {
+      more=(chunk_struct *)realloc(chunks, (chunk_count+1)*sizeof(chunk_struct));
+      if (more == NULL) return -1;
+      chunks=more;
+      memset(&chunks[chunk_count], 0, sizeof(chunk_struct));
+      chunks[chunk_count].file=file;
+      chunks[chunk_count].begin=begin;
+      chunks[chunk_count].end=(begin+step < f->size) ? begin+step : f->size;
+      chunk_count++;
+   }
+   return 0;
+}
+
+/* The gaps between the last spike on a stream in one chunk and the first on it in a later chunk of the
+   same file.  Chunks were created in file order, so walking them in order sees each stream in time order.
+*/
+static void stitch_gaps(worker_struct *total) {
+   unsigned long *last;
+   int *have, this, ndx, file=-1;
+   last=(unsigned long *)calloc(MAX_STREAMS, sizeof(unsigned long));
+   have=(int *)calloc(MAX_STREAMS, sizeof(int));
+   if ((last == NULL) || (have == NULL)) {
+      perror("unable to allocate memory to join the chunks");
+      free(last);
+      free(have);
+      return;
+   }
+   for (this=0; this<chunk_count; this++) {
+      chunk_struct *c=&chunks[this];
+      if (c->file != file) {
+         memset(have, 0, MAX_STREAMS*sizeof(int));
+         file=c->file;
+      }
+      for (ndx=0; ndx<c->edge_count; ndx++) {
+         stream_edge_struct *e=&c->edges[ndx];
+         if ((have[e->stream]) && (e->first >= last[e->stream])) {
+            unsigned long gap=e->first-last[e->stream];
+            hist_record(&total->gaps[e->unit], gap);
+            total->gap_count[e->unit]++;
+            if (gap > total->max_gap[e->unit]) total->max_gap[e->unit]=gap;
+         }
+         have[e->stream]=1;
+         last[e->stream]=e->last;
+      }
+   }
+   free(last);
+   free(have);
+}
+
+static void print_distribution(const char *name, const char *unit, histogram_struct *hist, unsigned long count, unsigned long maximum) {
+   static const double percentiles[]={50.0, 90.0, 99.0, 99.9, 99.99, 99.999};
+   unsigned int ndx, pct;
+   if (count == 0) return;
+   if (format == CSV_FORMAT) {
+      printf("%s,percentile,value (%s)\n", name, unit);
+      printf("%s,count,%lu\n", name, count);
+   } else if (format == XML_FORMAT) {
+      printf("      <%s>\n         <count>%lu</count><units>%s</units>\n", name, count, unit);
+   } else {
+      printf("%s:  %lu\n", name, count);
+   }
+   for (pct=0; pct<sizeof(percentiles)/sizeof(percentiles[0]); pct++) {
+      unsigned long value=hist_percentile(hist, count, percentiles[pct], maximum);
+      if (format == CSV_FORMAT) printf("%s,p%g,%lu\n", name, percentiles[pct], value);
+      else if (format == XML_FORMAT) printf("         <percentile><p>%g</p><value>%lu</value></percentile>\n", percentiles[pct], value);
+      else printf("   p%-7g <= %lu %s\n", percentiles[pct], value, unit);
+   }
+   if (format == CSV_FORMAT) printf("%s,maximum,%lu\n", name, maximum);
+   else if (format == XML_FORMAT) printf("         <maximum>%lu</maximum>\n", maximum);
+   else printf("   maximum  = %lu %s\n", maximum, unit);
+   if (chatty >= 2) {
+      if (format == CSV_FORMAT) printf("%s,bucket low (%s),bucket high (%s),count\n", name, unit, unit);
+      else if (format == FREEFORM_FORMAT) printf("   %12s %12s %14s\n", "low", "high", "count");
+      for (ndx=0; ndx<HIST_BUCKETS; ndx++) {
+         if (hist->count[ndx] == 0) continue;
+         if (format == CSV_FORMAT) printf("%s,%lu,%lu,%lu\n", name, hist_low(ndx), hist_high(ndx), hist->count[ndx]);
+         else if (format == XML_FORMAT) printf("         <bucket><low>%lu</low><high>%lu</high><count>%lu</count></bucket>\n", hist_low(ndx), hist_high(ndx), hist->count[ndx]);
+         else printf("   %12lu %12lu %14lu\n", hist_low(ndx), hist_high(ndx), hist->count[ndx]);
+      }
+   }
+   if (format == XML_FORMAT) printf("      </%s>\n", name);
+}
+
+static void print_windows(worker_struct *total, int unit) {
+   unsigned long ndx;
+   int header_printed=0;
+   for (ndx=0; ndx<total->window_count; ndx++) {
+      window_struct *win=&total->windows[ndx];
+      if (win->count[unit] == 0) continue;
+      if (header_printed == 0) {
+         if (format == CSV_FORMAT) printf("window start (seconds),spikes,maximum spike (%s)\n", unit_names[unit]);
+         else if (format == XML_FORMAT) printf("      <windows><seconds>%lu</seconds><units>%s</units>\n", window_nsec/1000000000UL, unit_names[unit]);
+         else printf("Windows of %lu seconds:\n   %12s %12s %14s\n", window_nsec/1000000000UL, "start", "spikes", "maximum");
+         header_printed=1;
+      }
+      if (format == CSV_FORMAT) printf("%lu,%lu,%lu\n", ndx*(window_nsec/1000000000UL), win->count[unit], win->max[unit]);
+      else if (format == XML_FORMAT) printf("         <window><start>%lu</start><spikes>%lu</spikes><maximum>%lu</maximum></window>\n", ndx*(window_nsec/1000000000UL), win->count[unit], win->max[unit]);
+      else printf("   %12lu %12lu %14lu\n", ndx*(window_nsec/1000000000UL), win->count[unit], win->max[unit]);
+   }
+   if ((header_printed) && (format == XML_FORMAT)) printf("      </windows>\n");
+}
+
+/* "--periods".  PERIOD_BINS bins of PERIOD_BIN_NSEC make a segment of about 33 seconds; the lowest
+   frequency looked at has PERIOD_MIN_CYCLES cycles in a segment.  A peak has to stand PERIOD_SIGMAS standard
+   deviations above what the same bursts at random times would give, and reach PERIOD_MIN_AMPLITUDE.  Peaks
+   closer than PERIOD_SPREAD (relative) or PERIOD_SPREAD_BINS are taken to be one; a harmonic has to be within
+   PERIOD_SPREAD or PERIOD_HARMONIC_BINS (plus a little for each multiple) of a multiple of its fundamental.
+*/
+#define PERIOD_BIN_NSEC      125000UL
+#define PERIOD_BINS          (1U<<18)
+#define PERIOD_MIN_CYCLES    3
+#define PERIOD_SIGMAS        6.0
+#define PERIOD_MIN_AMPLITUDE 0.02
+#define PERIOD_SPREAD        0.0005
+#define PERIOD_SPREAD_BINS   4.0
+#define PERIOD_HARMONIC_BINS 1.0
+#define PERIOD_SUBHARMONICS  8
+#define PERIODS_REPORTED     8
+
+typedef struct period_worker {
+   double *z;                          /* PERIOD_BINS complex values: arrivals + i*stall */
+   double *arrivals;                   /* |FFT| of the arrivals, summed over segments, per frequency bin */
+   double *stall;
+   double weight[2];                   /* the window-weighted arrivals and stall, summed over segments */
+   double noise[2];                    /* sqrt of the sums of their squares, summed over segments */
+   double square[2];                   /* the sums of their squares, summed over segments */
+   pthread_t thread;
+} __attribute__ ((aligned (CACHE_LINE_SIZE))) period_worker_struct;
+
+typedef struct period {
+   double frequency;
+   double amplitude;                   /* the fraction of the bursts that line up with it */
+   double share;                       /* the fraction of the stall time */
+   unsigned int bin;
+   int by_stall;                       /* found in the stall spectrum rather than the arrivals */
+   int harmonic;
+} period_struct;
+
+static burst_struct *bursts;
+static unsigned long burst_count;
+static unsigned long *segment_first;   /* the first burst of each segment; one more entry ends the last */
+static unsigned long segment_count;
+static unsigned long next_segment;
+static double *twiddle;                /* exp(-2*pi*i*k/PERIOD_BINS) for k < PERIOD_BINS/2 */
+static double *hann;
+
+static int compare_events(const void *a, const void *b) {
+   unsigned long x=((const event_struct *)a)->time-((const event_struct *)a)->spike;
+   unsigned long y=((const event_struct *)b)->time-((const event_struct *)b)->spike;
+   return (x < y) ? -1 : (x > y);
+}
+
+/* Every worker's events in time order (by the start of the spike), grouped into bursts */
+static int make_bursts(worker_struct *workers, int jobs) {
+   event_struct *events;
+   unsigned long count=0L, ndx, start;
+   int this;
+   for (this=0; this<jobs; this++) count+=workers[this].event_count;
+   if (count == 0) return 0;
+   events=(event_struct *)malloc(count*sizeof(event_struct));
+   bursts=(burst_struct *)malloc(count*sizeof(burst_struct));
+   if ((events == NULL) || (bursts == NULL)) return -1;
+   for (count=0, this=0; this<jobs; this++) {
+      memcpy(&events[count], workers[this].events, workers[this].event_count*sizeof(event_struct));
+      count+=workers[this].event_count;
+      free(workers[this].events);
+      workers[this].events=NULL;
+   }
+   qsort(events, count, sizeof(event_struct), compare_events);
+   for (ndx=0; ndx<count; ndx++) {
+      start=(events[ndx].time > events[ndx].spike) ? events[ndx].time-events[ndx].spike : 0L;
+      if ((burst_count == 0) || (start > bursts[burst_count-1].end+burst_gap_nsec)) {
+         bursts[burst_count].start=start;
+         bursts[burst_count].end=events[ndx].time;
+         bursts[burst_count].stall=0L;
+         bursts[burst_count].spikes=0L;
+         burst_count++;
+      }
+      if (events[ndx].time > bursts[burst_count-1].end) bursts[burst_count-1].end=events[ndx].time;
+      bursts[burst_count-1].stall+=events[ndx].spike;
+      bursts[burst_count-1].spikes++;
+   }
+   free(events);
+   return 0;
+}
+
+/* In-place radix-2 FFT of PERIOD_BINS interleaved complex values */
+static void fft(double *z) {
+   unsigned int n=PERIOD_BINS, i, j, bit, len, half, k, step;
+   double re, im, tr, ti;
+   for (i=1, j=0; i<n; i++) {
+      for (bit=n>>1; j & bit; bit>>=1) j^=bit;
+      j^=bit;
+      if (i < j) {
+         tr=z[2*i]; z[2*i]=z[2*j]; z[2*j]=tr;
+         ti=z[2*i+1]; z[2*i+1]=z[2*j+1]; z[2*j+1]=ti;
+      }
+   }
+   for (len=2; len<=n; len<<=1) {
+      half=len>>1;
+      step=n/len;
+      for (i=0; i<n; i+=len) {
+         for (k=0; k<half; k++) {
+            double *u=&z[2*(i+k)], *v=&z[2*(i+k+half)];
+            re=twiddle[2*k*step];
+            im=twiddle[2*k*step+1];
+            tr=v[0]*re-v[1]*im;
+            ti=v[0]*im+v[1]*re;
+            v[0]=u[0]-tr;
+            v[1]=u[1]-ti;
+            u[0]+=tr;
+            u[1]+=ti;
+         }
+      }
+   }
+}
+
+/* One segment: the arrivals go in the real part and the stall (in usecs) in the imaginary part, and the
+   two spectra are separated again with Z(k) and the conjugate of Z(n-k)
+*/
+static void period_segment(period_worker_struct *p, unsigned long segment) {
+   unsigned long ndx, origin=segment*PERIOD_BINS*PERIOD_BIN_NSEC;
+   unsigned int bin, k;
+   double h, w, sum_h=0.0, sum_hh=0.0, sum_hw=0.0, sum_hwhw=0.0;
+   double ar, ai, dr, di;
+   memset(p->z, 0, 2*PERIOD_BINS*sizeof(double));
+   for (ndx=segment_first[segment]; ndx<segment_first[segment+1]; ndx++) {
+      bin=(unsigned int)((bursts[ndx].start-origin)/PERIOD_BIN_NSEC);
+      h=hann[bin];
+      w=h*(double)bursts[ndx].stall/1000.0;
+      p->z[2*bin]+=h;
+      p->z[2*bin+1]+=w;
+      sum_h+=h;
+      sum_hh+=h*h;
+      sum_hw+=w;
+      sum_hwhw+=w*w;
+   }
+   if (sum_h <= 0.0) return;
+   fft(p->z);
+   for (k=1; k<PERIOD_BINS/2; k++) {
+      ar=p->z[2*k]+p->z[2*(PERIOD_BINS-k)];
+      ai=p->z[2*k+1]-p->z[2*(PERIOD_BINS-k)+1];
+      dr=p->z[2*k]-p->z[2*(PERIOD_BINS-k)];
+      di=p->z[2*k+1]+p->z[2*(PERIOD_BINS-k)+1];
+      p->arrivals[k]+=0.5*sqrt(ar*ar+ai*ai);
+      p->stall[k]+=0.5*sqrt(dr*dr+di*di);
+   }
+   p->weight[0]+=sum_h;
+   p->weight[1]+=sum_hw;
+   p->noise[0]+=sqrt(sum_hh);
+   p->noise[1]+=sqrt(sum_hwhw);
+   p->square[0]+=sum_hh;
+   p->square[1]+=sum_hwhw;
+}
+
+static void *period_thread(void *arg) {
+   period_worker_struct *p=(period_worker_struct *)arg;
+   unsigned long this;
+   while ((this=__atomic_fetch_add(&next_segment, 1, __ATOMIC_RELAXED)) < segment_count) period_segment(p, this);
+   return NULL;
+}
+
+/* Parabolic interpolation between a peak bin and its neighbours */
+static double refine_bin(const double *spectrum, unsigned int bin) {
+   double below=spectrum[bin-1], at=spectrum[bin], above=spectrum[bin+1], curve=below-2.0*at+above;
+   if (curve >= 0.0) return (double)bin;
+   return (double)bin+0.5*(below-above)/curve;
+}
+
+static int compare_strength(const void *a, const void *b) {
+   double x=((const period_struct *)a)->amplitude+((const period_struct *)a)->share;
+   double y=((const period_struct *)b)->amplitude+((const period_struct *)b)->share;
+   return (x > y) ? -1 : (x < y);
+}
+
+static int compare_periods(const void *a, const void *b) {
+   double x=((const period_struct *)a)->share, y=((const period_struct *)b)->share;
+   return (x > y) ? -1 : (x < y);
+}
+
+static void print_bursts(void) {
+   unsigned long ndx, multi=0L, max_spikes=0L, longest=0L, biggest=0L, stall=0L, spikes=0L;
+   for (ndx=0; ndx<burst_count; ndx++) {
+      burst_struct *b=&bursts[ndx];
+      spikes+=b->spikes;
+      stall+=b->stall;
+      if (b->spikes > 1) multi++;
+      if (b->spikes > max_spikes) max_spikes=b->spikes;
+      if (b->end-b->start > longest) longest=b->end-b->start;
+      if (b->stall > biggest) biggest=b->stall;
+   }
+   if (format == CSV_FORMAT) {
+      printf("bursts,spikes,bursts of more than one spike,most spikes in a burst,longest burst (nsec),largest burst stall (nsec),stall (nsec)\n");
+      printf("%lu,%lu,%lu,%lu,%lu,%lu,%lu\n", burst_count, spikes, multi, max_spikes, longest, biggest, stall);
+   } else if (format == XML_FORMAT) {
+      printf("      <bursts><gap>%lu</gap><count>%lu</count><spikes>%lu</spikes><multiple>%lu</multiple><most_spikes>%lu</most_spikes><longest>%lu</longest><largest_stall>%lu</largest_stall><stall>%lu</stall></bursts>\n",
+             burst_gap_nsec, burst_count, spikes, multi, max_spikes, longest, biggest, stall);
+   } else {
+      printf("Bursts (spikes within %lu nsec of each other):  %lu from %lu spikes, %lu of more than one spike\n", burst_gap_nsec, burst_count, spikes, multi);
+      printf("   most spikes in a burst = %lu, longest burst = %lu nsec, largest burst stall = %lu nsec, total stall = %lu nsec\n", max_spikes, longest, biggest, stall);
+   }
+}
+
+static void print_periods(period_struct *periods, int count, unsigned long stall) {
+   int ndx;
+   if (format == CSV_FORMAT) printf("period (msec),frequency (Hz),amplitude (%% of bursts),share of stall (%%),stall (nsec)\n");
+   else if (format == XML_FORMAT) printf("      <periods>\n");
+   else if (count == 0) printf("No periodic bursts found\n");
+   else printf("Periods:\n   %14s %12s %12s %12s %16s\n", "period (msec)", "Hz", "amplitude", "stall share", "stall (nsec)");
+   for (ndx=0; ndx<count; ndx++) {
+      period_struct *p=&periods[ndx];
+      double period_msec=1000.0/p->frequency;
+      unsigned long period_stall=(unsigned long)(p->share*(double)stall);
+      if (format == CSV_FORMAT) printf("%.4f,%.4f,%.1f,%.1f,%lu\n", period_msec, p->frequency, 100.0*p->amplitude, 100.0*p->share, period_stall);
+      else if (format == XML_FORMAT) printf("         <period><msec>%.4f</msec><hz>%.4f</hz><amplitude>%.3f</amplitude><share>%.3f</share><stall>%lu</stall></period>\n", period_msec, p->frequency, p->amplitude, p->share, period_stall);
+      else printf("   %14.4f %12.4f %11.1f%% %11.1f%% %16lu\n", period_msec, p->frequency, 100.0*p->amplitude, 100.0*p->share, period_stall);
+   }
+   if (format == XML_FORMAT) printf("      </periods>\n");
+}
+
+/* The spectra of all the segments, their peaks, and the peaks that are not harmonics of another */
+static void find_periods(worker_struct *workers, int worker_count, int jobs) {
+   period_worker_struct *pw;
+   period_struct *peaks=NULL, reported[PERIODS_REPORTED];
+   double *arrivals, *stall, weight[2]={0.0, 0.0}, noise[2]={0.0, 0.0}, square[2]={0.0, 0.0}, threshold[2], evidence[2], segment_seconds, span;
+   unsigned long ndx, segment, total_stall=0L;
+   unsigned int k, min_bin=PERIOD_MIN_CYCLES, peak_count=0, this, other;
+   int rv, w, reported_count=0;
+
+   if (make_bursts(workers, worker_count) != 0) {
+      perror("unable to allocate memory for the bursts");
+      return;
+   }
+   if (chatty >= 1) print_bursts();
+   if (burst_count == 0) return;
+   for (ndx=0; ndx<burst_count; ndx++) total_stall+=bursts[ndx].stall;
+   segment_count=bursts[burst_count-1].start/(PERIOD_BINS*PERIOD_BIN_NSEC)+1;
+   segment_first=(unsigned long *)calloc(segment_count+1, sizeof(unsigned long));
+   twiddle=(double *)malloc(PERIOD_BINS*sizeof(double));
+   hann=(double *)malloc(PERIOD_BINS*sizeof(double));
+   arrivals=(double *)calloc(PERIOD_BINS/2, sizeof(double));
+   stall=(double *)calloc(PERIOD_BINS/2, sizeof(double));
+   pw=(period_worker_struct *)calloc(jobs, sizeof(period_worker_struct));
+   if ((segment_first == NULL) || (twiddle == NULL) || (hann == NULL) || (arrivals == NULL) || (stall == NULL) || (pw == NULL)) {
+      perror("unable to allocate memory for the periods");
+      return;
+   }
+   for (segment=0, ndx=0; segment<=segment_count; segment++) {
+      while ((ndx < burst_count) && (bursts[ndx].start < segment*PERIOD_BINS*PERIOD_BIN_NSEC)) ndx++;
+      segment_first[segment]=ndx;
+   }
+   for (k=0; k<PERIOD_BINS/2; k++) {
+      twiddle[2*k]=cos(2.0*M_PI*k/PERIOD_BINS);
+      twiddle[2*k+1]=-sin(2.0*M_PI*k/PERIOD_BINS);
+   }
+   for (k=0; k<PERIOD_BINS; k++) hann[k]=0.5-0.5*cos(2.0*M_PI*k/PERIOD_BINS);
+
+/* The segments are shared out among threads the way the chunks were */
+   if ((unsigned long)jobs > segment_count) jobs=(int)segment_count;
+   for (w=0; w<jobs; w++) {
+      pw[w].z=(double *)malloc(2*PERIOD_BINS*sizeof(double));
+      pw[w].arrivals=(double *)calloc(PERIOD_BINS/2, sizeof(double));
+      pw[w].stall=(double *)calloc(PERIOD_BINS/2, sizeof(double));
+      if ((pw[w].z == NULL) || (pw[w].arrivals == NULL) || (pw[w].stall == NULL)) {
+         perror("unable to allocate memory for the periods");
+         return;
+      }
+      rv=pthread_create(&pw[w].thread, NULL, period_thread, &pw[w]);
+      if (rv != 0) {
+         fprintf (stderr, "unable to start period worker %d: %s\n", w, strerror(rv));
+         exit (1);
+      }
+   }
+   for (w=0; w<jobs; w++) {
+      pthread_join(pw[w].thread, NULL);
+      for (k=1; k<PERIOD_BINS/2; k++) {
+         arrivals[k]+=pw[w].arrivals[k];
+         stall[k]+=pw[w].stall[k];
+      }
+      weight[0]+=pw[w].weight[0];
+      weight[1]+=pw[w].weight[1];
+      noise[0]+=pw[w].noise[0];
+      noise[1]+=pw[w].noise[1];
+      square[0]+=pw[w].square[0];
+      square[1]+=pw[w].square[1];
+      free(pw[w].z);
+      free(pw[w].arrivals);
+      free(pw[w].stall);
+   }
+   free(pw);
+   if (weight[0] <= 0.0) return;
+   for (k=1; k<PERIOD_BINS/2; k++) {
+      arrivals[k]/=weight[0];
+      stall[k]=(weight[1] > 0.0) ? stall[k]/weight[1] : 0.0;
+   }
+/* At a frequency they don't line up with, a segment's bursts add up to a Rayleigh-distributed magnitude with
+   a mean of 0.886 and a standard deviation of 0.463 times the square root of the sum of their squared weights
+*/
+   threshold[0]=(0.886*noise[0]+PERIOD_SIGMAS*0.463*sqrt(square[0]))/weight[0];
+   threshold[1]=(weight[1] > 0.0) ? (0.886*noise[1]+PERIOD_SIGMAS*0.463*sqrt(square[1]))/weight[1] : 1.0;
+   evidence[0]=(0.886*noise[0]+0.5*PERIOD_SIGMAS*0.463*sqrt(square[0]))/weight[0];
+   evidence[1]=(weight[1] > 0.0) ? (0.886*noise[1]+0.5*PERIOD_SIGMAS*0.463*sqrt(square[1]))/weight[1] : 1.0;
+   if (threshold[0] < PERIOD_MIN_AMPLITUDE) threshold[0]=PERIOD_MIN_AMPLITUDE;
+   if (threshold[1] < PERIOD_MIN_AMPLITUDE) threshold[1]=PERIOD_MIN_AMPLITUDE;
+   segment_seconds=(double)PERIOD_BINS*(double)PERIOD_BIN_NSEC/1e9;
+   if (chatty >= 2) {
+      if (format == CSV_FORMAT) printf("segments,segment (seconds),bin (nsec),arrival threshold,stall threshold\n%lu,%.3f,%lu,%.4f,%.4f\n", segment_count, segment_seconds, PERIOD_BIN_NSEC, threshold[0], threshold[1]);
+      else if (format == XML_FORMAT) printf("      <spectrum><segments>%lu</segments><segment_seconds>%.3f</segment_seconds><bin>%lu</bin><thresholds>%.4f %.4f</thresholds></spectrum>\n", segment_count, segment_seconds, PERIOD_BIN_NSEC, threshold[0], threshold[1]);
+      else printf("%lu segments of %.3f seconds in %lu nsec bins; peaks must reach %.4f of the bursts or %.4f of the stall\n", segment_count, segment_seconds, PERIOD_BIN_NSEC, threshold[0], threshold[1]);
+   }
+
+/* A run shorter than a segment needs PERIOD_MIN_CYCLES of a period in the time it covered */
+   span=(double)(bursts[burst_count-1].start-bursts[0].start)/1e9;
+   if ((span > 0.0) && (span < segment_seconds)) min_bin=(unsigned int)ceil(PERIOD_MIN_CYCLES*segment_seconds/span);
+/* Local maxima of either spectrum above its threshold; neighbours within the window's main lobe are one peak */
+   for (k=min_bin; k<PERIOD_BINS/2-1; k++) {
+      int arrival_peak=(arrivals[k] >= threshold[0]) && (arrivals[k] >= arrivals[k-1]) && (arrivals[k] > arrivals[k+1]);
+      int stall_peak=(stall[k] >= threshold[1]) && (stall[k] >= stall[k-1]) && (stall[k] > stall[k+1]);
+      period_struct *more;
+      if ((arrival_peak == 0) && (stall_peak == 0)) continue;
+      if ((peak_count > 0) && (k-peaks[peak_count-1].bin <= 2)) {
+         if (arrivals[k]+stall[k] <= peaks[peak_count-1].amplitude+peaks[peak_count-1].share) continue;
+         peak_count--;
+      }
+      more=(period_struct *)realloc(peaks, (peak_count+1)*sizeof(period_struct));
+      if (more == NULL) break;
+      peaks=more;
+      peaks[peak_count].bin=k;
+      peaks[peak_count].frequency=refine_bin(arrival_peak ? arrivals : stall, k)/segment_seconds;
+      peaks[peak_count].amplitude=arrivals[k];
+      peaks[peak_count].share=stall[k];
+      peaks[peak_count].by_stall=(arrival_peak == 0);
+      peaks[peak_count].harmonic=0;
+      peak_count++;
+   }
+/* With few cycles in a segment the window can leave a train's fundamental just under the threshold while
+   some of its harmonics make it.  A peak whose frequency divided by 2 .. PERIOD_SUBHARMONICS is still clearly
+   above the noise there, and at least half as strong, is moved down to that frequency.
+*/
+   for (this=0; this<peak_count; this++) {
+      const double *spectrum=peaks[this].by_stall ? stall : arrivals;
+      double value=peaks[this].by_stall ? peaks[this].share : peaks[this].amplitude;
+      int divisor;
+      for (divisor=PERIOD_SUBHARMONICS; divisor>=2; divisor--) {
+         double fundamental, spread;
+         unsigned int low=(unsigned int)(peaks[this].frequency*segment_seconds/divisor+0.5);
+         if (low < min_bin+1) continue;
+         k=low;
+         if (spectrum[low-1] > spectrum[k]) k=low-1;
+         if (spectrum[low+1] > spectrum[k]) k=low+1;
+         if ((spectrum[k] < spectrum[k-1]) || (spectrum[k] < spectrum[k+1])) continue;
+         if ((spectrum[k] < evidence[peaks[this].by_stall]) || (2.0*spectrum[k] < value)) continue;
+         fundamental=refine_bin(spectrum, k)/segment_seconds;
+         spread=(PERIOD_HARMONIC_BINS+0.05*divisor)/segment_seconds+PERIOD_SPREAD*peaks[this].frequency;
+         if (fabs(peaks[this].frequency-divisor*fundamental) > spread) continue;
+         peaks[this].bin=k;
+         peaks[this].frequency=fundamental;
+         peaks[this].amplitude=arrivals[k];
+         peaks[this].share=stall[k];
+         break;
+      }
+   }
+/* A train of bursts with period P shows up at every multiple of 1/P too, and a strong peak leaks into
+   lesser ones around it.  Taking the peaks strongest first, one near another that is stronger is dropped;
+   so is one near a multiple of a lower one that is no stronger in either spectrum.
+*/
+   qsort(peaks, peak_count, sizeof(period_struct), compare_strength);
+   for (this=0; this<peak_count; this++) {
+      for (other=0; other<peak_count; other++) {
+         double ratio, multiple, spread;
+         if ((other == this) || peaks[other].harmonic) continue;
+         ratio=peaks[this].frequency/peaks[other].frequency;
+         multiple=floor(ratio+0.5);
+         if (multiple < 1.0) continue;
+         spread=((multiple <= 1.0) ? PERIOD_SPREAD_BINS : PERIOD_HARMONIC_BINS+0.05*multiple)/segment_seconds+PERIOD_SPREAD*peaks[this].frequency;
+         if (fabs(peaks[this].frequency-multiple*peaks[other].frequency) > spread) continue;
+         if (((multiple <= 1.0) && (other < this)) ||
+             ((multiple >= 2.0) && (peaks[this].amplitude <= 1.5*peaks[other].amplitude+threshold[0]/PERIOD_SIGMAS) &&
+                                   (peaks[this].share <= 1.5*peaks[other].share+threshold[1]/PERIOD_SIGMAS))) {
+            peaks[this].harmonic=1;
+            break;
+         }
+      }
+   }
+   for (this=0; this<peak_count; this++) {
+      if (peaks[this].harmonic) continue;
+      if (reported_count < PERIODS_REPORTED) reported[reported_count++]=peaks[this];
+   }
+   qsort(reported, reported_count, sizeof(period_struct), compare_periods);
+   print_periods(reported, reported_count, total_stall);
+   free(peaks);
+   free(arrivals);
+   free(stall);
+   free(segment_first);
+   free(twiddle);
+   free(hann);
+}
+
+int main (int argc, char *argv[])
+{
+   int rv, ndx, unit, jobs, period_jobs;
+   worker_struct *workers, *total;
+   struct timespec start, finish;
+   double seconds;
+   unsigned long bytes=0L, spikes=0L;
+   char *endptr;
+
+   struct option long_options[] = {
+      {"jobs",      required_argument, NULL, 'j'},
+      {"window",    required_argument, NULL, 'W'},
+      {"format",    required_argument, NULL, 'f'},
+      {"periods",   no_argument,       NULL, 'P'},
+      {"burst-gap", required_argument, NULL, 'G'},
+      {"Version",   no_argument,       NULL, 'V'},
+      {"verbose",   optional_argument, NULL, 'v'},
+      {"brief",     no_argument,       NULL, 'b'},
+      {"help",      no_argument,       NULL, 'h'},
+      {NULL, 0, NULL, 0} };
+
+   jobs=(int)sysconf(_SC_NPROCESSORS_ONLN);
+   while ( (rv=getopt_long (argc, argv, "j:W:f:PG:Vv::bh?", long_options, NULL)) != -1 ) {
+      switch (rv) {
+         case 'j':
+            jobs=(int)strtol(optarg, &endptr, 10);
+            if ((endptr == optarg) || (*endptr != '\0') || (jobs < 1)) {
+               fprintf (stderr, "illegal value for jobs; specify a number of worker threads\n");
+               exit (1);
+            }
+            break;
+         case 'W':
+            window_nsec=strtoul(optarg, &endptr, 10)*1000000000UL;
+            if ((endptr == optarg) || (*endptr != '\0')) {
+               fprintf (stderr, "illegal value for window; specify a number of seconds\n");
+               exit (1);
+            }
+            break;
+         case 'f':
+            if (strcmp(optarg, "csv") == 0) format=CSV_FORMAT;
+            else if (strcmp(optarg, "xml") == 0) format=XML_FORMAT;
+            else if (strcmp(optarg, "freeform") == 0) format=FREEFORM_FORMAT;
+            else {
+               fprintf (stderr, "illegal value for format; use \"csv\", \"xml\" or \"freeform\"\n");
+               exit (1);
+            }
+            break;
+         case 'P':
+            periods_flag=1;
+            break;
+         case 'G':
+            burst_gap_nsec=strtoul(optarg, &endptr, 10)*1000UL;
+            if ((endptr == optarg) || (*endptr != '\0')) {
+               fprintf (stderr, "illegal value for burst-gap; specify a number of usecs\n");
+               exit (1);
+            }
+            break;
+         case 'V':
+            fprintf (stderr, "hp-timetest-analyze version %d.%d\n", Version.major, Version.minor);
+            exit (0);
+         case 'v':
+            chatty=(optarg == NULL) ? 2 : atoi(optarg);
+            break;
+         case 'b':
+            chatty=0;
+            break;
+         default:
+            printf ("usage:  hp-timetest-analyze [-j,  --jobs #(default=number of online CPUs)]\n"
+                    "        [-W,  --window #(default=60 seconds; 0 for no per-window summary)]\n"
+                    "        [-f,  --format \"csv\"|\"xml\"|\"freeform\"(default=freeform)]\n"
+                    "        [-P,  --periods (group spikes into bursts and look for periodic noise sources)]\n"
+                    "        [-G,  --burst-gap #(default=100 usecs; spikes closer than this are one burst)]\n"
+                    "        [-v#, --verbose[=#(default=1)] [-b, --brief]\n"
+                    "        [-? -h, --help]\n"
+                    "        FILE...\n"
+                    "Each FILE is the output of HP-TimeTest with \"-f csv\" or \"-f xml\", or a binary\n"
+                    "spike log written with \"--log\".\n");
+            exit ((rv == 'h') ? 0 : 1);
+      }
+   }
+   if (optind >= argc) {
+      fprintf (stderr, "no spike files given; see --help\n");
+      exit (1);
+   }
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   file_count=argc-optind;
+   files=(input_file_struct *)calloc(file_count, sizeof(input_file_struct));
+   if (files == NULL) {
+      perror("unable to allocate memory for the file list");
+      exit (1);
+   }
+   for (ndx=0; ndx<file_count; ndx++) {
+      if (open_input(&files[ndx], argv[optind+ndx]) != 0) exit (1);
+      if (add_chunks(ndx) != 0) {
+         perror("unable to allocate memory for the chunk list");
+         exit (1);
+      }
+      bytes+=files[ndx].size;
+   }
+   period_jobs=jobs;
+   if (jobs > chunk_count) jobs=(chunk_count > 0) ? chunk_count : 1;
+
+   rv=posix_memalign((void **)&workers, CACHE_LINE_SIZE, (jobs+1)*sizeof(worker_struct));
+   if (rv != 0) {
+      fprintf (stderr, "unable to allocate memory for %d workers: %s\n", jobs, strerror(rv));
+      exit (1);
+   }
+   memset(workers, 0, (jobs+1)*sizeof(worker_struct));
+   for (ndx=0; ndx<jobs; ndx++) {
+      rv=pthread_create(&workers[ndx].thread, NULL, worker_thread, &workers[ndx]);
+      if (rv != 0) {
+         fprintf (stderr, "unable to start worker %d: %s\n", ndx, strerror(rv));
+         exit (1);
+      }
+   }
+   for (ndx=0; ndx<jobs; ndx++) pthread_join(workers[ndx].thread, NULL);
+
+/* Merge the workers into the spare worker_struct at the end */
+   total=&workers[jobs];
+   for (ndx=0; ndx<jobs; ndx++) {
+      worker_struct *w=&workers[ndx];
+      unsigned long win;
+      for (unit=0; unit<UNITS; unit++) {
+         hist_merge(&total->spikes[unit], &w->spikes[unit]);
+         hist_merge(&total->gaps[unit], &w->gaps[unit]);
+         total->spike_count[unit]+=w->spike_count[unit];
+         total->gap_count[unit]+=w->gap_count[unit];
+         if (w->max_spike[unit] > total->max_spike[unit]) total->max_spike[unit]=w->max_spike[unit];
+         if (w->max_gap[unit] > total->max_gap[unit]) total->max_gap[unit]=w->max_gap[unit];
+      }
+      if (w->window_count > total->window_count) {
+         window_struct *windows=(window_struct *)realloc(total->windows, w->window_count*sizeof(window_struct));
+         if (windows == NULL) continue;
+         memset(&windows[total->window_count], 0, (w->window_count-total->window_count)*sizeof(window_struct));
+         total->windows=windows;
+         total->window_count=w->window_count;
+      }
+      for (win=0; win<w->window_count; win++) {
+         for (unit=0; unit<UNITS; unit++) {
+            total->windows[win].count[unit]+=w->windows[win].count[unit];
+            if (w->windows[win].max[unit] > total->windows[win].max[unit]) total->windows[win].max[unit]=w->windows[win].max[unit];
+         }
+      }
+   }
+   stitch_gaps(total);
+   for (ndx=0; ndx<chunk_count; ndx++) {
+      files[chunks[ndx].file].spikes+=chunks[ndx].spikes;
+      spikes+=chunks[ndx].spikes;
+   }
+   clock_gettime(CLOCK_MONOTONIC, &finish);
+   seconds=(finish.tv_sec-start.tv_sec)+(finish.tv_nsec-start.tv_nsec)/1e9;
+
+   if (format == XML_FORMAT) printf("<spike_analysis>\n   <version>\n      <major>%d</major>\n      <minor>%d</minor>\n   </version>\n   <data>\n", Version.major, Version.minor);
+   if (chatty >= 1) {
+      if (format == CSV_FORMAT) {
+         printf("files,spikes,bytes,workers,chunks,seconds\n%d,%lu,%lu,%d,%d,%.3f\n", file_count, spikes, bytes, jobs, chunk_count, seconds);
+      } else if (format == XML_FORMAT) {
+         printf("      <files>%d</files><spikes>%lu</spikes><bytes>%lu</bytes><workers>%d</workers><chunks>%d</chunks><seconds>%.3f</seconds>\n", file_count, spikes, bytes, jobs, chunk_count, seconds);
+      } else {
+         printf("%d files, %lu spikes, %.1f MB in %.3f seconds with %d workers (%.0f MB/s)\n", file_count, spikes, bytes/1048576.0, seconds, jobs, (seconds > 0.0) ? bytes/1048576.0/seconds : 0.0);
+      }
+   }
+   if (chatty >= 2) {
+      for (ndx=0; ndx<file_count; ndx++) {
+         if (format == CSV_FORMAT) printf("file,%s,%lu\n", files[ndx].path, files[ndx].spikes);
+         else if (format == XML_FORMAT) printf("      <file><path>%s</path><spikes>%lu</spikes></file>\n", files[ndx].path, files[ndx].spikes);
+         else printf("   %lu spikes in %s\n", files[ndx].spikes, files[ndx].path);
+      }
+   }
+   for (unit=0; unit<UNITS; unit++) {
+      print_distribution((unit == NSEC_UNIT) ? "spikes" : "cycle_spikes", unit_names[unit], &total->spikes[unit], total->spike_count[unit], total->max_spike[unit]);
+      print_distribution((unit == NSEC_UNIT) ? "gaps" : "cycle_gaps", unit_names[NSEC_UNIT], &total->gaps[unit], total->gap_count[unit], total->max_gap[unit]);
+      if (window_nsec > 0) print_windows(total, unit);
+   }
+   if (periods_flag) find_periods(workers, jobs, period_jobs);
+   if (format == XML_FORMAT) printf("   </data>\n</spike_analysis>\n");
+   return 0;
+}
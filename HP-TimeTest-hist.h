@@ -0,0 +1,75 @@
+/* HP-TimeTest-hist.h
+   The log-linear latency histogram shared by HP-TimeTest's "-o histogram" option and hp-timetest-analyze.
+
+   Values are counted in a log-linear histogram in the style of HdrHistogram.  Values below
+   2*HIST_SUB_BUCKETS get a bucket each; above that every power of two is split into HIST_SUB_BUCKETS equal
+   buckets, so each bucket is within 1/HIST_SUB_BUCKETS (about 6%) of its value.  Values of 2^HIST_MAX_BITS
+   or more share the top bucket; the exact maximum has to be tracked separately.  The array is fixed at
+   about 5KB, small enough to stay in L1, and recording a value is a bsr, two shifts and an increment.
+*/
+#ifndef HP_TIMETEST_HIST_H
+#define HP_TIMETEST_HIST_H
+
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif
+
+#define HIST_SUB_BITS    4
+#define HIST_SUB_BUCKETS (1<<HIST_SUB_BITS)
+#define HIST_MAX_BITS    40
+#define HIST_BUCKETS     (((HIST_MAX_BITS-HIST_SUB_BITS)<<HIST_SUB_BITS)+HIST_SUB_BUCKETS)
+typedef struct histogram {
+   unsigned long count[HIST_BUCKETS] __attribute__ ((aligned (CACHE_LINE_SIZE)));
+} histogram_struct;
+
+static inline unsigned int hist_index(unsigned long value) {
+   unsigned int shift;
+   if (value >= (1UL<<HIST_MAX_BITS)) value=(1UL<<HIST_MAX_BITS)-1;
+/* OR-ing in the low bits makes the linear range fall out of the same formula with a shift of 0 */
+   shift=(63-__builtin_clzl(value|(2*HIST_SUB_BUCKETS-1)))-HIST_SUB_BITS;
+   return (shift<<HIST_SUB_BITS)+(unsigned int)(value>>shift);
+}
+
+static inline void hist_record(histogram_struct *hist, unsigned long value) {
+   hist->count[hist_index(value)]++;
+}
+
+/* The lowest and highest values that land in bucket "ndx" */
+static inline unsigned long hist_low(unsigned int ndx) {
+   unsigned int shift;
+   if (ndx < 2*HIST_SUB_BUCKETS) return ndx;
+   shift=(ndx>>HIST_SUB_BITS)-1;
+   return ((unsigned long)((ndx&(HIST_SUB_BUCKETS-1))+HIST_SUB_BUCKETS))<<shift;
+}
+
+static inline unsigned long hist_high(unsigned int ndx) {
+   if (ndx < 2*HIST_SUB_BUCKETS) return ndx;
+   return hist_low(ndx)+(1UL<<((ndx>>HIST_SUB_BITS)-1))-1;
+}
+
+static inline unsigned long hist_total(const histogram_struct *hist) {
+   unsigned long total=0L;
+   unsigned int ndx;
+   for (ndx=0; ndx<HIST_BUCKETS; ndx++) total+=hist->count[ndx];
+   return total;
+}
+
+/* Histograms kept by separate threads are simply added bucket by bucket */
+static inline void hist_merge(histogram_struct *into, const histogram_struct *from) {
+   unsigned int ndx;
+   for (ndx=0; ndx<HIST_BUCKETS; ndx++) into->count[ndx]+=from->count[ndx];
+}
+
+/* The upper edge of the bucket holding the given percentile, capped at the known maximum */
+static inline unsigned long hist_percentile(const histogram_struct *hist, unsigned long total, double percentile, unsigned long maximum) {
+   unsigned long running=0L, value;
+   unsigned int ndx;
+   for (ndx=0; ndx<HIST_BUCKETS-1; ndx++) {
+      running+=hist->count[ndx];
+      if ((double)running >= percentile*(double)total/100.0) break;
+   }
+   value=hist_high(ndx);
+   return (value > maximum) ? maximum : value;
+}
+
+#endif
@@ -0,0 +1,65 @@
+/* HP-TimeTest-log.h
+   Spike records and the binary spike log written by HP-TimeTest's "--log" option.
+
+   A log file is a spike_log_header_struct, padded out to header_size bytes, followed by "records"
+   spike_data_struct records in the order they were measured.  The file is written through a shared
+   mapping that is extended in SPIKE_LOG_EXTENT steps while the run goes on; "records" is kept current
+   with every spike, so a log from a run that was killed can still be read up to its last spike.  When
+   the log is closed normally the unused part of the last extent is truncated away.
+
+   All fields are in the byte order of the machine that wrote the log.
+*/
+#ifndef HP_TIMETEST_LOG_H
+#define HP_TIMETEST_LOG_H
+
+#include <stdint.h>
+
+#define SPIKE_LOG_MAGIC       "HPTTSPK"
+#define SPIKE_LOG_VERSION     2
+#define SPIKE_LOG_HEADER_SIZE 256
+#define SPIKE_LOG_EXTENT      (64UL<<20)
+
+/* One spike.  "time" is the elapsed time in nanoseconds from the start of the run to the end of the
+   spike; "spike" is its length in the log's spike_unit (nanoseconds for the TIME and WAKEUP methods,
+   cycles for the CYCLES and MEMCHASE methods).  "cpu" is 0xffffffff when the sampler wasn't pinned.  "flags" is a set
+   of SPIKE_FLAG_ bits.  With SPIKE_FLAG_COUNTERS, "counters" holds how much each perf_event counter went
+   up since the previous spike; a counter the machine doesn't have stays 0.
+*/
+#define SPIKE_FLAG_SMI        0x1      /* MSR_SMI_COUNT changed since the previous spike */
+#define SPIKE_FLAG_COUNTERS   0x2      /* "counters" is filled in */
+#define SPIKE_FLAG_MIGRATION  0x4      /* rdtscp saw a different CPU at each end; "spike" spans two TSCs */
+
+#define SPIKE_CTX_SWITCHES    0
+#define SPIKE_MIGRATIONS      1
+#define SPIKE_MINOR_FAULTS    2
+#define SPIKE_MAJOR_FAULTS    3
+#define SPIKE_INSTRUCTIONS    4
+#define SPIKE_CYCLES          5
+#define SPIKE_COUNTERS        6
+typedef struct spike_data {
+   uint64_t time;
+   uint64_t spike;
+   uint32_t cpu;
+   uint32_t flags;
+   uint64_t counters[SPIKE_COUNTERS];
+} spike_data_struct;
+
+typedef struct spike_log_header {
+   char     magic[8];                 /* SPIKE_LOG_MAGIC */
+   uint32_t version;                  /* SPIKE_LOG_VERSION */
+   uint32_t header_size;              /* offset of the first record */
+   uint32_t record_size;              /* sizeof(spike_data_struct) */
+   uint32_t method;                   /* 1 = TIME, 2 = CYCLES, 4 = WAKEUP, 5 = MEMCHASE */
+   int32_t  cpu;                      /* the sampler's CPU, or -1 */
+   uint32_t reserved;
+   char     timesource[16];           /* name of the clock behind "time" */
+   char     spike_unit[8];            /* "nsec" or "cycle" */
+   double   nsec_per_cycle;           /* from the TSC calibration; 0 if unknown or not CYCLES */
+   uint64_t threshold;                /* in spike_unit */
+   int64_t  epoch_sec;                /* timesource reading at time 0 */
+   int64_t  epoch_nsec;
+   int64_t  start_time;               /* wall clock at the start, seconds since 1970 */
+   uint64_t records;                  /* records that follow the header */
+} spike_log_header_struct;
+
+#endif
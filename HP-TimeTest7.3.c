@@ -1,19 +1,44 @@
-// usage:  [-m,  --method "time"|"cycles"(default="time")]
-//         [-t,  --threshold #(default=10 usecs|10000 cycles)]
-//         [-l,  --loopcount #(default=5000000000 (time)|5000000000 (cycles))]
+// usage:  [-m,  --method "time"|"cycles"|"pingpong"|"wakeup"|"memchase"(default="time")]
+//         [-t,  --threshold #(default=10 usecs (10000 nsecs with a --clock)|10000 cycles|0 nsecs (wakeup)|20000 cycles (memchase))]
+//         [-l,  --loopcount #(default=5000000000 (time)|5000000000 (cycles)|100000 per pair (pingpong)|10000 (wakeup)|5000000 (memchase))]
 //         [-f,  --format "csv"|"xml"|"freeform"(default=freeform)]
-//         [-o,  --option "date" "smi_count" "power_hog" "overhead"]
+//         [-o,  --option "date" "smi_count" "smi_spikes" "perf_counters" "power_hog" "overhead" "histogram"]
 //         [-p,  --priority ["FIFO"|"RR"|"OTHER"(default policy="FIFO")][,#(default priority=sched_get_priority_max(=99 for FIFO,RR))][,#(default nice=-20)]
+//         [-c,  --cpus list (e.g. "2-31,34"; one pinned sampler thread per CPU)]
+//         [-a,  --cpu # (pin the lone sampler to this CPU)]
+//         [-w,  --writer # (housekeeping CPU for a thread that prints the spikes)]
+//         [-k,  --clock "gettimeofday"|"monotonic"|"monotonic_raw"|"realtime"|"tai"|"boottime"(default=gettimeofday)]
+//         [-L,  --log FILE (binary spike log; FILE.<cpu> for each sampler with --cpus)]
+//         [-H,  --hog-isa "auto"|"sse"|"avx2"|"avx512"(default=auto; implies -o power_hog)]
+//         [-i,  --hog-intensity #(default=1; passes over the power_hog kernel per iteration)]
+//         [-n,  --noise "mem"|"stream"|"chase" (memory noise on --noise-cpus; quiet and loaded runs)]
+//         [-N,  --noise-cpus list (CPUs for the noise threads)]
+//         [-z,  --noise-size #(default=64; MB each noise thread works over)]
+//         [-P,  --period #(default=1000 usecs; timer period of the wakeup method)]
+//         [-s,  --chase-size #(default=256; MB each memchase sampler chases through)]
+//         [-d,  --chase-node # (NUMA node of the memchase buffers; default is each sampler's own)]
+//         [-I,  --interval # (seconds; report every window of this length as it closes)]
+//         [-J,  --json FILE (the --interval windows as JSON lines; "-" for stdout)]
+//         [-D,  --daemon (sample until SIGTERM/SIGINT; SIGUSR1 prints a snapshot)]
+//         [-O,  --output FILE (append the output to FILE; SIGHUP reopens it)]
+//         [-M,  --metrics PATH|PORT (serve OpenMetrics on a UNIX socket or 127.0.0.1:PORT)]
+//         [-S,  --buffer #[k|m|g] (bytes of huge-page spike buffer per sampler)]
+//         [-R,  --record-only (print the spikes only when the run is over)]
+//         [-A,  --audit (check the host's real-time tuning for the sampled CPUs before the run)]
+//         [-Q,  --pm-qos #[,cpu] (usecs; hold /dev/cpu_dma_latency, or with ",cpu" each --cpus CPU's resume latency)]
+//         [-q,  --pm-qos-ab (hold the --pm-qos limit in even --interval windows only, and compare)]
+//         [-X,  --matrix FILE (run each configuration in FILE --repeat times, then exit)]
+//         [-r,  --repeat #(default=5; runs of each --matrix configuration)]
+//         [-Y,  --baseline FILE (compare the --matrix runs with a saved baseline)]
+//         [-y,  --save-baseline FILE (save the --matrix runs and the host they ran on)]
+//         [-B,  --benchmark-kernels (compare the generic and the specialized sampling loop, then exit)]
+//         [-C,  --benchmark-clocks (cost and resolution of every way of reading the time, then exit)]
 //         [-V,  --Version]
 //         [-v#, --verbose[=#(default=1)] [-b, --brief]
 //         [-e,  --explain] [-? -h, --help]
 
 /* Additional things to look into implementing:
 
-nanosecond timer; I think it requires 2.6.26 or later
-    rv = clock_gettime( CLOCK_REALTIME, &(TimeSpec[0]) );
-    printf("clock_gettime() returned a time of %ld.%9.9ld\n", TimeSpec[0].tv_sec, TimeSpec[0].tv_nsec );
-
 read the value of /proc/sys/kernel/vsyscall64
     0: Provides the most accurate time intervals at μs (microsecond) resolution, but also produces the highest call overhead, as it uses a regular system call 
     1: Slightly less accurate, although still at μs resolution, with a lower call overhead 
@@ -45,6 +70,7 @@ In it he offers this table of typical Real Time Priorities:
 # include <stdio.h>
 # include <stdlib.h>
 # include <stdint.h>
+# include <stddef.h>
 # include <unistd.h>
 # include <string.h>
 # include <sys/time.h>
@@ -59,10 +85,28 @@ In it he offers this table of typical Real Time Priorities:
 # include <sys/stat.h>
 # include <fcntl.h>
 # include <utmpx.h>
+# include <ctype.h>
 # include <asm/vsyscall.h>
 # include <immintrin.h>
+# include <pthread.h>
+# include <signal.h>
+# include <poll.h>
+# include <dirent.h>
+# include <sys/socket.h>
+# include <sys/un.h>
+# include <netinet/in.h>
+# include <arpa/inet.h>
+# include <cpuid.h>
+# include <math.h>
+# include <sys/syscall.h>
+# include <sys/wait.h>
+# include <sys/utsname.h>
+# include <linux/perf_event.h>
+# include <linux/mempolicy.h>
+# include "HP-TimeTest-log.h"
+# include "HP-TimeTest-hist.h"
 
-// gcc -W -Wall -O -avx2 -o HP-TimeTest7.2 HP-TimeTest7.2.c
+// gcc -W -Wall -O -avx2 -pthread -o HP-TimeTest7.2 HP-TimeTest7.2.c -lm
 // You'll need a recent version of gcc to use the -mtune=corei7-avx compiler flag
 // This may require installing gmp-devel, and installing mpc and mpfr
 // get gmp:  ./configure
@@ -83,7 +127,7 @@ In it he offers this table of typical Real Time Priorities:
 //            LD_LIBRARY_PATH=/usr/local/lib make check
 //            LD_LIBRARY_PATH=/usr/local/lib make install
 
-// LD_LIBRARY_PATH=${LD_LIBRARY_PATH}:/usr/local/lib64:/usr/local/lib /usr/local/bin/gcc -mavx -Wl,-Map=HP-TimeTest7.2-4.map,--cref -mtune=corei7-avx -march=corei7-avx -O HP-TimeTest7.2-4.c -o HP-TimeTest7.2-4
+// LD_LIBRARY_PATH=${LD_LIBRARY_PATH}:/usr/local/lib64:/usr/local/lib /usr/local/bin/gcc -mavx -Wl,-Map=HP-TimeTest7.2-4.map,--cref -mtune=corei7-avx -march=corei7-avx -O HP-TimeTest7.2-4.c -o HP-TimeTest7.2-4 -pthread -lm
 // LD_LIBRARY_PATH=${LD_LIBRARY_PATH}:/usr/local/lib64:/usr/local/lib /usr/local/bin/gcc -mavx -Wl,-Map=HP-TimeTest7.2-4.map,--cref -mtune=corei7-avx -march=corei7-avx -O HP-TimeTest7.2-4.c -S
 
 /*
@@ -148,11 +192,91 @@ Date		Version	Contact		Description
 2015 11 24	7.3	Chuck Newman	Add option to report overhead time or cycles, i.e., time or cycles passed while
 					processing events.
 					Fixed some formatting issues.
+2026 10 16	7.4			Add "--cpus" option: one SCHED_FIFO sampler thread pinned to each listed CPU.
+					Each sampler keeps its own cache-line-aligned spike buffer, minimum spike and
+					overhead counters; the leftover spikes are merged by elapsed time at the end,
+					followed by a summary for each CPU.
+					The running elapsed time is now reset after the warm-up pass; the warm-up's
+					zero-length spikes used to be decoded as an extra-long gap.
+2026 10 16	7.4			Add "--writer" option: spikes go through a lock-free single-producer/single-consumer
+					ring per sampler to a writer thread on a housekeeping CPU, so printf() and
+					fflush() no longer run on the measuring core.  The "overhead" option also
+					reports the writer's cycles and any spikes dropped when a ring was full.
+2026 10 16	7.4			Add "histogram" option: every iteration of the TIME and CYCLES loops is counted
+					in a fixed-size log-linear histogram; percentiles, the maximum and the
+					non-empty buckets are reported in all three formats.
+2026 10 16	7.4			Add "--clock" option and a timesource layer: tt_gettime() can use clock_gettime()
+					on CLOCK_MONOTONIC, _MONOTONIC_RAW, _REALTIME, _TAI or _BOOTTIME instead of
+					gettimeofday().  Times are carried in nanoseconds throughout; with a --clock
+					spikes, thresholds and deltas are reported in nsecs.
+2026 10 16	7.4			Cycle mode checks CPUID for an invariant TSC and calibrates the TSC frequency
+					against CLOCK_MONOTONIC_RAW with an error bound in ppm.  When the TSC is
+					invariant every cycle spike is also reported in nanoseconds.  Link with -lm.
+2026 10 16	7.4			Spikes are now kept as 64-bit records (elapsed nsecs, raw spike, CPU, flags)
+					instead of the packed 32-bit entries with escape codes, so long gaps and
+					large cycle counts no longer need decoding.  Add "--log FILE": each sampler
+					appends its records to a binary log (see HP-TimeTest-log.h) through a
+					shared mapping that is fallocated and prefaulted in 64MB extents.
+2026 10 16	7.4			Add "smi_spikes" option: every spike is checked against MSR_SMI_COUNT, read
+					with one pread() on a descriptor opened before the run, and flagged when an
+					SMI has happened since the previous spike.  msr_read() uses pread() too.
+2026 10 16	7.4			Add "perf_counters" option: each sampler opens perf_event counters for context
+					switches, migrations, page faults, instructions and cycles, and every spike
+					carries their deltas since the previous spike.  Hardware counters are read
+					with rdpmc through the mmap'd user page.  Spike records grow to 72 bytes
+					(spike log version 2).
+2026 10 16	7.4			The "power_hog" option finally has kernels: 16 chains of SSE2 multiply/adds,
+					AVX2 FMAs or AVX-512 FMAs, chosen by CPUID at run time or with "--hog-isa",
+					and repeated "--hog-intensity" times per iteration.  They are built with
+					target attributes, so no -m flags are needed.  The kernel only runs on the
+					measured pass, and its cycles per iteration and GFLOP/s are reported.
+2026 10 16	7.4			Add "--noise" option: STREAM triad and/or pointer-chase threads run on the
+					"--noise-cpus" while the samplers measure.  The measurement is made once
+					quiet and once loaded, and the two are reported side by side.
+2026 10 16	7.4			Add "pingpong" method: cache-line round trips between every pair of CPUs,
+					timed with rdtscp and reported as min/median/p99 matrices plus the spikes
+					of each pair.
+2026 10 16	7.4			Add "wakeup" method: periodic clock_nanosleep() to absolute deadlines, with
+					the lateness of every wakeup reported as a spike and histogrammed.
+2026 10 16	7.4			The TIME and CYCLES loops are specialized at compile time for each timesource,
+					histogram setting and power_hog kernel and picked by select_sample_kernel();
+					the old loop stays as generic_sample().  Add "--benchmark-kernels" to compare
+					the two.
+2026 10 16	7.4			Add "--benchmark-clocks": cost per read and resolution of the TSC, lfence+rdtsc,
+					gettimeofday(), every clock_gettime() clock and the getcpu paths, plus the
+					kernel clocksource from sysfs.
+2026 10 16	7.4			Add "--interval" windowed statistics: each sampler fills a window (histogram,
+					spikes, overhead) and hands it to a reporter thread through a small lock-free
+					ring when the window closes.  Add "--json" for JSON-lines output of the windows.
+2026 10 16	7.4			Add "--daemon" and "--output": SIGINT/SIGTERM stop the run and still print
+					everything, SIGUSR1 prints a snapshot and SIGHUP reopens the output file.  The
+					measured pass runs in chunks so the signal flags are checked off the hot loop.
+2026 10 16	7.4			Add "--metrics": an exporter thread serving OpenMetrics over a UNIX socket or
+					a loopback port, reading seqlock snapshots the samplers publish between chunks.
+2026 10 16	7.4			Add "--audit": pass/warn/fail checks of isolcpus, nohz_full, rcu_nocbs, IRQ
+					affinity, cpufreq governor, C-states, THP, RT throttling, clocksource and the
+					timer tick for the sampled CPUs before the run.
+2026 10 16	7.4			Add "--pm-qos" to hold a C-state exit latency limit through /dev/cpu_dma_latency
+					or per-CPU pm_qos_resume_latency_us, and "--pm-qos-ab" to alternate it by window
+					and compare latency and RAPL package power with and without it.
+2026 10 16	7.4			The cycles method keeps rdtscp's TSC_AUX and flags a spike whose readings came
+					from two CPUs as a migration instead of a latency.  Add "--cpu" to pin the
+					lone sampler.
+2026 10 16	7.4			The spike buffer is now an anonymous mapping per sampler.  Add "--buffer" to size
+					it at run time on hugetlb or transparent huge pages, prefaulted and checked
+					with mincore(), and "--record-only" to hold all output until the run ends.
+2026 10 16	7.4			Add "--matrix" to run a file of configurations "--repeat" times each in child
+					processes, "--save-baseline" to keep the results with the host's kernel, BIOS
+					and tuned profile, and "--baseline" to flag regressions with a Mann-Whitney U
+					test; the exit status is 2 when anything regressed.
+2026 10 16	7.4			Add the "memchase" method: a random dependent pointer chase through a
+					"--chase-size" buffer bound to "--chase-node", timed 16 loads at a time with
+					rdtscp, so memory-side stalls come through process_big_diff() as spikes.
 
 YYYY MM DD	V.V	F.N. L.N.	!!! UPDATE THE date_time VARIABLE BELOW AND THE Version VARIABLE BELOW !!!
 */
 
-static char date_time[]="2015 11 24 20 35 UTC"; // YYYY MM DD HH MM
+static char date_time[]="2026 10 16 12 00 UTC"; // YYYY MM DD HH MM
 /* I want the date hand-coded in the source and not filled in by the compiler
 static char date_time[]= __DATE__ " " __TIME__ ;
 */
@@ -160,34 +284,227 @@ typedef struct Version_struct {
    unsigned int major;
    unsigned int minor;
 } Version_struct;
-static Version_struct Version={7,3};
+static Version_struct Version={7,4};
 
-#define MAX_SPIKES 1021
-typedef struct spike_data {
-   unsigned int time;
-   unsigned int spike;
-} spike_data_struct;
-/* Note that the array is dimensioned as MAX_SPIKES+3; this is to cover the unlikely case that
-   the last spike is an extra-long one and therefore consumes three array pairs (described later).
+/* Spikes are kept as spike_data_struct records (see HP-TimeTest-log.h): a 64-bit elapsed time and a
+   64-bit spike length, plus the CPU and flags.  The same record is used in the buffer, the writer's
+   ring and the binary log, so nothing is truncated or re-encoded on the way out.
 */
+#define MAX_SPIKES 1021
+/* MSR_SMI_COUNT (34H): bits 31:0 are the number of SMIs since reset */
+#define MSR_SMI_COUNT 0x34L
 /* gcc 4.4.5 defines __BIGGEST_ALIGNMENT__; on the system I tested it on it came up as 16
    it was not defined with gcc 4.1.2, so I define it here if necessary.
 */
 #ifndef __BIGGEST_ALIGNMENT__
 #define __BIGGEST_ALIGNMENT__ 16
 #endif
-static spike_data_struct spikes[MAX_SPIKES+3] __attribute__ ((aligned (__BIGGEST_ALIGNMENT__)));
-static char second_string[]="usec";
+typedef struct timespec timesignature;
+
+/* Everything a sampling loop writes while it runs lives in its own sampler_struct.  With "--cpus" there
+   is one per CPU, each aligned to (and therefore padded out to) whole cache lines, so the samplers never
+   write to a line that another sampler is using.
+*/
+#define CACHE_LINE_SIZE 64
+
+/* With "--writer" a sampler never formats its own spikes.  It hands each one to the writer thread through
+   a single-producer/single-consumer ring: the sampler only ever writes "head" and the records, the writer
+   only ever writes "tail", and the two indexes live on separate cache lines.  When the ring is full the
+   spike is counted as dropped rather than making the sampler wait.
+*/
+#define RING_RECORDS 4096               /* must be a power of two */
+typedef struct spike_ring {
+   unsigned long head __attribute__ ((aligned (CACHE_LINE_SIZE)));
+   unsigned long cached_tail;           /* the sampler's last look at "tail" */
+   unsigned long tail __attribute__ ((aligned (CACHE_LINE_SIZE)));
+   unsigned long last_printed;          /* the writer's elapsed time of the last spike it printed */
+   spike_data_struct records[RING_RECORDS] __attribute__ ((aligned (CACHE_LINE_SIZE)));
+} spike_ring_struct;
+
+/* With "--log" each sampler appends its spikes to its own binary log file (see HP-TimeTest-log.h) through
+   a shared mapping that is allocated and prefaulted one SPIKE_LOG_EXTENT at a time, so recording a spike
+   is a store of the record and of the header's record count.
+*/
+typedef struct spike_log {
+   spike_log_header_struct *header;    /* start of the mapping */
+   spike_data_struct *records;
+   unsigned long count;
+   unsigned long capacity;             /* records that fit in the mapping */
+   size_t mapped;
+   int fd;
+   unsigned long drops;                /* spikes lost because the log couldn't grow */
+   char path[PATH_MAX];
+} spike_log_struct;
+
+/* With "-o perf_counters" each sampler thread counts its own context switches, migrations and page faults,
+   and where the PMU allows its instructions and cycles, with perf_event counters opened before it starts.
+   The hardware counters are read with rdpmc through their mmap'd user pages; the software counters can't be
+   read that way and come from one read() of their group.  Either way they are only read when a spike has
+   already happened, never in the sampling loop itself.
+*/
+typedef struct perf_counters {
+   int fd[SPIKE_COUNTERS];             /* -1 for a counter this machine doesn't have */
+   struct perf_event_mmap_page *page[SPIKE_COUNTERS];  /* hardware counters only */
+   int group_fd;                       /* leader of the software counters */
+   int group_order[SPIKE_COUNTERS];    /* which counter is at each position of the group's read() */
+   int group_size;
+   uint64_t last[SPIKE_COUNTERS];      /* values as of the previous spike */
+} perf_counters_struct;
+
+/* "-o power_hog" runs a block of floating point multiply-adds on every iteration of the cycles loop.  The
+16 accumulators are independent chains, enough to keep the vector units busy; each call does "intensity"
+passes over them.  The state lives in the sampler so each thread has its own.
+*/
+#define HOG_CHAINS 16
+typedef struct hog_state {
+   double acc[HOG_CHAINS*8] __attribute__ ((aligned (CACHE_LINE_SIZE)));
+   double mul[8] __attribute__ ((aligned (CACHE_LINE_SIZE)));
+   double add[8] __attribute__ ((aligned (CACHE_LINE_SIZE)));
+} hog_state_struct;
+
+/* "--interval" statistics windows.  The sampler fills the window at "head" and hands it to the reporter by
+moving "head" on and switching its histogram pointer to the next slot; the reporter prints the window,
+merges its histogram into the run's, clears it and moves "tail" on.  If the reporter falls so far behind
+that no slot is free, the sampler keeps adding to the window it has and counts an overrun.
+*/
+#define WINDOW_SLOTS 4
+typedef struct stats_window {
+   histogram_struct hist;
+   unsigned long number;
+   unsigned long start;                /* elapsed nsecs */
+   unsigned long end;
+   unsigned long iterations;
+   unsigned long spike_count;
+   unsigned long max_spike;
+   unsigned long overhead;             /* nsecs, or cycles for the CYCLES method */
+   unsigned long overruns;             /* windows that had to be folded into this one */
+   int constrained;                    /* "--pm-qos-ab": the PM QoS limit was held during this window */
+} stats_window_struct;
+typedef struct window_ring {
+   stats_window_struct slot[WINDOW_SLOTS];
+   unsigned long head __attribute__ ((aligned (CACHE_LINE_SIZE)));  /* windows handed over by the sampler */
+   unsigned long tail __attribute__ ((aligned (CACHE_LINE_SIZE)));  /* windows the reporter is done with */
+} window_ring_struct;
+
+/* "--metrics" snapshots.  Each half is a seqlock with a single writer: "seq" is odd while the writer is
+copying, so the exporter copies the fields out, checks that "seq" is even and hasn't moved, and otherwise
+tries again.  The sampler writes the totals between chunks; the histogram is written by the sampler too,
+unless "--interval" is on, in which case the reporter writes it after merging each window.
+*/
+typedef struct sampler_metrics {
+   unsigned long seq __attribute__ ((aligned (CACHE_LINE_SIZE)));
+   unsigned long iterations;
+   unsigned long spike_count;
+   unsigned long max_spike;
+   unsigned long overhead;             /* nsecs, or cycles for the CYCLES method */
+   unsigned long smi_spikes;
+   unsigned long hist_seq __attribute__ ((aligned (CACHE_LINE_SIZE)));
+   histogram_struct hist;
+} sampler_metrics_struct;
+
+/* "--pm-qos-ab" totals of one setting, kept by the reporter */
+typedef struct pm_qos_stats {
+   histogram_struct hist;
+   unsigned long windows;
+   unsigned long iterations;
+   unsigned long spike_count;
+   unsigned long max_spike;
+} pm_qos_stats_struct;
+
+typedef struct sampler {
+   spike_data_struct *spikes;          /* the spike arena; see spike_arena_map() */
+   unsigned long spike_ndx;
+   unsigned long spike_capacity;
+   unsigned long spike_drops;          /* "--record-only" spikes that found the arena full */
+   int quiet;                          /* set while warming up; nothing gets printed */
+   unsigned long min_spike;
+   unsigned long max_spike;
+   unsigned long spike_count;
+   unsigned long last_printed;         /* elapsed nsecs of the last spike printed from this buffer */
+   timesignature start_time;           /* elapsed time 0 */
+   unsigned long overhead_nsec;
+   unsigned long overhead_cycles;
+   unsigned long ring_drops;           /* spikes lost because the writer fell behind */
+   unsigned long smi_count;            /* MSR_SMI_COUNT as of the last spike */
+   unsigned long smi_spikes;           /* spikes that had an SMI since the previous one */
+   histogram_struct histogram;
+   hog_state_struct hog;
+   unsigned long hog_cycles;           /* cycles spent in the power_hog loop, spikes included */
+   unsigned long iterations;           /* iterations the measured pass completed; less than loopcount if it was stopped */
+   unsigned long migrations;           /* rdtscp readings that came from another CPU than the one before */
+/* read-only once the sampler starts */
+   int method;
+   int cpu;                            /* -1 unless "--cpus" or "--cpu" pinned this sampler */
+   unsigned long threshold;
+   unsigned long loopcount;
+   pthread_barrier_t *start_barrier;   /* NULL for a lone sampler running in main() */
+   spike_ring_struct *ring;            /* NULL unless "--writer" was given */
+   spike_log_struct *log;              /* NULL unless "--log" was given */
+   int msr_fd;                         /* /dev/cpu/<cpu>/msr with "-o smi_spikes", otherwise -1 */
+   perf_counters_struct *perf;         /* NULL unless "-o perf_counters" */
+   histogram_struct *hist;             /* &histogram with "-o histogram", otherwise NULL */
+   const struct sample_kernel *sample_kernel[2];  /* loops for the warm-up and the measured pass */
+   window_ring_struct *windows;        /* NULL unless "--interval" was given */
+   stats_window_struct *window;        /* the window being filled */
+   timesignature wakeup_deadline;      /* the wakeup method's next deadline */
+   int chunk_carry;                    /* set once a chunk of the pass has left its last reading below */
+   timesignature chunk_stamp;          /* the TIME kernels' last reading, for the next chunk to start from */
+   unsigned long chunk_cycles;         /* the CYCLES and MEMCHASE kernels' last TSC reading, likewise */
+   unsigned int chunk_aux;             /* and its TSC_AUX */
+   char *chase;                        /* the memchase method's buffer; see chase_map() */
+   char *chase_at;                     /* where the chase has got to */
+   size_t chase_bytes;
+   int chase_node;                     /* the NUMA node it is bound to, or that its first page is on */
+   unsigned long chase_on_node;        /* pages move_pages() found on chase_node */
+   sampler_metrics_struct *metrics;    /* NULL unless "--metrics" was given */
+   int pm_qos_owner;                   /* PM_QOS_OWNER_ bits: what this sampler switches for "--pm-qos-ab" */
+   char pm_qos_saved[32];              /* the CPU's pm_qos_resume_latency_us before the run */
+   pm_qos_stats_struct pm_qos_stats[2];  /* "--pm-qos-ab" windows without and with the limit */
+   size_t arena_bytes;
+   int arena_pages;                    /* ARENA_ kind of pages behind "spikes" */
+   pthread_t thread;
+} __attribute__ ((aligned (CACHE_LINE_SIZE))) sampler_struct;
+static sampler_struct lone_sampler;
+
+typedef struct writer {
+   sampler_struct *samplers;
+   int sampler_count;
+   int cpu;
+   int done;                           /* set by main() once every sampler has finished */
+   unsigned long records;
+   unsigned long overhead_cycles;      /* cycles the writer spent formatting and writing spikes */
+   pthread_t thread;
+} writer_struct;
+static writer_struct writer;
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+static timesignature run_epoch;
 static char cycle_string[]="cycle";
 static char *spike_unit;
+/* Set by calibrate_tsc() in cycle mode when the TSC is invariant; 0 means cycle spikes are reported in cycles only */
+static double spike_nsec_per_unit=0.0;
+static double tsc_error_ppm=0.0;
 
 #define TIME_METHOD   1
 #define CYCLES_METHOD 2
+#define PINGPONG_METHOD 3
+#define WAKEUP_METHOD 4
+#define MEMCHASE_METHOD 5
+/* The methods whose spikes are TSC cycles */
+#define CYCLE_METHOD(method) (((method) == CYCLES_METHOD) || ((method) == MEMCHASE_METHOD))
 #define method_default TIME_METHOD
 #define threshold_time_default 10L
 #define loopcount_time_default 5000000000L
 #define threshold_cycles_default  10000L
 #define loopcount_cycles_default  5000000000L
+#define loopcount_pingpong_default 100000L
+#define threshold_wakeup_default  0L
+#define loopcount_wakeup_default  10000L
+#define period_wakeup_default     1000L
+#define threshold_memchase_default 20000L
+#define loopcount_memchase_default 5000000L
+#define chase_size_default        256UL
+#define CHASE_HOPS                16
+#define CHASE_MAX_NODES           1024
 
 #define chatty_default 1
 static unsigned int chatty=chatty_default;
@@ -199,19 +516,69 @@ static unsigned int format=FREEFORM_FORMAT;
 static char XML_head[]="<!-- ";
 static char XML_tail[]=" -->";
 static int spike_header_printed=0;
+static size_t buffer_bytes=0;           /* "--buffer": bytes of spike arena per sampler; 0 for MAX_SPIKES records */
+static int record_only=0;               /* "--record-only": print nothing until the run is over */
+static int migration_column=0;          /* CSV spike lines carry a "migration" column (CYCLES and MEMCHASE methods) */
+static size_t chase_bytes=chase_size_default<<20;  /* "--chase-size": bytes each memchase sampler chases through */
+static int chase_node=-1;               /* "--chase-node": NUMA node of the chase buffers; -1 for each sampler's own */
 
 #define DATE_OPTION		0
 #define SMI_OPTION		1
 #define POWER_HOG_OPTION	2
 #define OVERHEAD_OPTION		3
-#define LAST_OPTION		3
+#define HISTOGRAM_OPTION	4
+#define SMI_SPIKES_OPTION	5
+#define PERF_COUNTERS_OPTION	6
+#define LAST_OPTION		6
 static int options[LAST_OPTION+1]={};
 
+/* The perf_event counters behind "-o perf_counters", in SPIKE_ order (see HP-TimeTest-log.h) */
+typedef struct perf_event_desc {
+   const char *name;                   /* column heading and freeform label */
+   const char *tag;                    /* XML tag */
+   uint32_t type;
+   uint64_t config;
+} perf_event_desc_struct;
+static const perf_event_desc_struct perf_events[SPIKE_COUNTERS]={
+   {"context switches", "ctx_switches",  PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+   {"migrations",       "migrations",    PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS},
+   {"minor faults",     "minor_faults",  PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MIN},
+   {"major faults",     "major_faults",  PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MAJ},
+   {"instructions",     "instructions",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+   {"cycles",           "cycles",        PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES}};
+/* Bit n is set when counter n could be opened; set by main() before any sampler starts */
+static unsigned int perf_available=0;
+
 /* I couldn't find where these are specified in an include file or available through a system call. */
 #define MAX_NICE  19
 #define MIN_NICE -20
 
-typedef struct timeval timesignature;
+/* The timesource abstraction.  Every timestamp is a timesignature, whichever clock produced it, and
+   differences between timestamps are always carried in nanoseconds.  "scale" and "digits" only affect
+   how times are reported: gettimeofday() can't resolve less than a microsecond, so it reports usecs with
+   six decimal places of seconds, while the clock_gettime() clocks report nsecs with nine.
+*/
+typedef struct timesource {
+   const char *name;
+   clockid_t clock_id;           /* -1 for gettimeofday() */
+   unsigned long scale;          /* nanoseconds per reported unit */
+   int digits;                   /* decimal places when reporting seconds */
+   char *unit;
+} timesource_struct;
+#ifndef CLOCK_TAI
+#define CLOCK_TAI 11
+#endif
+static char usec_string[]="usec";
+static char nsec_string[]="nsec";
+static const timesource_struct timesources[]={
+   {"gettimeofday",  -1,                  1000L, 6, usec_string},
+   {"monotonic",     CLOCK_MONOTONIC,     1L,    9, nsec_string},
+   {"monotonic_raw", CLOCK_MONOTONIC_RAW, 1L,    9, nsec_string},
+   {"realtime",      CLOCK_REALTIME,      1L,    9, nsec_string},
+   {"tai",           CLOCK_TAI,           1L,    9, nsec_string},
+   {"boottime",      CLOCK_BOOTTIME,      1L,    9, nsec_string},
+   {NULL,            -1,                  0L,    0, NULL} };
+static const timesource_struct *timesource=&timesources[0];
 
 #ifdef FAKE
 /* Synthetic data for testing.  Results should be:
@@ -274,14 +641,20 @@ static int fake_data_ndx=0;
 static inline void tt_gettime (timesignature* tvr) {
 #ifndef FAKE
     int rv;
-    rv=gettimeofday(tvr, NULL);
-    if (rv!=0) { perror("Error calling gettimeofday"); fflush(stdout); fflush(stderr); }
+    if (timesource->clock_id < 0) {
+       struct timeval tv;
+       rv=gettimeofday(&tv, NULL);
+       tvr->tv_sec=tv.tv_sec;
+       tvr->tv_nsec=tv.tv_usec*1000L;
+    } else
+       rv=clock_gettime(timesource->clock_id, tvr);
+    if (rv!=0) { perror("Error reading the timesource"); fflush(stdout); fflush(stderr); }
 #else
    tvr->tv_sec=(time_t)(high[fake_data_ndx]+(low[fake_data_ndx]>>32));
-   tvr->tv_usec=(suseconds_t)(low[fake_data_ndx]&0xffffffffL);
+   tvr->tv_nsec=(long)(low[fake_data_ndx]&0xffffffffL)*1000L;
    if (fake_data_ndx<FAKE_SAMPLE_COUNT-1) fake_data_ndx++;
 #endif
-   if (chatty >= 3) printf("%sGot a time of %5lu.%.6lu%s sec since the epoch began\n", XML_head, tvr->tv_sec, tvr->tv_usec, XML_tail);
+   if (chatty >= 3) printf("%sGot a time of %5lu.%.9lu%s sec since the epoch began\n", XML_head, tvr->tv_sec, tvr->tv_nsec, XML_tail);
 }
 
 static inline unsigned long get_cycles() {
@@ -306,10 +679,96 @@ static inline unsigned long get_cycles_p() {
     return low + ((unsigned long)(high)<<32);
 }
 
+/* rdtscp also loads ECX with TSC_AUX, which Linux sets to (node<<12)|cpu on every CPU; keeping it costs
+   nothing, since rdtscp writes ECX anyway
+*/
+static inline unsigned long get_cycles_aux(unsigned int *aux) {
+    unsigned low, high;
+    asm volatile ("rdtscp" : "=a" (low), "=d" (high), "=c" (*aux));
+    return low + ((unsigned long)(high)<<32);
+}
+#define TSC_AUX_CPU(aux) ((aux) & 0xfff)
+
+/* rdtsc that can't be executed ahead of the instructions before it */
+static inline unsigned long get_cycles_lfence() {
+    unsigned low, high;
+    asm volatile ("lfence\n\trdtsc" : "=a" (low), "=d" (high) :: "memory");
+    return ((unsigned long)high)<<32 | low;
+}
+
+/* Nanoseconds from b to a */
 static inline unsigned long tt_time_diff (timesignature* a, timesignature* b) {
-    return (unsigned long)a->tv_sec * 1000000L + (unsigned long)a->tv_usec - ((unsigned long)b->tv_sec * 1000000L + (unsigned long)b->tv_usec);
+    return (unsigned long)a->tv_sec * 1000000000L + (unsigned long)a->tv_nsec - ((unsigned long)b->tv_sec * 1000000000L + (unsigned long)b->tv_nsec);
 }
 
+/* CPUID.80000007H:EDX[8] says the TSC runs at a constant rate in every P-, C- and T-state */
+static int tsc_is_invariant() {
+   unsigned int eax, ebx, ecx, edx;
+   if (__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) == 0) return 0;
+   if (eax < 0x80000007) return 0;
+   __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+   return (edx>>8) & 1;
+}
+
+/* Read CLOCK_MONOTONIC_RAW between two rdtscp's, keeping the tightest of a few tries; the TSC value is the
+   midpoint and "uncertainty" is half the bracket.
+*/
+static void tsc_clock_pair(unsigned long *tsc, unsigned long *nsec, unsigned long *uncertainty) {
+   struct timespec ts;
+   unsigned long before, after;
+   int tries;
+   *uncertainty=ULONG_MAX;
+   for (tries=0; tries<5; tries++) {
+      before=get_cycles_p();
+      clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+      after=get_cycles_p();
+      if ((after-before)/2 < *uncertainty) {
+         *uncertainty=(after-before)/2;
+         *tsc=before+(after-before)/2;
+         *nsec=(unsigned long)ts.tv_sec*1000000000L+(unsigned long)ts.tv_nsec;
+      }
+   }
+}
+
+/* Measure the TSC frequency against CLOCK_MONOTONIC_RAW over TSC_CALIBRATION_ROUNDS back-to-back intervals.
+   The error bound is two standard errors of the per-round estimates plus the worst read bracket, in ppm.
+   Returns the TSC frequency in kHz, or 0 if the TSC can't be trusted to convert cycles to time.
+*/
+#define TSC_CALIBRATION_ROUNDS 8
+#define TSC_CALIBRATION_NSEC   25000000L
+static double calibrate_tsc(double *error_ppm) {
+   unsigned long tsc[2], nsec[2], uncertainty[2], worst=0L, now;
+   double khz[TSC_CALIBRATION_ROUNDS], mean=0.0, variance=0.0, bracket;
+   struct timespec ts;
+   int round;
+   *error_ppm=0.0;
+   if (tsc_is_invariant() == 0) return 0.0;
+   tsc_clock_pair(&tsc[0], &nsec[0], &uncertainty[0]);
+   for (round=0; round<TSC_CALIBRATION_ROUNDS; round++) {
+      do {
+         clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+         now=(unsigned long)ts.tv_sec*1000000000L+(unsigned long)ts.tv_nsec;
+      } while (now-nsec[0] < TSC_CALIBRATION_NSEC);
+      tsc_clock_pair(&tsc[1], &nsec[1], &uncertainty[1]);
+      khz[round]=(double)(tsc[1]-tsc[0])*1000000.0/(double)(nsec[1]-nsec[0]);
+      bracket=(double)(uncertainty[0]+uncertainty[1])/(double)(tsc[1]-tsc[0]);
+      if (bracket*1e6 > (double)worst) worst=(unsigned long)(bracket*1e6+0.5);
+      mean+=khz[round];
+      tsc[0]=tsc[1]; nsec[0]=nsec[1]; uncertainty[0]=uncertainty[1];
+   }
+   mean/=TSC_CALIBRATION_ROUNDS;
+   for (round=0; round<TSC_CALIBRATION_ROUNDS; round++) variance+=(khz[round]-mean)*(khz[round]-mean);
+   variance/=TSC_CALIBRATION_ROUNDS-1;
+   *error_ppm=2.0*sqrt(variance/TSC_CALIBRATION_ROUNDS)/mean*1e6+(double)worst;
+   return mean;
+}
+
+/* Convert a TIME-method value from nanoseconds to the timesource's reporting unit; cycles are left alone */
+static inline unsigned long spike_units(int method, unsigned long value) {
+   return (method == TIME_METHOD) ? value/timesource->scale : value;
+}
+
+
 static inline int compare_parameters(const char *str1, const char *gold) {
 // -1 means different or test string is longer than the "gold" string
 // non-negative means length of match before end of either string
@@ -322,6 +781,25 @@ static inline int compare_parameters(const char *str1, const char *gold) {
    return -1;
 }
 
+/* Choose a timesource by name, e.g. "monotonic_raw" or just "boot"; returns 0 if the name is unknown or ambiguous */
+static int parse_timesource(const char *name) {
+   const timesource_struct *ts, *found=NULL;
+   char lower[32];
+   size_t ndx;
+   for (ndx=0; (ndx<sizeof(lower)-1) && (name[ndx]!='\0'); ndx++) lower[ndx]=tolower((unsigned char)name[ndx]);
+   lower[ndx]='\0';
+   for (ts=timesources; ts->name!=NULL; ts++) {
+      if (strcmp(lower, ts->name) == 0) { found=ts; break; }
+      if (compare_parameters(lower, ts->name) > 0) {
+         if (found != NULL) return 0;
+         found=ts;
+      }
+   }
+   if (found == NULL) return 0;
+   timesource=found;
+   return 1;
+}
+
 static inline char *scheduler_string(int scheduler) {
    static char SCHED_FIFO_string[]  = "SCHED_FIFO";
    static char SCHED_RR_string[]    = "SCHED_RR";
@@ -387,129 +865,647 @@ static inline int parse_nice(char *nice_string, int *nice_value) {
    return rv;
 }
 
-static inline void print_big_diff(spike_data_struct *spikes, unsigned int *spike_ndx) {
-   static unsigned long cumulative=0L;
-   unsigned long this_time;
-   unsigned int ndx;
-   if (chatty >= 3) printf("%sDump a buffer of up to %d spikes%s\n", XML_head, *spike_ndx, XML_tail);
-   if (cumulative==0) {
-      if ((chatty>0)&&(format==CSV_FORMAT)) printf("Elapsed Time (sec),spike (%s),delta time (usec)\n", spike_unit);
-   }
-   for (ndx=0; ndx<*spike_ndx; ndx++) {
-
-/* look at both fields together in a single comparison */
-      if ((*(unsigned long *)(&(spikes[ndx].time)))==0L) {
-/* In this "if" section with both time and spike=0, the time consumes both "int"s of the next record
-   and the spike consumes its normal field of the subsequent record;
-   and the print statement has a corresponding long unsigned format.
-*/
-         this_time=*(unsigned long *)(&(spikes[ndx+1].time));
-         cumulative+=this_time;
-         if ( chatty>0 ) {
-            if (format==FREEFORM_FORMAT) {
-               printf("%5u.%.6u Latency spike of %u %s\n"
-                  , (unsigned int)(cumulative/1000000L)
-                  , (unsigned int)(cumulative-(cumulative/1000000L)*1000000L)
-                  , spikes[ndx+2].spike
-                  , spike_unit);
-               if (cumulative!=this_time) printf("             %lu usec since last spike\n"
-                  , *(unsigned long *)(&(spikes[ndx+1].time)));
-            } else if (format==CSV_FORMAT) {
-               printf("%5u.%.6u,%u"
-                  , (unsigned int)(cumulative/1000000L)
-                  , (unsigned int)(cumulative-(cumulative/1000000L)*1000000L)
-                  , spikes[ndx+2].spike);
-               if (cumulative!=this_time) printf(",%lu"
-                  , *(unsigned long *)(&(spikes[ndx+1].time)));
-               printf("\n");
-            } else {
-               printf("      <datum>\n         <elapsed>%u.%.6u</elapsed><spike>%u</spike>"
-                  , (unsigned int)(cumulative/1000000L)
-                  , (unsigned int)(cumulative-(cumulative/1000000L)*1000000L)
-                  , spikes[ndx+2].spike);
-               if (cumulative!=this_time) printf("<delta>%lu</delta>"
-                  , *(unsigned long *)(&(spikes[ndx+1].time)));
-               printf("\n      </datum>\n");
-            }
-         }
-         ndx+=2;
+/* Parse a CPU list such as "2-31,34" into a cpu_set_t; returns the number of CPUs in the set, or -1 on a syntax error */
+static int parse_cpu_list(const char *list_string, cpu_set_t *cpus) {
+   const char *ptr=list_string;
+   char *endptr;
+   unsigned long first, last, cpu;
+   CPU_ZERO(cpus);
+   while (*ptr != '\0') {
+      first=strtoul(ptr, &endptr, 10);
+      if (endptr == ptr) return -1;
+      last=first;
+      ptr=endptr;
+      if (*ptr == '-') {
+         ptr++;
+         last=strtoul(ptr, &endptr, 10);
+         if ((endptr == ptr) || (last < first)) return -1;
+         ptr=endptr;
+      }
+      if (last >= CPU_SETSIZE) return -1;
+      for (cpu=first; cpu<=last; cpu++) CPU_SET(cpu, cpus);
+      if (*ptr == ',') ptr++;
+      else if (*ptr != '\0') return -1;
+   }
+   return CPU_COUNT(cpus);
+}
+
+/* cpu is negative when the run uses a single, unpinned sampler; in that case no CPU column is printed */
+static inline void print_spike_header(int cpu) {
+   int counter;
+   if ((format==XML_FORMAT) || (format==CSV_FORMAT)) {
+      printf("%s%sElapsed time (seconds),latency spike (%s),%s%s%s", XML_head, (cpu>=0)?"CPU,":"", spike_unit, (spike_nsec_per_unit>0.0)?"latency spike (nsec),":"", (options[SMI_SPIKES_OPTION]==1)?"SMI,":"",
+         (migration_column==1)?"migration,":"");
+      for (counter=0; counter<SPIKE_COUNTERS; counter++)
+         if (perf_available & (1<<counter)) printf("%s,", perf_events[counter].name);
+      printf("delta time (%s)%s\n", timesource->unit, XML_tail);
+   }
+   spike_header_printed = 1;
+}
+
+/* The record's elapsed time includes "gap", so the two are equal only for the first spike, which has no
+   delta to report.  Both are in nanoseconds; "spike" is the record's spike already in spike_unit.
+*/
+static inline void print_spike(const spike_data_struct *record, unsigned long gap, unsigned long spike) {
+   unsigned long elapsed=record->time;
+   int cpu=(int)record->cpu, counter;
+   if (format==FREEFORM_FORMAT) {
+      printf("%5lu.%.*lu Latency spike of %lu %s"
+         , elapsed/1000000000L
+         , timesource->digits, (elapsed%1000000000L)/timesource->scale
+         , spike
+         , spike_unit);
+      if (spike_nsec_per_unit>0.0) printf(" (%.0f +/- %.0f nsec)", spike*spike_nsec_per_unit, ceil(spike*spike_nsec_per_unit*tsc_error_ppm/1e6));
+      if (cpu>=0) printf(" on CPU %d", cpu);
+      if (record->flags & SPIKE_FLAG_SMI) printf(" with an SMI");
+      if (record->flags & SPIKE_FLAG_MIGRATION) printf(" across a CPU migration");
+      printf("\n");
+      if (elapsed!=gap) printf("             %lu %s since last spike\n", gap/timesource->scale, timesource->unit);
+      if (record->flags & SPIKE_FLAG_COUNTERS) {
+         printf("             since then:");
+         for (counter=0; counter<SPIKE_COUNTERS; counter++)
+            if (perf_available & (1<<counter)) printf(" %lu %s", (unsigned long)record->counters[counter], perf_events[counter].name);
+         printf("\n");
+      }
+   } else if (format==CSV_FORMAT) {
+      if (cpu>=0) printf("%d,", cpu);
+      printf("%5lu.%.*lu,%lu"
+         , elapsed/1000000000L
+         , timesource->digits, (elapsed%1000000000L)/timesource->scale
+         , spike);
+      if (spike_nsec_per_unit>0.0) printf(",%.0f", spike*spike_nsec_per_unit);
+      if (options[SMI_SPIKES_OPTION]==1) printf(",%d", (record->flags & SPIKE_FLAG_SMI) ? 1 : 0);
+      if (migration_column==1) printf(",%d", (record->flags & SPIKE_FLAG_MIGRATION) ? 1 : 0);
+      for (counter=0; counter<SPIKE_COUNTERS; counter++)
+         if (perf_available & (1<<counter)) printf(",%lu", (unsigned long)record->counters[counter]);
+      if (elapsed!=gap) printf(",%lu", gap/timesource->scale);
+      printf("\n");
+   } else {
+      printf("      <datum>\n         ");
+      if (cpu>=0) printf("<cpu>%d</cpu>", cpu);
+      printf("<elapsed>%lu.%.*lu</elapsed><spike>%lu</spike>"
+         , elapsed/1000000000L
+         , timesource->digits, (elapsed%1000000000L)/timesource->scale
+         , spike);
+      if (spike_nsec_per_unit>0.0) printf("<spike_nsec>%.0f</spike_nsec>", spike*spike_nsec_per_unit);
+      if (record->flags & SPIKE_FLAG_SMI) printf("<smi>1</smi>");
+      if (record->flags & SPIKE_FLAG_MIGRATION) printf("<migration>1</migration>");
+      if (record->flags & SPIKE_FLAG_COUNTERS) {
+         for (counter=0; counter<SPIKE_COUNTERS; counter++)
+            if (perf_available & (1<<counter)) printf("<%s>%lu</%s>", perf_events[counter].tag, (unsigned long)record->counters[counter], perf_events[counter].tag);
+      }
+      if (elapsed!=gap) printf("<delta>%lu</delta>", gap/timesource->scale);
+      printf("\n      </datum>\n");
+   }
+}
+
+/* Seconds to the timesource's resolution, for the overhead totals */
+static inline void print_seconds(const char *before, unsigned long nsec, const char *after) {
+   printf("%s%lu.%.*lu%s", before, nsec/1000000000L, timesource->digits, (nsec%1000000000L)/timesource->scale, after);
+}
+
+static inline void print_big_diff(sampler_struct *s) {
+   spike_data_struct *spike;
+   unsigned long ndx;
+   if ((chatty >= 3) && (s->quiet == 0)) printf("%sDump a buffer of up to %lu spikes%s\n", XML_head, s->spike_ndx, XML_tail);
+/* Samplers on other CPUs may be dumping their buffers too; keep each buffer's lines together */
+   pthread_mutex_lock(&output_lock);
+   for (ndx=0; ndx<s->spike_ndx; ndx++) {
+      spike=&s->spikes[ndx];
+      if ((chatty>0) && (s->quiet == 0)) print_spike(spike, spike->time-s->last_printed, spike_units(s->method, spike->spike));
+      s->last_printed=spike->time;
+   }
+   s->spike_ndx=0;
+   fflush( stdout );
+   pthread_mutex_unlock(&output_lock);
+}
+
+/* Once every sampler has finished, print what is left in their buffers as one list ordered by elapsed
+   time, so spikes that hit several CPUs in the same window show up next to each other.
+*/
+static void print_merged_spikes(sampler_struct *samplers, int sampler_count) {
+   unsigned long *ndx;
+   int this, best;
+   spike_data_struct *spike;
+   if (sampler_count <= 0) return;
+   ndx=(unsigned long *)calloc(sampler_count, sizeof(unsigned long));
+   if (ndx == NULL) {
+      perror("unable to allocate memory to merge the spike buffers");
+      for (this=0; this<sampler_count; this++) if (samplers[this].spike_ndx>0) print_big_diff(&samplers[this]);
+      return;
+   }
+   for (;;) {
+      best=-1;
+      for (this=0; this<sampler_count; this++) {
+         if (ndx[this]>=samplers[this].spike_ndx) continue;
+         if ((best<0) || (samplers[this].spikes[ndx[this]].time<samplers[best].spikes[ndx[best]].time)) best=this;
+      }
+      if (best<0) break;
+      spike=&samplers[best].spikes[ndx[best]++];
+      if (chatty>0) print_spike(spike, spike->time-samplers[best].last_printed, spike_units(samplers[best].method, spike->spike));
+      samplers[best].last_printed=spike->time;
+   }
+   for (this=0; this<sampler_count; this++) samplers[this].spike_ndx=0;
+   free(ndx);
+   fflush( stdout );
+}
+
+/* Open the msr device of one CPU; the descriptor can then be read from any CPU with msr_pread() */
+static int msr_open(int cpu) {
+   char msr_path[64];
+   int fd;
+   sprintf(msr_path, "/dev/cpu/%d/msr", cpu);
+   fd=open(msr_path, O_RDONLY);
+   if (fd<0) perror("unable to access /dev/cpu/<core>/msr; perhaps the module is not loaded (try insmod msr)");
+   return fd;
+}
+
+/* One system call; the msr driver takes the MSR number as the file offset */
+static inline int msr_pread(int fd, unsigned long MSR, unsigned long *value) {
+   return (pread(fd, value, 8, (off_t)MSR) == 8) ? 0 : -1;
+}
+
+/* Count one event for the calling thread on whatever CPU it runs.  If kernel-mode counting is not
+   allowed (perf_event_paranoid) the hardware events fall back to user mode only.
+*/
+static int perf_open_event(int counter, int group_fd) {
+   struct perf_event_attr attr;
+   int fd;
+   memset(&attr, 0, sizeof(attr));
+   attr.size=sizeof(attr);
+   attr.type=perf_events[counter].type;
+   attr.config=perf_events[counter].config;
+   if (attr.type == PERF_TYPE_SOFTWARE) attr.read_format=PERF_FORMAT_GROUP;
+   fd=(int)syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+   if ((fd < 0) && (attr.type == PERF_TYPE_HARDWARE)) {
+      attr.exclude_kernel=1;
+      attr.exclude_hv=1;
+      fd=(int)syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+   }
+   return fd;
+}
+
+/* Open the counters in "wanted" for the calling thread; returns the bits of the ones that opened */
+static unsigned int perf_open(perf_counters_struct *perf, unsigned int wanted) {
+   unsigned int opened=0;
+   int counter;
+   memset(perf, 0, sizeof(perf_counters_struct));
+   perf->group_fd=-1;
+   for (counter=0; counter<SPIKE_COUNTERS; counter++) {
+      perf->fd[counter]=-1;
+      if ((wanted & (1<<counter)) == 0) continue;
+      if (perf_events[counter].type == PERF_TYPE_SOFTWARE) {
+         perf->fd[counter]=perf_open_event(counter, perf->group_fd);
+         if (perf->fd[counter] < 0) continue;
+         if (perf->group_fd < 0) perf->group_fd=perf->fd[counter];
+         perf->group_order[perf->group_size++]=counter;
       } else {
-         this_time=spikes[ndx].time;
-         cumulative+=this_time;
-         if ( chatty>0 ) {
-            if (format==FREEFORM_FORMAT) {
-               printf("%5u.%.6u Latency spike of %u %s\n"
-                  , (unsigned int)(cumulative/1000000L)
-                  , (unsigned int)(cumulative-(cumulative/1000000L)*1000000L)
-                  , spikes[ndx].spike
-                  , spike_unit);
-               if (cumulative!=this_time) printf("             %u usec since last spike\n"
-                  , spikes[ndx].time);
-            } else if (format==CSV_FORMAT) {
-               printf("%5u.%.6u,%u"
-                  , (unsigned int)(cumulative/1000000L)
-                  , (unsigned int)(cumulative-(cumulative/1000000L)*1000000L)
-                  , spikes[ndx].spike);
-               if (cumulative!=this_time) printf(",%u"
-                  , spikes[ndx].time);
-               printf("\n");
-            } else {
-               printf("      <datum>\n         <elapsed>%u.%.6u</elapsed><spike>%u</spike>"
-                  , (unsigned int)(cumulative/1000000L)
-                  , (unsigned int)(cumulative-(cumulative/1000000L)*1000000L)
-                  , spikes[ndx].spike);
-               if (cumulative!=this_time) printf("<delta>%u</delta>"
-                  , spikes[ndx].time);
-               printf("\n      </datum>\n");
-            }
+         perf->fd[counter]=perf_open_event(counter, -1);
+         if (perf->fd[counter] < 0) continue;
+         perf->page[counter]=(struct perf_event_mmap_page *)mmap(NULL, getpagesize(), PROT_READ, MAP_SHARED, perf->fd[counter], 0);
+         if (perf->page[counter] == MAP_FAILED) perf->page[counter]=NULL;
+      }
+      opened|=1<<counter;
+   }
+   return opened;
+}
+
+static void perf_close(perf_counters_struct *perf) {
+   int counter;
+   for (counter=0; counter<SPIKE_COUNTERS; counter++) {
+      if (perf->page[counter] != NULL) munmap(perf->page[counter], getpagesize());
+      if (perf->fd[counter] >= 0) close(perf->fd[counter]);
+      perf->page[counter]=NULL;
+      perf->fd[counter]=-1;
+   }
+}
+
+static inline uint64_t rdpmc(unsigned int counter) {
+   unsigned low, high;
+   asm volatile ("rdpmc" : "=a" (low), "=d" (high) : "c" (counter));
+   return ((uint64_t)high)<<32 | low;
+}
+
+/* The user-page protocol from linux/perf_event.h: retry if the kernel updated the page (e.g. the thread
+   was rescheduled) while we read it.  Without rdpmc access the count comes from read() instead.
+*/
+static inline uint64_t perf_read_hw(perf_counters_struct *perf, int counter) {
+   struct perf_event_mmap_page *page=perf->page[counter];
+   uint64_t value=0;
+   uint32_t seq, index;
+   int64_t pmc;
+   if (page != NULL) {
+      do {
+         seq=page->lock;
+         __atomic_signal_fence(__ATOMIC_SEQ_CST);
+         index=page->index;
+         if ((page->cap_user_rdpmc == 0) || (index == 0)) break;
+         pmc=(int64_t)rdpmc(index-1);
+         pmc<<=64-page->pmc_width;
+         pmc>>=64-page->pmc_width;
+         value=page->offset+pmc;
+         __atomic_signal_fence(__ATOMIC_SEQ_CST);
+         if (page->lock == seq) return value;
+      } while (1);
+   }
+   if (read(perf->fd[counter], &value, sizeof(value)) != sizeof(value)) value=0;
+   return value;
+}
+
+/* Current values of every open counter, less their values at the previous call */
+static inline void perf_deltas(perf_counters_struct *perf, uint64_t *deltas) {
+   uint64_t now[SPIKE_COUNTERS]={0}, group[SPIKE_COUNTERS+1];
+   int counter, ndx;
+   if ((perf->group_fd >= 0) && (read(perf->group_fd, group, (perf->group_size+1)*sizeof(uint64_t)) > 0)) {
+      for (ndx=0; (ndx<perf->group_size) && (ndx<(int)group[0]); ndx++) now[perf->group_order[ndx]]=group[ndx+1];
+   }
+   for (counter=0; counter<SPIKE_COUNTERS; counter++) {
+      if (perf->fd[counter] < 0) continue;
+      if (perf_events[counter].type == PERF_TYPE_HARDWARE) now[counter]=perf_read_hw(perf, counter);
+      if (deltas != NULL) deltas[counter]=now[counter]-perf->last[counter];
+      perf->last[counter]=now[counter];
+   }
+}
+
+/* Make room for another SPIKE_LOG_EXTENT of records: allocate the blocks, extend the mapping and write to
+   every new page so none of them faults while the sampler is storing spikes.  Growing happens in the
+   middle of a measurement, so the extents are large enough that it should rarely happen at all.
+*/
+static int spike_log_grow(spike_log_struct *log) {
+   size_t new_size=log->mapped+SPIKE_LOG_EXTENT, offset;
+   void *map;
+   if (posix_fallocate(log->fd, 0, new_size) != 0) return -1;
+   if (log->header == NULL)
+      map=mmap(NULL, new_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, log->fd, 0);
+   else
+      map=mremap(log->header, log->mapped, new_size, MREMAP_MAYMOVE);
+   if (map == MAP_FAILED) return -1;
+   for (offset=log->mapped; offset<new_size; offset+=getpagesize()) ((volatile char *)map)[offset]=0;
+   log->header=(spike_log_header_struct *)map;
+   log->records=(spike_data_struct *)((char *)map+SPIKE_LOG_HEADER_SIZE);
+   log->mapped=new_size;
+   log->capacity=(new_size-SPIKE_LOG_HEADER_SIZE)/sizeof(spike_data_struct);
+   return 0;
+}
+
+static int spike_log_open(spike_log_struct *log, const char *path, sampler_struct *s) {
+   spike_log_header_struct *header;
+   memset(log, 0, sizeof(spike_log_struct));
+   snprintf(log->path, sizeof(log->path), "%s", path);
+   log->fd=open(path, O_RDWR|O_CREAT|O_TRUNC, 0644);
+   if (log->fd < 0) {
+      fprintf(stderr, "unable to create the spike log \"%s\": %s\n", path, strerror(errno));
+      return -1;
+   }
+   if (spike_log_grow(log) != 0) {
+      fprintf(stderr, "unable to map the spike log \"%s\": %s\n", path, strerror(errno));
+      close(log->fd);
+      return -1;
+   }
+   header=log->header;
+   memcpy(header->magic, SPIKE_LOG_MAGIC, sizeof(header->magic));
+   header->version=SPIKE_LOG_VERSION;
+   header->header_size=SPIKE_LOG_HEADER_SIZE;
+   header->record_size=sizeof(spike_data_struct);
+   header->method=s->method;
+   header->cpu=s->cpu;
+   strncpy(header->timesource, timesource->name, sizeof(header->timesource)-1);
+   strncpy(header->spike_unit, CYCLE_METHOD(s->method) ? cycle_string : nsec_string, sizeof(header->spike_unit)-1);
+   header->nsec_per_cycle=CYCLE_METHOD(s->method) ? spike_nsec_per_unit : 0.0;
+   header->threshold=s->threshold;
+   header->start_time=time(NULL);
+   header->records=0;
+   return 0;
+}
+
+/* The record is stored before the count that covers it, so a reader of a killed run's log never sees a
+   half-written spike.
+*/
+static inline void spike_log_append(spike_log_struct *log, const spike_data_struct *spike) {
+   if ((log->count >= log->capacity) && (spike_log_grow(log) != 0)) {
+      log->drops++;
+      return;
+   }
+   log->records[log->count]=*spike;
+   __atomic_store_n(&log->header->records, ++log->count, __ATOMIC_RELEASE);
+}
+
+static void spike_log_close(spike_log_struct *log) {
+   if (log->header == NULL) return;
+   log->header->records=log->count;
+   munmap(log->header, log->mapped);
+   if (ftruncate(log->fd, SPIKE_LOG_HEADER_SIZE+log->count*sizeof(spike_data_struct)) != 0)
+      fprintf(stderr, "unable to truncate the spike log \"%s\": %s\n", log->path, strerror(errno));
+   close(log->fd);
+   log->header=NULL;
+}
+
+/* Each sampler stores its spikes in an anonymous mapping of its own.  Without "--buffer" it holds MAX_SPIKES
+   records on ordinary pages.  With "--buffer" the size is rounded up to whole 2MB pages and explicit huge
+   pages (MAP_HUGETLB) are tried first, then transparent huge pages; either way every page is faulted in
+   before the run and mincore() confirms that all of it is resident, so storing a spike never faults and a
+   buffer of gigabytes takes only a handful of TLB entries.
+*/
+#define ARENA_HUGE_PAGE (2UL<<20)
+#define ARENA_SMALL     0
+#define ARENA_THP       1
+#define ARENA_HUGETLB   2
+static const char *arena_pages_string[]={"small pages", "transparent huge pages", "hugetlb pages"};
+
+/* kB of AnonHugePages in the mapping that holds "addr", from /proc/self/smaps */
+static unsigned long arena_thp_kb(void *addr) {
+   FILE *smaps;
+   char line[256];
+   unsigned long start, end, kb=0L, value;
+   int inside=0;
+   smaps=fopen("/proc/self/smaps", "r");
+   if (smaps == NULL) return 0L;
+   while (fgets(line, sizeof(line), smaps) != NULL) {
+      if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+         if (inside) break;
+         inside=((unsigned long)addr >= start) && ((unsigned long)addr < end);
+      } else if (inside && (sscanf(line, "AnonHugePages: %lu kB", &value) == 1)) {
+         kb=value;
+      }
+   }
+   fclose(smaps);
+   return kb;
+}
+
+/* Bytes of the arena that mincore() reports resident */
+static size_t arena_resident(void *addr, size_t bytes) {
+   size_t page=getpagesize(), pages=(bytes+page-1)/page, ndx, resident=0;
+   unsigned char *vec=(unsigned char *)malloc(pages);
+   if (vec == NULL) return 0;
+   if (mincore(addr, bytes, vec) == 0) {
+      for (ndx=0; ndx<pages; ndx++) if (vec[ndx] & 1) resident+=page;
+   }
+   free(vec);
+   return resident;
+}
+
+static int spike_arena_map(sampler_struct *s, size_t bytes) {
+   void *map=MAP_FAILED;
+   size_t resident, offset, capacity=0;
+   char *aligned;
+   s->arena_pages=ARENA_SMALL;
+   if (bytes == 0) {
+/* Rounded up to a whole page, but still flushed every MAX_SPIKES spikes as it always has been */
+      capacity=MAX_SPIKES;
+      bytes=MAX_SPIKES*sizeof(spike_data_struct);
+      bytes=(bytes+getpagesize()-1)&~((size_t)getpagesize()-1);
+      map=mmap(NULL, bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, -1, 0);
+   } else {
+      bytes=(bytes+ARENA_HUGE_PAGE-1)&~(ARENA_HUGE_PAGE-1);
+      map=mmap(NULL, bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB|MAP_POPULATE, -1, 0);
+      if (map != MAP_FAILED) {
+         s->arena_pages=ARENA_HUGETLB;
+      } else {
+/* Transparent huge pages need a 2MB-aligned range; map one huge page extra and trim both ends */
+         map=mmap(NULL, bytes+ARENA_HUGE_PAGE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+         if (map != MAP_FAILED) {
+            aligned=(char *)(((unsigned long)map+ARENA_HUGE_PAGE-1)&~(ARENA_HUGE_PAGE-1));
+            if (aligned > (char *)map) munmap(map, aligned-(char *)map);
+            munmap(aligned+bytes, (char *)map+ARENA_HUGE_PAGE-aligned);
+            map=aligned;
+            if (madvise(map, bytes, MADV_HUGEPAGE) == 0) s->arena_pages=ARENA_THP;
+            for (offset=0; offset<bytes; offset+=getpagesize()) ((volatile char *)map)[offset]=0;
          }
       }
    }
-   *spike_ndx=0;
-   fflush( stdout );
+   if (map == MAP_FAILED) {
+      fprintf(stderr, "unable to map %lu bytes for the spike buffer: %s\n", (unsigned long)bytes, strerror(errno));
+      return -1;
+   }
+   s->spikes=(spike_data_struct *)map;
+   s->arena_bytes=bytes;
+   s->spike_capacity=(capacity != 0) ? capacity : bytes/sizeof(spike_data_struct);
+   s->spike_ndx=0;
+   resident=arena_resident(map, bytes);
+   if ((s->arena_pages == ARENA_THP) && (arena_thp_kb(map) == 0)) s->arena_pages=ARENA_SMALL;
+   if ((resident < bytes) && (chatty >= 1))
+      printf("%sonly %lu of the spike buffer's %lu bytes are resident%s\n", XML_head, (unsigned long)resident, (unsigned long)bytes, XML_tail);
+   if ((buffer_bytes != 0) && (chatty >= 2))
+      printf("%sspike buffer of %lu records (%lu MB) on %s; %lu MB resident%s\n", XML_head, s->spike_capacity, (unsigned long)(bytes>>20),
+             arena_pages_string[s->arena_pages], (unsigned long)(resident>>20), XML_tail);
+   return 0;
 }
 
-static inline void process_big_diff(struct timeval *t_stamp, struct timeval *last_spike_time, spike_data_struct *spikes, unsigned int *spike_ndx, unsigned long diff) {
-   unsigned long gap=(unsigned long)t_stamp->tv_sec * 1000000L + (unsigned long)t_stamp->tv_usec -
-      (((unsigned long)last_spike_time->tv_sec * 1000000L) + (unsigned long)last_spike_time->tv_usec);
-/* It's possible that there's a very long time between spikes (i.e., more than fits in a 32-bit counter).
-   I would rather not allocate twice as much memory for those unlikely cases, so when that happens I set the time
-   and spike values to 0 as a special case.  The next time-spike pair provides 64 bits for this long time,
-   and the subsequent spike field is where I keep the spike value.
-   
-   It's possible that "gettimeofday" returns the same value for up to 1 microsecond of elapsed time,
-   so it's conceivable that (for a very low threshold) a spike will happen within a single microsecond.
+/* The sampler's side of the ring: a copy of the record and a release store of "head" */
+static inline void ring_push(sampler_struct *s, const spike_data_struct *spike) {
+   spike_ring_struct *ring=s->ring;
+   unsigned long head=ring->head;
+   if (head-ring->cached_tail >= RING_RECORDS) {
+      ring->cached_tail=__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+      if (head-ring->cached_tail >= RING_RECORDS) {
+         s->ring_drops++;
+         return;
+      }
+   }
+   ring->records[head&(RING_RECORDS-1)]=*spike;
+   __atomic_store_n(&ring->head, head+1, __ATOMIC_RELEASE);
+}
+
+/* The writer polls every sampler's ring, always taking the oldest spike that is available, and sleeps
+   briefly when all of them are empty.  It runs on the "--writer" CPU so none of the printf() and fflush()
+   work lands on a measuring core.
 */
-   if (spike_header_printed == 0) {
-      if (format==XML_FORMAT) {
-         printf("%sElapsed time (seconds),latency spike (%s),delta time (%s)%s\n", XML_head, spike_unit, second_string, XML_tail);
-      } else if (format==CSV_FORMAT) {
-         printf("Elapsed time (seconds),latency spike (%s),delta time (%s)\n", spike_unit, second_string);
+static void *writer_thread(void *arg) {
+   writer_struct *w=(writer_struct *)arg;
+   struct timespec nap={0, 100000L};
+   unsigned long start, written, elapsed, best_elapsed=0L;
+   spike_ring_struct *ring;
+   spike_data_struct *record;
+   int this, best, done;
+   for (;;) {
+      done=__atomic_load_n(&w->done, __ATOMIC_ACQUIRE);
+      written=0;
+      start=get_cycles_p();
+      for (;;) {
+         best=-1;
+         for (this=0; this<w->sampler_count; this++) {
+            ring=w->samplers[this].ring;
+            if (ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) continue;
+            elapsed=ring->records[ring->tail&(RING_RECORDS-1)].time;
+            if ((best<0) || (elapsed<best_elapsed)) { best=this; best_elapsed=elapsed; }
+         }
+         if (best<0) break;
+         ring=w->samplers[best].ring;
+         record=&ring->records[ring->tail&(RING_RECORDS-1)];
+         if (chatty>0) {
+            pthread_mutex_lock(&output_lock);
+            if (spike_header_printed == 0) print_spike_header(w->samplers[best].cpu);
+            print_spike(record, record->time-ring->last_printed, spike_units(w->samplers[best].method, record->spike));
+            pthread_mutex_unlock(&output_lock);
+         }
+         ring->last_printed=record->time;
+         __atomic_store_n(&ring->tail, ring->tail+1, __ATOMIC_RELEASE);
+         written++;
+      }
+      if (written > 0) {
+         fflush( stdout );
+         w->records+=written;
+         w->overhead_cycles+=get_cycles_p()-start;
+      } else if (done) {
+         break;
+      } else {
+         nanosleep(&nap, NULL);
       }
-      spike_header_printed = 1;
    }
-   if (gap==(gap & 0xffffffffL)) {
-      spikes[*spike_ndx].time=gap;
-      spikes[*spike_ndx].spike=diff;
-      if (chatty >= 3) printf("%sspikes[%d] = %6u %6u%s\n", XML_head, *spike_ndx, spikes[*spike_ndx].time, spikes[*spike_ndx].spike, XML_tail);
+   return NULL;
+}
+
+/* "flags" is SPIKE_FLAG_MIGRATION when the two cycle readings came from different CPUs; such a "spike" is
+   a difference between two TSCs, so it is recorded but kept out of the spike totals.
+*/
+static inline void process_big_diff(sampler_struct *s, timesignature *t_stamp, unsigned long diff, uint32_t flags) {
+   spike_data_struct spike;
+   unsigned long smi_count;
+/* It's possible that "gettimeofday" returns the same value for up to 1 microsecond of elapsed time,
+   so it's conceivable that (for a very low threshold) a spike will happen within a single microsecond.
+*/
+   if (flags & SPIKE_FLAG_MIGRATION) {
+      s->migrations++;
    } else {
-      spikes[*spike_ndx].time=0;
-      spikes[*spike_ndx].spike=0;
-      *(unsigned long *)(&spikes[*spike_ndx+1].time)=gap;
-      spikes[*spike_ndx+2].time=0xdeaddead;
-      spikes[*spike_ndx+2].spike=diff;
-      if (chatty >= 3) {
-         printf("%sspikes[%d] = %6u %6u%s\n", XML_head, *spike_ndx, spikes[*spike_ndx].time, spikes[*spike_ndx].spike, XML_tail);
-         printf("%sspikes[%d] = %13lu%s\n", XML_head, *spike_ndx, *(unsigned long *)(&spikes[*spike_ndx+1].time), XML_tail);
-         printf("%sspikes[%d] = %6u %6u%s\n", XML_head, *spike_ndx, spikes[*spike_ndx+2].time, spikes[*spike_ndx+2].spike, XML_tail);
+      s->spike_count++;
+      if (diff > s->max_spike) s->max_spike = diff;
+      if (s->window != NULL) {
+         s->window->spike_count++;
+         if (diff > s->window->max_spike) s->window->max_spike = diff;
+      }
+   }
+   spike.time=tt_time_diff(t_stamp, &s->start_time);
+   spike.spike=diff;
+   spike.cpu=(uint32_t)s->cpu;
+   spike.flags=flags;
+   memset(spike.counters, 0, sizeof(spike.counters));
+   if (s->quiet == 0) {
+/* A change in MSR_SMI_COUNT since the previous spike means an SMI hit somewhere in between; anything long
+   enough to be worth noticing would itself have been a spike, so it is charged to this one.
+*/
+      if ((s->msr_fd >= 0) && (msr_pread(s->msr_fd, MSR_SMI_COUNT, &smi_count) == 0) && (smi_count != s->smi_count)) {
+         spike.flags|=SPIKE_FLAG_SMI;
+         s->smi_count=smi_count;
+         s->smi_spikes++;
+      }
+      if (s->perf != NULL) {
+         perf_deltas(s->perf, spike.counters);
+         spike.flags|=SPIKE_FLAG_COUNTERS;
+      }
+      if (s->log != NULL) {
+         spike_log_append(s->log, &spike);
+         return;
+      }
+      if (s->ring != NULL) {
+         ring_push(s, &spike);
+         return;
+      }
+   }
+   if (spike_header_printed == 0) print_spike_header(s->cpu);
+/* Only "--record-only" leaves a full arena unprinted */
+   if (s->spike_ndx>=s->spike_capacity) {
+      s->spike_drops++;
+      return;
+   }
+   s->spikes[s->spike_ndx]=spike;
+   if ((chatty >= 3) && (s->quiet == 0)) printf("%sspikes[%lu] = %13lu %6lu%s\n", XML_head, s->spike_ndx, (unsigned long)spike.time, diff, XML_tail);
+   s->spike_ndx++;
+/* Filled up the buffer; time to print it, unless the printing has to wait for the end of the run.
+*/
+   if ((s->spike_ndx>=s->spike_capacity) && ((record_only == 0) || (s->quiet == 1))) print_big_diff(s);
+}
+
+/* Per-CPU totals for a --cpus run, printed after the merged spike list */
+static void print_cpu_summary(sampler_struct *samplers, int sampler_count) {
+   int this;
+   sampler_struct *s;
+   if (format == CSV_FORMAT) {
+      printf("CPU,spikes,maximum spike (%s),minimum spike (%s)", spike_unit, spike_unit);
+      if (options[OVERHEAD_OPTION]==1) printf(",overhead (%s)", !CYCLE_METHOD(samplers[0].method)?"seconds":"cycles");
+      if (options[SMI_SPIKES_OPTION]==1) printf(",spikes with an SMI");
+      printf("\n");
+   }
+   for (this=0; this<sampler_count; this++) {
+      s=&samplers[this];
+      if (format == CSV_FORMAT) {
+         printf("%d,%lu,%lu,%lu", s->cpu, s->spike_count, spike_units(s->method, s->max_spike), spike_units(s->method, s->min_spike));
+         if (options[OVERHEAD_OPTION]==1) {
+            if (!CYCLE_METHOD(s->method)) print_seconds(",", s->overhead_nsec, "");
+            else printf(",%lu", s->overhead_cycles);
+         }
+         if (options[SMI_SPIKES_OPTION]==1) printf(",%lu", s->smi_spikes);
+         printf("\n");
+      } else if (format == XML_FORMAT) {
+         printf("      <cpu_summary>\n         <cpu>%d</cpu><spikes>%lu</spikes><maximum_spike>%lu</maximum_spike><minimum_spike>%lu</minimum_spike>", s->cpu, s->spike_count, spike_units(s->method, s->max_spike), spike_units(s->method, s->min_spike));
+         if (options[OVERHEAD_OPTION]==1) {
+            if (!CYCLE_METHOD(s->method)) print_seconds("<OverheadSeconds>", s->overhead_nsec, "</OverheadSeconds>");
+            else printf("<OverheadCycles>%lu</OverheadCycles>", s->overhead_cycles);
+         }
+         if (options[SMI_SPIKES_OPTION]==1) printf("<SMISpikes>%lu</SMISpikes>", s->smi_spikes);
+         printf("\n      </cpu_summary>\n");
+      } else {
+         printf("CPU %3d:  %lu spikes, maximum %lu %s, minimum %lu %s", s->cpu, s->spike_count, spike_units(s->method, s->max_spike), spike_unit, spike_units(s->method, s->min_spike), spike_unit);
+         if (options[OVERHEAD_OPTION]==1) {
+            if (!CYCLE_METHOD(s->method)) print_seconds(", overhead ", s->overhead_nsec, " seconds");
+            else printf(", overhead %lu cycles", s->overhead_cycles);
+         }
+         if (options[SMI_SPIKES_OPTION]==1) printf(", %lu with an SMI", s->smi_spikes);
+         printf("\n");
       }
-      (*spike_ndx)+=2;
    }
-   (*spike_ndx)++;
-/* Filled up the buffer; time to print it.
+}
+
+/* Percentiles and the non-empty buckets of one sampler's histogram.  A percentile is reported as the highest
+   value in the bucket where it falls (capped at the maximum), so it never understates the latency.
+   When there were no spikes the maximum is only known to within its bucket.  TIME-method histograms are
+   always in nanoseconds, whatever unit the timesource reports its spikes in.
 */
-   if (*spike_ndx>=MAX_SPIKES) print_big_diff(spikes, spike_ndx);
-   *last_spike_time = *t_stamp;
+static void print_histogram(sampler_struct *s) {
+   static const double percentiles[]={50.0, 90.0, 99.0, 99.9, 99.99, 99.999};
+   histogram_struct *hist=s->hist;
+   unsigned long total, maximum, value;
+   unsigned int ndx, top=0, pct;
+   char cpu_label[32]="";
+   const char *unit=(s->method==TIME_METHOD) ? nsec_string : spike_unit;
+   total=hist_total(hist);
+   if (total == 0) return;
+   for (ndx=0; ndx<HIST_BUCKETS; ndx++) if (hist->count[ndx] != 0) top=ndx;
+   maximum=(s->spike_count > 0) ? s->max_spike : hist_high(top);
+   if (s->cpu >= 0) {
+      if (format == CSV_FORMAT) sprintf(cpu_label, "%d,", s->cpu);
+      else if (format == XML_FORMAT) sprintf(cpu_label, "<cpu>%d</cpu>", s->cpu);
+      else sprintf(cpu_label, " for CPU %d", s->cpu);
+   }
+   if (format == CSV_FORMAT) {
+      printf("%spercentile,latency (%s)\n", (s->cpu>=0)?"CPU,":"", unit);
+      printf("%siterations,%lu\n", cpu_label, total);
+   } else if (format == XML_FORMAT) {
+      printf("      <histogram>\n         %s<iterations>%lu</iterations><units>%s</units>\n", cpu_label, total, unit);
+   } else {
+      printf("Latency histogram%s:  %lu iterations\n", cpu_label, total);
+   }
+   for (pct=0; pct<sizeof(percentiles)/sizeof(percentiles[0]); pct++) {
+      value=hist_percentile(hist, total, percentiles[pct], maximum);
+      if (format == CSV_FORMAT) printf("%sp%g,%lu\n", cpu_label, percentiles[pct], value);
+      else if (format == XML_FORMAT) printf("         <percentile><p>%g</p><value>%lu</value></percentile>\n", percentiles[pct], value);
+      else printf("   p%-7g <= %lu %s\n", percentiles[pct], value, unit);
+   }
+   if (format == CSV_FORMAT) {
+      printf("%smaximum,%lu\n", cpu_label, maximum);
+      printf("%sbucket low (%s),bucket high (%s),count\n", (s->cpu>=0)?"CPU,":"", unit, unit);
+   } else if (format == XML_FORMAT) {
+      printf("         <maximum>%lu</maximum>\n", maximum);
+   } else {
+      printf("   maximum  = %lu %s\n", maximum, unit);
+      printf("   %12s %12s %14s\n", "low", "high", "count");
+   }
+   for (ndx=0; ndx<HIST_BUCKETS; ndx++) {
+      if (hist->count[ndx] == 0) continue;
+      if (format == CSV_FORMAT) printf("%s%lu,%lu,%lu\n", cpu_label, hist_low(ndx), hist_high(ndx), hist->count[ndx]);
+      else if (format == XML_FORMAT) printf("         <bucket><low>%lu</low><high>%lu</high><count>%lu</count></bucket>\n", hist_low(ndx), hist_high(ndx), hist->count[ndx]);
+      else printf("   %12lu %12lu %14lu\n", hist_low(ndx), hist_high(ndx), hist->count[ndx]);
+   }
+   if (format == XML_FORMAT) printf("      </histogram>\n");
 }
 
 static int scheduler_priority() {
@@ -539,72 +1535,2800 @@ static int get_my_cpu() {
 }
 
 static int msr_read(unsigned long MSR, unsigned long *value, unsigned long core __attribute__ ((__unused__)) ) {
-   static int (*msr_fd_ptr)[]=NULL;
-   static unsigned long (*SMI_count_ptr)[]=NULL;
+   static int *msr_fd=NULL;
    static long num_cores;
    int this_core;
-   int count;
-   off_t offset;
 /* The "core" paramenter is not used, but the intent is to use it to get the MSR value for a different core
 */
 /* Ensure we can access the output buffer
 */
    if (value==NULL) return -1;
    *value=0x8BadBeef;
-   num_cores=sysconf(_SC_NPROCESSORS_CONF);
-   if (num_cores == -1) {
-      perror("unable to determine number of cores\n");
+   if (msr_fd == NULL) {
+      num_cores=sysconf(_SC_NPROCESSORS_CONF);
+      if (num_cores == -1) {
+         perror("unable to determine number of cores\n");
+         options[SMI_OPTION]=0;
+         return -1;
+      }
+      msr_fd=(int *)calloc(num_cores, sizeof(int));
+      if (msr_fd == NULL) {
+         perror("unable to allocate memory for SMI_COUNT functionality\n");
+         options[SMI_OPTION]=0;
+         return -1;
+      }
+   }
+   this_core = get_my_cpu();
+/* sched_getcpu is not available on RHEL 5 variants
+   this_core = sched_getcpu();
+*/
+   if ((this_core<0) || (this_core>=num_cores)) {
+      perror("unable to determine current core\n");
       options[SMI_OPTION]=0;
       return -1;
    }
-   if (msr_fd_ptr == NULL) {
-      msr_fd_ptr=(int (*)[])calloc(num_cores, sizeof(int));
-      if (msr_fd_ptr == NULL) {
-         perror("unable to allocate memory for SMI_COUNT functionality\n");
+/* The descriptors are opened +1 so that calloc's zeros mean "not open yet" */
+   if (msr_fd[this_core] == 0) {
+      int fd=msr_open(this_core);
+      if (fd<0) {
          options[SMI_OPTION]=0;
          return -1;
       }
-      SMI_count_ptr=(unsigned long (*)[])calloc(num_cores, sizeof(unsigned long));
-      if (SMI_count_ptr == NULL) {
-         perror("unable to allocate memory for SMI_COUNT functionality\n");
-         options[SMI_OPTION]=0;
-         return -1;
+      msr_fd[this_core]=fd+1;
+   }
+   if (msr_pread(msr_fd[this_core]-1, MSR, value) != 0) {
+      perror("unable to access /dev/cpu/<this core>/msr\n");
+      close(msr_fd[this_core]-1);
+      msr_fd[this_core]=0;
+      options[SMI_OPTION]=0;
+      return -1;
+   }
+   return 8;
+}
+
+/* The power_hog kernels.  Each is compiled for its own instruction set with a target attribute, so the
+program runs anywhere and hog_isas[] picks the best one the CPU has (or the one "--hog-isa" names) at run
+time.  acc=acc*mul+add converges to add/(1-mul), so the values stay normal however long the run is.
+*/
+static void hog_idle(hog_state_struct *hog __attribute__ ((__unused__)), unsigned int intensity __attribute__ ((__unused__))) {
+}
+
+static void hog_sse(hog_state_struct *hog, unsigned int intensity) {
+   __m128d acc[HOG_CHAINS], mul=_mm_load_pd(hog->mul), add=_mm_load_pd(hog->add);
+   unsigned int pass, chain;
+   for (chain=0; chain<HOG_CHAINS; chain++) acc[chain]=_mm_load_pd(&hog->acc[chain*2]);
+   for (pass=0; pass<intensity; pass++) {
+#pragma GCC unroll 16
+      for (chain=0; chain<HOG_CHAINS; chain++) acc[chain]=_mm_add_pd(_mm_mul_pd(acc[chain], mul), add);
+   }
+   for (chain=0; chain<HOG_CHAINS; chain++) _mm_store_pd(&hog->acc[chain*2], acc[chain]);
+}
+
+__attribute__ ((target ("avx2,fma")))
+static void hog_avx2(hog_state_struct *hog, unsigned int intensity) {
+   __m256d acc[HOG_CHAINS], mul=_mm256_load_pd(hog->mul), add=_mm256_load_pd(hog->add);
+   unsigned int pass, chain;
+   for (chain=0; chain<HOG_CHAINS; chain++) acc[chain]=_mm256_load_pd(&hog->acc[chain*4]);
+   for (pass=0; pass<intensity; pass++) {
+#pragma GCC unroll 16
+      for (chain=0; chain<HOG_CHAINS; chain++) acc[chain]=_mm256_fmadd_pd(acc[chain], mul, add);
+   }
+   for (chain=0; chain<HOG_CHAINS; chain++) _mm256_store_pd(&hog->acc[chain*4], acc[chain]);
+}
+
+__attribute__ ((target ("avx512f")))
+static void hog_avx512(hog_state_struct *hog, unsigned int intensity) {
+   __m512d acc[HOG_CHAINS], mul=_mm512_load_pd(hog->mul), add=_mm512_load_pd(hog->add);
+   unsigned int pass, chain;
+   for (chain=0; chain<HOG_CHAINS; chain++) acc[chain]=_mm512_load_pd(&hog->acc[chain*8]);
+   for (pass=0; pass<intensity; pass++) {
+#pragma GCC unroll 16
+      for (chain=0; chain<HOG_CHAINS; chain++) acc[chain]=_mm512_fmadd_pd(acc[chain], mul, add);
+   }
+   for (chain=0; chain<HOG_CHAINS; chain++) _mm512_store_pd(&hog->acc[chain*8], acc[chain]);
+}
+
+static int hog_has_sse() { return __builtin_cpu_supports("sse2"); }
+static int hog_has_avx2() { return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"); }
+static int hog_has_avx512() { return __builtin_cpu_supports("avx512f"); }
+
+typedef struct hog_isa {
+   const char *name;
+   void (*kernel)(hog_state_struct *, unsigned int);
+   int (*supported)();
+   unsigned int flops;                 /* double-precision flops per chain per pass */
+} hog_isa_struct;
+/* Best first */
+static const hog_isa_struct hog_isas[]={
+   {"avx512", hog_avx512, hog_has_avx512, 16},
+   {"avx2",   hog_avx2,   hog_has_avx2,    8},
+   {"sse",    hog_sse,    hog_has_sse,     4},
+   {NULL,     NULL,       NULL,            0}};
+static const hog_isa_struct *hog_isa=NULL;     /* NULL until chosen; "auto" leaves it NULL */
+static unsigned int hog_intensity=1;
+
+/* Choose a power_hog kernel by name, e.g. "avx2" or "avx5"; returns 0 if the name is unknown or ambiguous */
+static int parse_hog_isa(const char *name) {
+   const hog_isa_struct *isa, *found=NULL;
+   if (strcasecmp(name, "auto") == 0) {
+      hog_isa=NULL;
+      return 1;
+   }
+   for (isa=hog_isas; isa->name!=NULL; isa++) {
+      if (strcasecmp(name, isa->name) == 0) { found=isa; break; }
+      if (compare_parameters(name, isa->name) > 0) {
+         if (found != NULL) return 0;
+         found=isa;
+      }
+   }
+   if (found == NULL) return 0;
+   hog_isa=found;
+   return 1;
+}
+
+/* Cycles per iteration of the power_hog loop, spikes included; with a calibrated TSC also the rate the
+   kernel sustained, which drops when the core runs under a lower frequency license.
+*/
+static void print_hog_summary(sampler_struct *samplers, int sampler_count) {
+   int this;
+   sampler_struct *s;
+   double per_iteration, gflops;
+   if (format == CSV_FORMAT) printf("%spower hog kernel,intensity,cycles per iteration%s\n", (samplers[0].cpu>=0)?"CPU,":"", (spike_nsec_per_unit>0.0)?",GFLOP/s":"");
+   for (this=0; this<sampler_count; this++) {
+      s=&samplers[this];
+      if (s->iterations == 0) continue;
+      per_iteration=(double)s->hog_cycles/(double)s->iterations;
+      gflops=(spike_nsec_per_unit>0.0) ? (double)(HOG_CHAINS*hog_isa->flops*hog_intensity)/(per_iteration*spike_nsec_per_unit) : 0.0;
+      if (format == CSV_FORMAT) {
+         if (s->cpu>=0) printf("%d,", s->cpu);
+         printf("%s,%u,%.1f", hog_isa->name, hog_intensity, per_iteration);
+         if (gflops>0.0) printf(",%.2f", gflops);
+         printf("\n");
+      } else if (format == XML_FORMAT) {
+         printf("      <power_hog>");
+         if (s->cpu>=0) printf("<cpu>%d</cpu>", s->cpu);
+         printf("<kernel>%s</kernel><intensity>%u</intensity><cycles_per_iteration>%.1f</cycles_per_iteration>", hog_isa->name, hog_intensity, per_iteration);
+         if (gflops>0.0) printf("<GFLOPs>%.2f</GFLOPs>", gflops);
+         printf("</power_hog>\n");
+      } else {
+         printf("Power hog:  %s kernel, intensity %u, %.1f cycles per iteration", hog_isa->name, hog_intensity, per_iteration);
+         if (gflops>0.0) printf(", %.2f GFLOP/s", gflops);
+         if (s->cpu>=0) printf(" on CPU %d", s->cpu);
+         printf("\n");
+      }
+   }
+}
+
+static void hog_init(hog_state_struct *hog) {
+   unsigned int ndx;
+   for (ndx=0; ndx<HOG_CHAINS*8; ndx++) hog->acc[ndx]=1.0+ndx/1024.0;
+   for (ndx=0; ndx<8; ndx++) {
+      hog->mul[ndx]=0.999999;
+      hog->add[ndx]=0.000001;
+   }
+}
+
+/* The wakeup method's timer period, in nanoseconds */
+static unsigned long wakeup_period=period_wakeup_default*1000L;
+
+/* The sampling loops.  generic_sample() is the loop the way it has always been: it looks at the method, the
+histogram and the power_hog option on every pass and reads the clock through tt_gettime().  The kernels
+after it are the same loop compiled once for every combination of timesource, histogram and power_hog
+kernel, so each iteration is down to the clock read, the subtraction and the threshold compare.  The
+clock is read without tt_gettime()'s verbosity and return-code checks, the TIME loop is unrolled twice
+so the two stamps simply trade places instead of being indexed with count%2, and the minimum is kept in
+a register.  main() picks the kernels for each sampler with select_sample_kernel() before the run, and
+"--benchmark-kernels" compares the chosen one with generic_sample().
+*/
+static void generic_sample(sampler_struct *s, unsigned long loopcount, unsigned long threshold) {
+   unsigned long count, diff;
+   histogram_struct *hist=s->hist;
+   if (s->method==TIME_METHOD) {
+      timesignature t_stamps[2], temp_stamp;
+      tt_gettime (&t_stamps[0]);
+      for (count = 1; count <= loopcount; count++) {
+         tt_gettime (&t_stamps[count%2]);
+         diff = tt_time_diff(&t_stamps[count%2], &t_stamps[(count-1)%2]);
+         if (hist != NULL) hist_record(hist, diff);
+         if (diff >= threshold) {
+            process_big_diff(s, &(t_stamps[count%2]), diff, 0);
+            tt_gettime (&temp_stamp);
+            s->overhead_nsec+=tt_time_diff(&temp_stamp, &t_stamps[count%2]);
+            t_stamps[count%2]=temp_stamp;
+         } else
+            if (diff < s->min_spike) s->min_spike = diff;
+      }
+   } else if ( options[POWER_HOG_OPTION]==1) {
+/* The kernel only runs on the measured pass, so the vector units' warm-up and any frequency license
+   change show up as spikes at its start instead of being absorbed by the warm-up pass.
+*/
+      void (*kernel)(hog_state_struct *, unsigned int)=(s->quiet == 0) ? hog_isa->kernel : hog_idle;
+      unsigned int intensity=hog_intensity;
+      unsigned long cycle_stamp[2], temp_cycles, first_cycles;
+      timesignature spike_time;
+      hog_init(&s->hog);
+      cycle_stamp[0]=first_cycles=get_cycles();
+      for (count = 1; count <= loopcount; count++) {
+         kernel(&s->hog, intensity);
+         cycle_stamp[count%2]=get_cycles();
+         diff = cycle_stamp[count%2] - cycle_stamp[(count-1)%2];
+         if (hist != NULL) hist_record(hist, diff);
+         if (diff >= threshold) {
+            tt_gettime(&spike_time);
+            process_big_diff(s, &spike_time, diff, 0);
+            temp_cycles=get_cycles();
+            s->overhead_cycles+=(temp_cycles-cycle_stamp[count%2]);
+            cycle_stamp[count%2]=temp_cycles;
+         } else
+            if (diff < s->min_spike) s->min_spike = diff;
+      }
+      s->hog_cycles+=cycle_stamp[loopcount%2]-first_cycles;
+   } else {
+      unsigned long cycle_stamp[2], temp_cycles;
+      timesignature spike_time;
+      cycle_stamp[0]=get_cycles_p();
+      for (count = 1; count <= loopcount; count++) {
+         cycle_stamp[count%2]=get_cycles_p();
+         diff = cycle_stamp[count%2] - cycle_stamp[(count-1)%2];
+         if (hist != NULL) hist_record(hist, diff);
+         if (diff >= threshold) {
+            tt_gettime(&spike_time);
+            process_big_diff(s, &spike_time, diff, 0);
+            temp_cycles=get_cycles_p();
+            s->overhead_cycles+=(temp_cycles-cycle_stamp[count%2]);
+            cycle_stamp[count%2]=temp_cycles;
+         } else
+            if (diff < s->min_spike) s->min_spike = diff;
+      }
+   }
+}
+
+static inline __attribute__ ((always_inline)) void read_clock(const clockid_t clock_id, timesignature *tvr) {
+#ifndef FAKE
+   if (clock_id < 0) {
+      struct timeval tv;
+      gettimeofday(&tv, NULL);
+      tvr->tv_sec=tv.tv_sec;
+      tvr->tv_nsec=tv.tv_usec*1000L;
+   } else
+      clock_gettime(clock_id, tvr);
+#else
+   tt_gettime(tvr);
+#endif
+}
+
+/* One TIME iteration: read "now" and compare it with "then" */
+static inline __attribute__ ((always_inline)) void time_step(sampler_struct *s, unsigned long threshold, const clockid_t clock_id, const int use_hist,
+                                                             unsigned long *min_spike, timesignature *now, timesignature *then) {
+   unsigned long diff;
+   timesignature temp_stamp;
+   read_clock(clock_id, now);
+   diff = tt_time_diff(now, then);
+   if (use_hist) hist_record(s->hist, diff);
+   if (__builtin_expect(diff >= threshold, 0)) {
+      process_big_diff(s, now, diff, 0);
+      read_clock(clock_id, &temp_stamp);
+      s->overhead_nsec+=tt_time_diff(&temp_stamp, now);
+      *now=temp_stamp;
+   } else
+      if (diff < *min_spike) *min_spike = diff;
+}
+
+static inline __attribute__ ((always_inline)) void time_kernel(sampler_struct *s, unsigned long loopcount, unsigned long threshold, const clockid_t clock_id, const int use_hist) {
+   unsigned long count, min_spike=s->min_spike;
+   timesignature even, odd, entry;
+/* A chunk after the first starts from the previous chunk's last reading, so the time spent between chunks
+   is measured like any other iteration; it is also counted as overhead
+*/
+   if (s->chunk_carry) {
+      even=s->chunk_stamp;
+      read_clock(clock_id, &entry);
+      s->overhead_nsec+=tt_time_diff(&entry, &even);
+   } else
+      read_clock(clock_id, &even);
+   for (count = 1; count < loopcount; count+=2) {
+      time_step(s, threshold, clock_id, use_hist, &min_spike, &odd, &even);
+      time_step(s, threshold, clock_id, use_hist, &min_spike, &even, &odd);
+   }
+   if (count == loopcount) time_step(s, threshold, clock_id, use_hist, &min_spike, &odd, &even);
+   s->min_spike=min_spike;
+   s->chunk_stamp=(count == loopcount) ? odd : even;
+   s->chunk_carry=1;
+}
+
+/* "hog" is NULL for the plain rdtscp loop; the power_hog loops time themselves with rdtsc as before */
+static inline __attribute__ ((always_inline)) void cycles_kernel(sampler_struct *s, unsigned long loopcount, unsigned long threshold, const int use_hist,
+                                                                 void (* const hog)(hog_state_struct *, unsigned int)) {
+   unsigned long count, diff, now, then, first, temp_cycles, min_spike=s->min_spike;
+   unsigned int intensity=hog_intensity, aux=0, aux_then=0;
+   timesignature spike_time;
+/* Without a power_hog the loop reads rdtscp, and a change of TSC_AUX between two readings means the thread
+   moved to another CPU in between; the power_hog loops read rdtsc and can't tell
+*/
+   if (hog != NULL) hog_init(&s->hog);
+/* A chunk after the first starts from the previous chunk's last reading, as in time_kernel() */
+   if (s->chunk_carry) {
+      then=s->chunk_cycles;
+      aux_then=s->chunk_aux;
+      first=(hog != NULL) ? get_cycles() : get_cycles_aux(&aux);
+      s->overhead_cycles+=first-then;
+   } else
+      then=first=(hog != NULL) ? get_cycles() : get_cycles_aux(&aux_then);
+   for (count = 1; count <= loopcount; count++) {
+      if (hog != NULL) hog(&s->hog, intensity);
+      now=(hog != NULL) ? get_cycles() : get_cycles_aux(&aux);
+      diff = now - then;
+      if (use_hist && (aux == aux_then)) hist_record(s->hist, diff);
+      if (__builtin_expect((diff >= threshold) | (aux != aux_then), 0)) {
+         tt_gettime(&spike_time);
+         process_big_diff(s, &spike_time, diff, (aux != aux_then) ? SPIKE_FLAG_MIGRATION : 0);
+         temp_cycles=(hog != NULL) ? get_cycles() : get_cycles_aux(&aux);
+         s->overhead_cycles+=(temp_cycles-now);
+         now=temp_cycles;
+      } else
+         if (diff < min_spike) min_spike = diff;
+      then=now;
+      aux_then=aux;
+   }
+   s->min_spike=min_spike;
+   s->chunk_cycles=then;
+   s->chunk_aux=aux_then;
+   s->chunk_carry=1;
+   if (hog != NULL) s->hog_cycles+=then-first;
+}
+
+/* The wakeup method sleeps to absolute deadlines one period apart, so a late wakeup doesn't push the later
+   ones back.  How far past its deadline the thread starts running again is the "spike".  The deadline is
+   kept in the sampler so a run cut into "--interval" pieces keeps its cadence.
+*/
+static void wakeup_sample(sampler_struct *s, unsigned long loopcount, unsigned long threshold) {
+   unsigned long count, diff;
+   int rv;
+   histogram_struct *hist=s->hist;
+   timesignature *deadline=&s->wakeup_deadline, woke, temp_stamp;
+   for (count = 1; count <= loopcount; count++) {
+      deadline->tv_nsec+=wakeup_period;
+      while (deadline->tv_nsec >= 1000000000L) {
+         deadline->tv_nsec-=1000000000L;
+         deadline->tv_sec++;
+      }
+      while ((rv=clock_nanosleep(timesource->clock_id, TIMER_ABSTIME, deadline, NULL)) == EINTR) ;
+/* A sleep that failed returned at once; recording it would report a perfect wakeup that never happened */
+      if (rv != 0) {
+         fprintf (stderr, "clock_nanosleep() on the %s clock failed: %s\n", timesource->name, strerror(rv));
+         exit (1);
+      }
+      tt_gettime (&woke);
+      diff = ((woke.tv_sec > deadline->tv_sec) || ((woke.tv_sec == deadline->tv_sec) && (woke.tv_nsec >= deadline->tv_nsec))) ? tt_time_diff(&woke, deadline) : 0L;
+      if (hist != NULL) hist_record(hist, diff);
+      if (diff >= threshold) {
+         process_big_diff(s, &woke, diff, 0);
+         tt_gettime (&temp_stamp);
+         s->overhead_nsec+=tt_time_diff(&temp_stamp, &woke);
+      } else
+         if (diff < s->min_spike) s->min_spike = diff;
+   }
+}
+
+/* A single random cycle through "count" cache lines: each line holds the address of the next, so every load
+   depends on the one before and the prefetchers can't guess ahead.  Sattolo's shuffle yields a cyclic
+   permutation, so line i can simply point at line perm[i].  The permutation is shuffled in the lines
+   themselves, as indices, and the indices are then turned into addresses.  That way no side array is
+   needed, which would be 1/8 of the buffer.
+*/
+static void chase_chain_init(char *lines, unsigned long count, unsigned long seed) {
+   unsigned long ndx, other, temp;
+#define CHASE_SLOT(ndx) (*(unsigned long *)(lines+(ndx)*CACHE_LINE_SIZE))
+   for (ndx=0; ndx<count; ndx++) CHASE_SLOT(ndx)=ndx;
+   for (ndx=count-1; ndx>0; ndx--) {
+      seed^=seed<<13; seed^=seed>>7; seed^=seed<<17;
+      other=seed%ndx;
+      temp=CHASE_SLOT(ndx); CHASE_SLOT(ndx)=CHASE_SLOT(other); CHASE_SLOT(other)=temp;
+   }
+   for (ndx=0; ndx<count; ndx++) *(char **)(lines+ndx*CACHE_LINE_SIZE)=lines+CHASE_SLOT(ndx)*CACHE_LINE_SIZE;
+#undef CHASE_SLOT
+}
+
+/* The NUMA node a CPU belongs to, from the nodeN link in its sysfs directory; -1 if there is none */
+static int cpu_node(int cpu) {
+   char path[64];
+   DIR *dir;
+   struct dirent *entry;
+   int node=-1;
+   snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+   dir=opendir(path);
+   if (dir == NULL) return -1;
+   while ((entry=readdir(dir)) != NULL) {
+      if ((strncmp(entry->d_name, "node", 4) == 0) && isdigit((unsigned char)entry->d_name[4])) {
+         node=atoi(entry->d_name+4);
+         break;
+      }
+   }
+   closedir(dir);
+   return node;
+}
+
+/* The memchase method's buffer: chase_bytes of ordinary anonymous memory per sampler, bound with mbind() to
+   "--chase-node" or else to the node of the sampler's CPU.  The chain is built here, in main(), so every page
+   is faulted in on that node before mlockall(); move_pages() then reports where the pages really are.
+*/
+static int chase_map(sampler_struct *s, size_t bytes, int node) {
+   unsigned long nodemask[CHASE_MAX_NODES/(8*sizeof(unsigned long))], pages, ndx, on_node=0L;
+   size_t page=getpagesize();
+   void **addresses;
+   int *status;
+   char *lines;
+   if ((node < 0) && (s->cpu >= 0)) node=cpu_node(s->cpu);
+   lines=(char *)mmap(NULL, bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+   if (lines == MAP_FAILED) {
+      fprintf(stderr, "unable to map %lu bytes for the pointer chase: %s\n", (unsigned long)bytes, strerror(errno));
+      return -1;
+   }
+   if (node >= 0) {
+      memset(nodemask, 0, sizeof(nodemask));
+      nodemask[node/(8*sizeof(unsigned long))]|=1UL<<(node%(8*sizeof(unsigned long)));
+      if (syscall(SYS_mbind, lines, bytes, MPOL_BIND, nodemask, 8*sizeof(nodemask)+1, MPOL_MF_STRICT|MPOL_MF_MOVE) != 0) {
+         fprintf(stderr, "unable to bind the pointer chase to NUMA node %d: %s\n", node, strerror(errno));
+         munmap(lines, bytes);
+         return -1;
+      }
+   }
+   chase_chain_init(lines, bytes/CACHE_LINE_SIZE, 0x2545F4914F6CDD1DUL+s->cpu);
+   s->chase=lines;
+   s->chase_at=lines;
+   s->chase_bytes=bytes;
+   s->chase_node=node;
+   pages=(bytes+page-1)/page;
+   addresses=(void **)malloc(pages*sizeof(void *));
+   status=(int *)malloc(pages*sizeof(int));
+   if ((addresses != NULL) && (status != NULL)) {
+      for (ndx=0; ndx<pages; ndx++) addresses[ndx]=lines+ndx*page;
+/* With no "nodes" to move them to, move_pages() only says which node each page is on */
+      if (syscall(SYS_move_pages, 0, pages, addresses, NULL, status, 0) == 0) {
+         if (s->chase_node < 0) s->chase_node=status[0];
+         for (ndx=0; ndx<pages; ndx++) if (status[ndx] == s->chase_node) on_node++;
+      }
+   }
+   free(addresses);
+   free(status);
+   s->chase_on_node=on_node;
+   if ((on_node < pages) && (chatty >= 1))
+      printf("%sonly %lu of the pointer chase's %lu pages are on NUMA node %d%s\n", XML_head, on_node, pages, s->chase_node, XML_tail);
+   if (chatty >= 2)
+      printf("%spointer chase of %lu MB (%lu cache lines) on NUMA node %d%s\n", XML_head, (unsigned long)(bytes>>20), (unsigned long)(bytes/CACHE_LINE_SIZE), s->chase_node, XML_tail);
+   return 0;
+}
+
+/* The memchase method follows the chain CHASE_HOPS loads at a time and times each block with rdtscp, so a
+   stall on the memory side (a TLB shootdown, a NUMA balancing hinting fault or page migration, compaction,
+   a refresh cycle) shows up as a spike in cycles.  rdtscp waits for the loads before it; the empty asm keeps
+   the compiler from moving them past it.  The position in the chain is kept in the sampler between calls.
+*/
+static void memchase_sample(sampler_struct *s, unsigned long loopcount, unsigned long threshold) {
+   unsigned long count, diff, now, then, temp_cycles, min_spike=s->min_spike;
+   unsigned int hop, aux=0, aux_then=0;
+   histogram_struct *hist=s->hist;
+   char **line=(char **)s->chase_at;
+   timesignature spike_time;
+/* A chunk after the first starts from the previous chunk's last reading, as in time_kernel() */
+   if (s->chunk_carry) {
+      then=s->chunk_cycles;
+      aux_then=s->chunk_aux;
+      s->overhead_cycles+=get_cycles_aux(&aux)-then;
+   } else
+      then=get_cycles_aux(&aux_then);
+   for (count = 1; count <= loopcount; count++) {
+      for (hop=0; hop<CHASE_HOPS; hop++) line=(char **)*line;
+      asm volatile ("" : "+r" (line));
+      now=get_cycles_aux(&aux);
+      diff = now - then;
+      if ((hist != NULL) && (aux == aux_then)) hist_record(hist, diff);
+      if (__builtin_expect((diff >= threshold) | (aux != aux_then), 0)) {
+         tt_gettime(&spike_time);
+         process_big_diff(s, &spike_time, diff, (aux != aux_then) ? SPIKE_FLAG_MIGRATION : 0);
+         temp_cycles=get_cycles_aux(&aux);
+         s->overhead_cycles+=(temp_cycles-now);
+         now=temp_cycles;
+      } else
+         if (diff < min_spike) min_spike = diff;
+      then=now;
+      aux_then=aux;
+   }
+   s->chase_at=(char *)line;
+   s->min_spike=min_spike;
+   s->chunk_cycles=then;
+   s->chunk_aux=aux_then;
+   s->chunk_carry=1;
+}
+
+#define TIME_KERNEL(name, clock_id, use_hist) \
+static void name(sampler_struct *s, unsigned long loopcount, unsigned long threshold) { time_kernel(s, loopcount, threshold, clock_id, use_hist); }
+#define CYCLES_KERNEL(name, target, use_hist, hog) \
+target static void name(sampler_struct *s, unsigned long loopcount, unsigned long threshold) { cycles_kernel(s, loopcount, threshold, use_hist, hog); }
+TIME_KERNEL(time_gettimeofday,       -1,                  0)
+TIME_KERNEL(time_gettimeofday_hist,  -1,                  1)
+TIME_KERNEL(time_monotonic,          CLOCK_MONOTONIC,     0)
+TIME_KERNEL(time_monotonic_hist,     CLOCK_MONOTONIC,     1)
+TIME_KERNEL(time_monotonic_raw,      CLOCK_MONOTONIC_RAW, 0)
+TIME_KERNEL(time_monotonic_raw_hist, CLOCK_MONOTONIC_RAW, 1)
+TIME_KERNEL(time_realtime,           CLOCK_REALTIME,      0)
+TIME_KERNEL(time_realtime_hist,      CLOCK_REALTIME,      1)
+TIME_KERNEL(time_tai,                CLOCK_TAI,           0)
+TIME_KERNEL(time_tai_hist,           CLOCK_TAI,           1)
+TIME_KERNEL(time_boottime,           CLOCK_BOOTTIME,      0)
+TIME_KERNEL(time_boottime_hist,      CLOCK_BOOTTIME,      1)
+CYCLES_KERNEL(cycles_plain,          , 0, NULL)
+CYCLES_KERNEL(cycles_plain_hist,     , 1, NULL)
+CYCLES_KERNEL(cycles_idle,           , 0, hog_idle)
+CYCLES_KERNEL(cycles_idle_hist,      , 1, hog_idle)
+CYCLES_KERNEL(cycles_sse,            , 0, hog_sse)
+CYCLES_KERNEL(cycles_sse_hist,       , 1, hog_sse)
+CYCLES_KERNEL(cycles_avx2,           __attribute__ ((target ("avx2,fma"))), 0, hog_avx2)
+CYCLES_KERNEL(cycles_avx2_hist,      __attribute__ ((target ("avx2,fma"))), 1, hog_avx2)
+CYCLES_KERNEL(cycles_avx512,         __attribute__ ((target ("avx512f"))),  0, hog_avx512)
+CYCLES_KERNEL(cycles_avx512_hist,    __attribute__ ((target ("avx512f"))),  1, hog_avx512)
+
+typedef struct sample_kernel {
+   const char *name;
+   int method;
+   clockid_t clock_id;                 /* TIME: the timesource's clock, -1 for gettimeofday() */
+   void (*hog)(hog_state_struct *, unsigned int);      /* CYCLES: the power_hog kernel, or NULL */
+   int use_hist;
+   void (*kernel)(sampler_struct *, unsigned long, unsigned long);
+} sample_kernel_struct;
+static const sample_kernel_struct sample_kernels[]={
+   {"time/gettimeofday",            TIME_METHOD,   -1,                  NULL,       0, time_gettimeofday},
+   {"time/gettimeofday/histogram",  TIME_METHOD,   -1,                  NULL,       1, time_gettimeofday_hist},
+   {"time/monotonic",               TIME_METHOD,   CLOCK_MONOTONIC,     NULL,       0, time_monotonic},
+   {"time/monotonic/histogram",     TIME_METHOD,   CLOCK_MONOTONIC,     NULL,       1, time_monotonic_hist},
+   {"time/monotonic_raw",           TIME_METHOD,   CLOCK_MONOTONIC_RAW, NULL,       0, time_monotonic_raw},
+   {"time/monotonic_raw/histogram", TIME_METHOD,   CLOCK_MONOTONIC_RAW, NULL,       1, time_monotonic_raw_hist},
+   {"time/realtime",                TIME_METHOD,   CLOCK_REALTIME,      NULL,       0, time_realtime},
+   {"time/realtime/histogram",      TIME_METHOD,   CLOCK_REALTIME,      NULL,       1, time_realtime_hist},
+   {"time/tai",                     TIME_METHOD,   CLOCK_TAI,           NULL,       0, time_tai},
+   {"time/tai/histogram",           TIME_METHOD,   CLOCK_TAI,           NULL,       1, time_tai_hist},
+   {"time/boottime",                TIME_METHOD,   CLOCK_BOOTTIME,      NULL,       0, time_boottime},
+   {"time/boottime/histogram",      TIME_METHOD,   CLOCK_BOOTTIME,      NULL,       1, time_boottime_hist},
+   {"cycles",                       CYCLES_METHOD, -1,                  NULL,       0, cycles_plain},
+   {"cycles/histogram",             CYCLES_METHOD, -1,                  NULL,       1, cycles_plain_hist},
+   {"cycles/idle",                  CYCLES_METHOD, -1,                  hog_idle,   0, cycles_idle},
+   {"cycles/idle/histogram",        CYCLES_METHOD, -1,                  hog_idle,   1, cycles_idle_hist},
+   {"cycles/sse",                   CYCLES_METHOD, -1,                  hog_sse,    0, cycles_sse},
+   {"cycles/sse/histogram",         CYCLES_METHOD, -1,                  hog_sse,    1, cycles_sse_hist},
+   {"cycles/avx2",                  CYCLES_METHOD, -1,                  hog_avx2,   0, cycles_avx2},
+   {"cycles/avx2/histogram",        CYCLES_METHOD, -1,                  hog_avx2,   1, cycles_avx2_hist},
+   {"cycles/avx512",                CYCLES_METHOD, -1,                  hog_avx512, 0, cycles_avx512},
+   {"cycles/avx512/histogram",      CYCLES_METHOD, -1,                  hog_avx512, 1, cycles_avx512_hist},
+   {NULL,                           0,             -1,                  NULL,       0, NULL}};
+static const sample_kernel_struct generic_kernel={"generic", 0, -1, NULL, 0, generic_sample};
+static const sample_kernel_struct wakeup_kernel={"wakeup", WAKEUP_METHOD, -1, NULL, 0, wakeup_sample};
+static const sample_kernel_struct memchase_kernel={"memchase", MEMCHASE_METHOD, -1, NULL, 0, memchase_sample};
+
+/* The kernel for a configuration, or generic_sample() if there is none */
+static const sample_kernel_struct *select_sample_kernel(int method, clockid_t clock_id, void (*hog)(hog_state_struct *, unsigned int), int use_hist) {
+   const sample_kernel_struct *k;
+   if (method == WAKEUP_METHOD) return &wakeup_kernel;
+   if (method == MEMCHASE_METHOD) return &memchase_kernel;
+   for (k=sample_kernels; k->name!=NULL; k++) {
+      if ((k->method != method) || (k->use_hist != use_hist)) continue;
+      if ((method == TIME_METHOD) && (k->clock_id != clock_id)) continue;
+      if ((method == CYCLES_METHOD) && (k->hog != hog)) continue;
+      return k;
+   }
+   return &generic_kernel;
+}
+
+/* "--benchmark-kernels": run generic_sample() and the kernel chosen for this configuration in turn, with a
+   threshold nothing can reach, and report the best minimum spike and time per iteration of each
+*/
+#define KERNEL_BENCHMARK_ROUNDS 5
+static void benchmark_kernels(sampler_struct *s, unsigned long loopcount) {
+   const sample_kernel_struct *kernels[2]={&generic_kernel, s->sample_kernel[1]};
+   unsigned long best_min[2]={ULONG_MAX, ULONG_MAX};
+   double best_nsec[2]={0.0, 0.0}, nsec;
+   struct timespec start, finish;
+   const char *unit=(s->method==CYCLES_METHOD) ? cycle_string : nsec_string;
+   int round, which;
+   s->quiet=0;
+   for (round=0; round<KERNEL_BENCHMARK_ROUNDS; round++) {
+      for (which=0; which<2; which++) {
+         s->min_spike=ULONG_MAX;
+         s->chunk_carry=0;
+         clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+         kernels[which]->kernel(s, loopcount, ULONG_MAX);
+         clock_gettime(CLOCK_MONOTONIC_RAW, &finish);
+         nsec=((finish.tv_sec-start.tv_sec)*1e9+(finish.tv_nsec-start.tv_nsec))/(double)loopcount;
+         if (s->min_spike < best_min[which]) best_min[which]=s->min_spike;
+         if ((round == 0) || (nsec < best_nsec[which])) best_nsec[which]=nsec;
+      }
+   }
+   if (format == CSV_FORMAT) printf("kernel,minimum spike (%s),nsec per iteration\n", unit);
+   else if (format == XML_FORMAT) printf("<kernel_benchmark>\n  <iterations>%lu</iterations>\n  <rounds>%d</rounds>\n", loopcount, KERNEL_BENCHMARK_ROUNDS);
+   else printf("Kernel benchmark:  best of %d rounds of %lu iterations\n", KERNEL_BENCHMARK_ROUNDS, loopcount);
+   for (which=0; which<2; which++) {
+      if (format == CSV_FORMAT) printf("%s,%lu,%.2f\n", kernels[which]->name, best_min[which], best_nsec[which]);
+      else if (format == XML_FORMAT) printf("  <kernel><name>%s</name><minimum_spike>%lu</minimum_spike><nsec_per_iteration>%.2f</nsec_per_iteration></kernel>\n", kernels[which]->name, best_min[which], best_nsec[which]);
+      else printf("   %-30s minimum spike %lu %s, %.2f nsec per iteration\n", kernels[which]->name, best_min[which], unit, best_nsec[which]);
+   }
+   if (format == XML_FORMAT) printf("</kernel_benchmark>\n");
+}
+
+/* "--benchmark-clocks": what each way of reading the time costs on this machine and how finely it resolves.
+Every source is read back to back, first just to time the reads, then to collect the differences between
+successive readings: the smallest non-zero one is the resolution, and reads that return the same value as
+the one before are counted as repeats.  The CPU-number sources are only timed.
+*/
+typedef struct clock_bench {
+   const char *name;
+   const char *unit;                   /* of the readings; NULL when they aren't times */
+   double nsec_per_read;
+   unsigned long repeats;
+   unsigned long min;                  /* the resolution */
+   unsigned long max;
+   histogram_struct hist;              /* the non-zero differences between successive readings */
+} clock_bench_struct;
+static volatile unsigned long clock_bench_sink;
+
+static inline unsigned long clock_nsec(clockid_t clock_id) {
+   struct timespec t;
+   clock_gettime(clock_id, &t);
+   return (unsigned long)t.tv_sec*1000000000L+t.tv_nsec;
+}
+
+static inline unsigned long gettimeofday_nsec() {
+   struct timeval tv;
+   gettimeofday(&tv, NULL);
+   return (unsigned long)tv.tv_sec*1000000000L+tv.tv_usec*1000L;
+}
+
+#define CLOCK_BENCH(name, read, resolve) \
+static void name(clock_bench_struct *b, clockid_t clock_id __attribute__ ((__unused__)), unsigned long reads) { \
+   unsigned long ndx, value, last, diff, sink=0; \
+   struct timespec start, finish; \
+   clock_gettime(CLOCK_MONOTONIC_RAW, &start); \
+   for (ndx=0; ndx<reads; ndx++) sink+=(read); \
+   clock_gettime(CLOCK_MONOTONIC_RAW, &finish); \
+   clock_bench_sink+=sink; \
+   b->nsec_per_read=((finish.tv_sec-start.tv_sec)*1e9+(finish.tv_nsec-start.tv_nsec))/(double)reads; \
+   if (!(resolve)) return; \
+   b->min=ULONG_MAX; \
+   last=(read); \
+   for (ndx=0; ndx<reads; ndx++) { \
+      value=(read); \
+      diff=value-last; \
+      last=value; \
+      if (diff == 0) { b->repeats++; continue; } \
+      hist_record(&b->hist, diff); \
+      if (diff < b->min) b->min=diff; \
+      if (diff > b->max) b->max=diff; \
+   } \
+}
+CLOCK_BENCH(bench_rdtsc,         get_cycles(),              1)
+CLOCK_BENCH(bench_rdtscp,        get_cycles_p(),            1)
+CLOCK_BENCH(bench_lfence_rdtsc,  get_cycles_lfence(),       1)
+CLOCK_BENCH(bench_gettimeofday,  gettimeofday_nsec(),       1)
+CLOCK_BENCH(bench_clock_gettime, clock_nsec(clock_id),      1)
+CLOCK_BENCH(bench_get_my_cpu,    (unsigned long)get_my_cpu(),   0)
+CLOCK_BENCH(bench_sched_getcpu,  (unsigned long)sched_getcpu(), 0)
+
+#ifndef CLOCK_MONOTONIC_COARSE
+#define CLOCK_MONOTONIC_COARSE 6
+#endif
+#ifndef CLOCK_REALTIME_COARSE
+#define CLOCK_REALTIME_COARSE 5
+#endif
+typedef struct clock_bench_source {
+   const char *name;
+   void (*bench)(clock_bench_struct *, clockid_t, unsigned long);
+   clockid_t clock_id;
+   const char *unit;
+} clock_bench_source_struct;
+static const clock_bench_source_struct clock_bench_sources[]={
+   {"rdtsc",                          bench_rdtsc,         -1,                     cycle_string},
+   {"rdtscp",                         bench_rdtscp,        -1,                     cycle_string},
+   {"lfence+rdtsc",                   bench_lfence_rdtsc,  -1,                     cycle_string},
+   {"gettimeofday",                   bench_gettimeofday,  -1,                     nsec_string},
+   {"clock_gettime(monotonic)",       bench_clock_gettime, CLOCK_MONOTONIC,        nsec_string},
+   {"clock_gettime(monotonic_raw)",   bench_clock_gettime, CLOCK_MONOTONIC_RAW,    nsec_string},
+   {"clock_gettime(monotonic_coarse)",bench_clock_gettime, CLOCK_MONOTONIC_COARSE, nsec_string},
+   {"clock_gettime(realtime)",        bench_clock_gettime, CLOCK_REALTIME,         nsec_string},
+   {"clock_gettime(realtime_coarse)", bench_clock_gettime, CLOCK_REALTIME_COARSE,  nsec_string},
+   {"clock_gettime(tai)",             bench_clock_gettime, CLOCK_TAI,              nsec_string},
+   {"clock_gettime(boottime)",        bench_clock_gettime, CLOCK_BOOTTIME,         nsec_string},
+   {"get_my_cpu() (vsyscall)",        bench_get_my_cpu,    -1,                     NULL},
+   {"sched_getcpu()",                 bench_sched_getcpu,  -1,                     NULL},
+   {NULL,                             NULL,                -1,                     NULL}};
+
+/* The first line of a sysfs file, without its newline; "unknown" if it can't be read */
+static void read_sysfs_line(const char *path, char *line, int size) {
+   FILE *f=fopen(path, "r");
+   if ((f == NULL) || (fgets(line, size, f) == NULL)) snprintf(line, size, "unknown");
+   else {
+      line[strcspn(line, "\n")]='\0';
+      while ((line[0] != '\0') && isspace((unsigned char)line[strlen(line)-1])) line[strlen(line)-1]='\0';
+   }
+   if (f != NULL) fclose(f);
+}
+
+static void benchmark_clocks(int cpu, unsigned long reads) {
+   const clock_bench_source_struct *source;
+   clock_bench_struct *b;
+   char current[64], available[256];
+   cpu_set_t one_cpu;
+   unsigned long total, p50, p99;
+   int count, ndx;
+   for (count=0; clock_bench_sources[count].name!=NULL; count++) ;
+   b=(clock_bench_struct *)calloc(count, sizeof(clock_bench_struct));
+   if (b == NULL) {
+      perror("unable to allocate memory for the clock benchmark");
+      exit (1);
+   }
+   CPU_ZERO(&one_cpu);
+   CPU_SET(cpu, &one_cpu);
+   if (sched_setaffinity(0, sizeof(one_cpu), &one_cpu) != 0) perror("unable to pin the clock benchmark");
+   read_sysfs_line("/sys/devices/system/clocksource/clocksource0/current_clocksource", current, sizeof(current));
+   read_sysfs_line("/sys/devices/system/clocksource/clocksource0/available_clocksource", available, sizeof(available));
+/* With any other clocksource the vDSO can't read the time itself and every call becomes a system call */
+   if ((strcmp(current, "tsc") != 0) && (chatty >= 1))
+      printf ("%sthe kernel clocksource is %s, not tsc; gettimeofday() and clock_gettime() will be slow%s\n", XML_head, current, XML_tail);
+   for (ndx=0, source=clock_bench_sources; ndx<count; ndx++, source++) {
+      b[ndx].name=source->name;
+      b[ndx].unit=source->unit;
+      if (chatty >= 2) printf ("%sreading %s %lu times%s\n", XML_head, source->name, reads, XML_tail);
+      source->bench(&b[ndx], source->clock_id, reads);
+   }
+   if (format == CSV_FORMAT) {
+      printf("Clocksource,%s\nAvailable clocksources,%s\nBenchmark CPU,%d\nReads,%lu\n", current, available, cpu, reads);
+      printf("source,nsec per read,unit,resolution,median step,p99 step,maximum step,repeated reads\n");
+   } else if (format == XML_FORMAT) {
+      printf("<clock_benchmark>\n  <clocksource>%s</clocksource>\n  <available>%s</available>\n  <cpu>%d</cpu>\n  <reads>%lu</reads>\n", current, available, cpu, reads);
+   } else {
+      printf("Clocksource:  %s (available: %s)\n", current, available);
+      printf("Timesource benchmark on CPU %d, %lu reads each\n", cpu, reads);
+      printf("   %-32s %9s %14s %14s %14s %14s %10s\n", "source", "nsec/read", "resolution", "median step", "p99 step", "max step", "repeats");
+   }
+   for (ndx=0; ndx<count; ndx++) {
+      total=hist_total(&b[ndx].hist);
+      p50=(total > 0) ? hist_percentile(&b[ndx].hist, total, 50.0, b[ndx].max) : 0L;
+      p99=(total > 0) ? hist_percentile(&b[ndx].hist, total, 99.0, b[ndx].max) : 0L;
+      if (b[ndx].min == ULONG_MAX) b[ndx].min=0L;
+      if (format == CSV_FORMAT) {
+         printf("%s,%.2f", b[ndx].name, b[ndx].nsec_per_read);
+         if (b[ndx].unit != NULL) printf(",%s,%lu,%lu,%lu,%lu,%lu", b[ndx].unit, b[ndx].min, p50, p99, b[ndx].max, b[ndx].repeats);
+         printf("\n");
+      } else if (format == XML_FORMAT) {
+         printf("  <source><name>%s</name><nsec_per_read>%.2f</nsec_per_read>", b[ndx].name, b[ndx].nsec_per_read);
+         if (b[ndx].unit != NULL) printf("<unit>%s</unit><resolution>%lu</resolution><p50>%lu</p50><p99>%lu</p99><max>%lu</max><repeats>%lu</repeats>", b[ndx].unit, b[ndx].min, p50, p99, b[ndx].max, b[ndx].repeats);
+         printf("</source>\n");
+      } else {
+         printf("   %-32s %9.2f", b[ndx].name, b[ndx].nsec_per_read);
+         if (b[ndx].unit != NULL) printf(" %8lu %-5s %8lu %-5s %8lu %-5s %8lu %-5s %10lu", b[ndx].min, b[ndx].unit, p50, b[ndx].unit, p99, b[ndx].unit, b[ndx].max, b[ndx].unit, b[ndx].repeats);
+         printf("\n");
+      }
+   }
+   if (format == XML_FORMAT) printf("</clock_benchmark>\n");
+   free(b);
+}
+
+/* "--audit": before the run, read procfs and sysfs for the settings that decide whether the sampled CPUs
+can be quiet, and give each a verdict.  Most are per CPU; irqbalance, THP, RT throttling and the
+clocksource are per host and are reported with CPU "all".
+*/
+#define AUDIT_PASS 0
+#define AUDIT_WARN 1
+#define AUDIT_FAIL 2
+#define AUDIT_CSTATE_LATENCY 10        /* usecs; deeper C-states than this are worth a warning */
+#define AUDIT_TICK_SPIN 100            /* msecs spent busy on each CPU counting its timer interrupts */
+static const char *audit_verdicts[]={"pass", "warn", "fail"};
+static int audit_counts[3];
+
+static void print_audit(int cpu, const char *check, int verdict, const char *detail) {
+   char cpu_string[16];
+   audit_counts[verdict]++;
+   if (cpu >= 0) snprintf(cpu_string, sizeof(cpu_string), "%d", cpu);
+   else snprintf(cpu_string, sizeof(cpu_string), "all");
+   if (format == CSV_FORMAT) printf("Audit,%s,%s,%s,\"%s\"\n", cpu_string, check, audit_verdicts[verdict], detail);
+   else if (format == XML_FORMAT) printf("   <check><cpu>%s</cpu><name>%s</name><verdict>%s</verdict><detail>%s</detail></check>\n", cpu_string, check, audit_verdicts[verdict], detail);
+   else printf("  CPU %-4s %-14s %s  %s\n", cpu_string, check, audit_verdicts[verdict], detail);
+}
+
+/* The value of "name=" on the kernel command line, or "" */
+static void read_cmdline_param(const char *name, char *value, int size) {
+   char cmdline[4096], *token, *save;
+   size_t length=strlen(name);
+   value[0]='\0';
+   read_sysfs_line("/proc/cmdline", cmdline, sizeof(cmdline));
+   for (token=strtok_r(cmdline, " ", &save); token!=NULL; token=strtok_r(NULL, " ", &save))
+      if ((strncmp(token, name, length) == 0) && (token[length] == '=')) snprintf(value, size, "%s", token+length+1);
+}
+
+/* A cpu list as sysfs or the command line gives it; "isolcpus=" may lead with flags such as "domain," */
+static int audit_cpu_in_list(int cpu, const char *list) {
+   cpu_set_t cpus;
+   while ((*list != '\0') && !isdigit((unsigned char)*list)) {
+      if (strncmp(list, "all", 3) == 0) return 1;
+      list++;
+   }
+   return (parse_cpu_list(list, &cpus) > 0) && CPU_ISSET(cpu, &cpus);
+}
+
+/* The local timer interrupts /proc/interrupts has counted on "cpu" */
+static long read_local_timer_count(int cpu) {
+   char line[8192], *ptr, *endptr;
+   int column=-1, ndx;
+   long count=-1L;
+   FILE *f=fopen("/proc/interrupts", "r");
+   if (f == NULL) return -1L;
+/* The header names the online CPUs in column order */
+   if (fgets(line, sizeof(line), f) != NULL) {
+      for (ptr=line, ndx=0; (ptr=strstr(ptr, "CPU")) != NULL; ptr+=3, ndx++)
+         if (atoi(ptr+3) == cpu) column=ndx;
+   }
+   while ((column >= 0) && (fgets(line, sizeof(line), f) != NULL)) {
+      for (ptr=line; isspace((unsigned char)*ptr); ptr++) ;
+      if (strncmp(ptr, "LOC:", 4) != 0) continue;
+      ptr+=4;
+      for (ndx=0; ndx<=column; ndx++) {
+         count=strtol(ptr, &endptr, 10);
+         if (endptr == ptr) count=-1L;
+         ptr=endptr;
+      }
+      break;
+   }
+   fclose(f);
+   return count;
+}
+
+/* Spin on "cpu" for AUDIT_TICK_SPIN msecs and count its timer interrupts: busy, as the sampler will be */
+static void audit_tick(int cpu) {
+   cpu_set_t saved, one_cpu;
+   struct timespec start, now;
+   long before, after;
+   double rate;
+   char detail[128];
+   sched_getaffinity(0, sizeof(saved), &saved);
+   CPU_ZERO(&one_cpu);
+   CPU_SET(cpu, &one_cpu);
+   if (sched_setaffinity(0, sizeof(one_cpu), &one_cpu) != 0) {
+      print_audit(cpu, "timer tick", AUDIT_WARN, "unable to run on this CPU to count its ticks");
+      return;
+   }
+   before=read_local_timer_count(cpu);
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   do clock_gettime(CLOCK_MONOTONIC, &now);
+   while ((now.tv_sec-start.tv_sec)*1000L+(now.tv_nsec-start.tv_nsec)/1000000L < AUDIT_TICK_SPIN);
+   after=read_local_timer_count(cpu);
+   sched_setaffinity(0, sizeof(saved), &saved);
+   if ((before < 0) || (after < 0)) {
+      print_audit(cpu, "timer tick", AUDIT_WARN, "no LOC line in /proc/interrupts");
+      return;
+   }
+   rate=(double)(after-before)*1000.0/AUDIT_TICK_SPIN;
+   snprintf(detail, sizeof(detail), "%.0f local timer interrupts/sec while busy", rate);
+/* nohz_full still ticks once a second */
+   print_audit(cpu, "timer tick", (rate <= 10.0) ? AUDIT_PASS : AUDIT_WARN, detail);
+}
+
+static void audit_irqs(int cpu) {
+   DIR *dir=opendir("/proc/irq");
+   struct dirent *entry;
+   char path[PATH_MAX], list[1024], detail[512];
+   int total=0, here=0, length=0;
+   detail[0]='\0';
+   if (dir == NULL) {
+      print_audit(cpu, "IRQ affinity", AUDIT_WARN, "unable to read /proc/irq");
+      return;
+   }
+   while ((entry=readdir(dir)) != NULL) {
+      if (!isdigit((unsigned char)entry->d_name[0])) continue;
+/* Where the IRQ is actually routed, if the kernel says; otherwise where it may go */
+      snprintf(path, sizeof(path), "/proc/irq/%s/effective_affinity_list", entry->d_name);
+      read_sysfs_line(path, list, sizeof(list));
+      if ((strcmp(list, "unknown") == 0) || (list[0] == '\0')) {
+         snprintf(path, sizeof(path), "/proc/irq/%s/smp_affinity_list", entry->d_name);
+         read_sysfs_line(path, list, sizeof(list));
+      }
+      total++;
+      if (!audit_cpu_in_list(cpu, list)) continue;
+      here++;
+      if (length < 64) length+=snprintf(detail+length, sizeof(detail)-length, "%s%s", (here > 1) ? " " : "", entry->d_name);
+   }
+   closedir(dir);
+   if (here == 0) {
+      snprintf(detail, sizeof(detail), "none of %d IRQs are routed here", total);
+      print_audit(cpu, "IRQ affinity", AUDIT_PASS, detail);
+   } else {
+      char irqs[256];
+      snprintf(irqs, sizeof(irqs), "%s", detail);
+      snprintf(detail, sizeof(detail), "%d of %d IRQs are routed here: %s%s", here, total, irqs, (length >= 64) ? " ..." : "");
+      print_audit(cpu, "IRQ affinity", AUDIT_WARN, detail);
+   }
+}
+
+static void audit_cstates(int cpu) {
+   char path[PATH_MAX], name[64], value[64], deepest[64], detail[256], limit[64];
+   int state, worst=-1, latency;
+   deepest[0]='\0';
+   for (state=0; ; state++) {
+      snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpuidle/state%d/latency", cpu, state);
+      read_sysfs_line(path, value, sizeof(value));
+      if (strcmp(value, "unknown") == 0) break;
+      latency=atoi(value);
+      snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpuidle/state%d/disable", cpu, state);
+      read_sysfs_line(path, value, sizeof(value));
+      if (strcmp(value, "1") == 0) continue;
+      if (latency > worst) {
+         worst=latency;
+         snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpuidle/state%d/name", cpu, state);
+         read_sysfs_line(path, name, sizeof(name));
+         snprintf(deepest, sizeof(deepest), "%s", name);
+      }
+   }
+   read_cmdline_param("idle", value, sizeof(value));
+   read_cmdline_param("intel_idle.max_cstate", name, sizeof(name));
+   read_cmdline_param("processor.max_cstate", limit, sizeof(limit));
+   if (worst < 0) {
+      snprintf(detail, sizeof(detail), "no cpuidle states%s%s", (value[0] != '\0') ? "; idle=" : "", value);
+      print_audit(cpu, "C-states", AUDIT_PASS, detail);
+      return;
+   }
+   snprintf(detail, sizeof(detail), "deepest enabled state %s exits in %d usecs%s%s%s%s", deepest, worst,
+      (name[0] != '\0') ? "; intel_idle.max_cstate=" : "", name, (limit[0] != '\0') ? "; processor.max_cstate=" : "", limit);
+   print_audit(cpu, "C-states", (worst <= AUDIT_CSTATE_LATENCY) ? AUDIT_PASS : AUDIT_WARN, detail);
+}
+
+static void audit_host(int requested_policy) {
+   char value[256], available[256], detail[1024];
+   long runtime, period;
+   DIR *dir;
+   struct dirent *entry;
+   int irqbalance=0;
+/* irqbalance moves IRQs onto isolated CPUs unless it is told not to */
+   dir=opendir("/proc");
+   while ((dir != NULL) && ((entry=readdir(dir)) != NULL)) {
+      char path[PATH_MAX];
+      if (!isdigit((unsigned char)entry->d_name[0])) continue;
+      snprintf(path, sizeof(path), "/proc/%s/comm", entry->d_name);
+      read_sysfs_line(path, value, sizeof(value));
+      if (strcmp(value, "irqbalance") == 0) irqbalance=1;
+   }
+   if (dir != NULL) closedir(dir);
+   if (irqbalance == 0) {
+      print_audit(-1, "irqbalance", AUDIT_PASS, "not running");
+   } else {
+      FILE *f=fopen("/etc/sysconfig/irqbalance", "r");
+      int told=0;
+      if (f == NULL) f=fopen("/etc/default/irqbalance", "r");
+      while ((f != NULL) && (fgets(value, sizeof(value), f) != NULL))
+         if ((strncmp(value, "FOLLOW_ISOLCPUS=yes", 19) == 0) || (strncmp(value, "IRQBALANCE_BANNED_CPUS=", 23) == 0) ||
+             (strncmp(value, "IRQBALANCE_BANNED_CPULIST=", 26) == 0)) told=1;
+      if (f != NULL) fclose(f);
+      print_audit(-1, "irqbalance", told ? AUDIT_PASS : AUDIT_WARN, told ? "running, with FOLLOW_ISOLCPUS or banned CPUs set" : "running, with neither FOLLOW_ISOLCPUS=yes nor IRQBALANCE_BANNED_CPUS set");
+   }
+   read_sysfs_line("/sys/kernel/mm/transparent_hugepage/enabled", value, sizeof(value));
+   read_sysfs_line("/sys/kernel/mm/transparent_hugepage/defrag", available, sizeof(available));
+   snprintf(detail, sizeof(detail), "enabled: %s; defrag: %s", value, available);
+   print_audit(-1, "THP", ((strstr(value, "[always]") != NULL) || (strstr(available, "[always]") != NULL)) ? AUDIT_WARN : AUDIT_PASS, detail);
+/* Automatic NUMA balancing unmaps pages now and then to see who touches them; the next access takes a fault */
+   read_sysfs_line("/proc/sys/kernel/numa_balancing", value, sizeof(value));
+   snprintf(detail, sizeof(detail), (strcmp(value, "unknown") == 0) ? "not built in" : "numa_balancing=%s", value);
+   print_audit(-1, "NUMA balancing", ((strcmp(value, "unknown") != 0) && (strcmp(value, "0") != 0)) ? AUDIT_WARN : AUDIT_PASS, detail);
+/* A busy SCHED_FIFO sampler is what RT throttling is there to stop: it is parked for the rest of each period */
+   read_sysfs_line("/proc/sys/kernel/sched_rt_runtime_us", value, sizeof(value));
+   runtime=atol(value);
+   read_sysfs_line("/proc/sys/kernel/sched_rt_period_us", value, sizeof(value));
+   period=atol(value);
+   if ((requested_policy != SCHED_FIFO) && (requested_policy != SCHED_RR)) {
+      snprintf(detail, sizeof(detail), "sched_rt_runtime_us=%ld; the samplers don't use a real-time policy", runtime);
+      print_audit(-1, "RT throttling", AUDIT_PASS, detail);
+   } else if ((runtime < 0) || (runtime >= period)) {
+      snprintf(detail, sizeof(detail), "off (sched_rt_runtime_us=%ld)", runtime);
+      print_audit(-1, "RT throttling", AUDIT_PASS, detail);
+   } else {
+      snprintf(detail, sizeof(detail), "a %s sampler is stopped for %ld usecs of every %ld; echo -1 >/proc/sys/kernel/sched_rt_runtime_us",
+         scheduler_string(requested_policy), period-runtime, period);
+      print_audit(-1, "RT throttling", AUDIT_FAIL, detail);
+   }
+   read_sysfs_line("/sys/devices/system/clocksource/clocksource0/current_clocksource", value, sizeof(value));
+   snprintf(detail, sizeof(detail), "%s", value);
+/* hpet and acpi_pm can't be read from the vDSO, so every clock read becomes a system call */
+   print_audit(-1, "clocksource", (strcmp(value, "tsc") == 0) ? AUDIT_PASS : ((strcmp(value, "hpet") == 0) || (strcmp(value, "acpi_pm") == 0)) ? AUDIT_FAIL : AUDIT_WARN, detail);
+}
+
+static void audit_host_readiness(cpu_set_t *cpus, int requested_policy) {
+   char isolated[1024], nohz_full[1024], rcu_nocbs[1024], path[PATH_MAX], value[256], detail[1280];
+   int cpu;
+   memset(audit_counts, 0, sizeof(audit_counts));
+   if (format == CSV_FORMAT) printf("Audit,CPU,check,verdict,detail\n");
+   else if (format == XML_FORMAT) printf("<audit>\n");
+   else printf("Real-time readiness audit:\n");
+   audit_host(requested_policy);
+   read_sysfs_line("/sys/devices/system/cpu/isolated", isolated, sizeof(isolated));
+   read_sysfs_line("/sys/devices/system/cpu/nohz_full", nohz_full, sizeof(nohz_full));
+   if ((strcmp(nohz_full, "unknown") == 0) || (strcmp(nohz_full, "(null)") == 0)) nohz_full[0]='\0';
+   read_cmdline_param("rcu_nocbs", rcu_nocbs, sizeof(rcu_nocbs));
+   for (cpu=0; cpu<CPU_SETSIZE; cpu++) {
+      if (!CPU_ISSET(cpu, cpus)) continue;
+      snprintf(detail, sizeof(detail), "isolated CPUs: %s", (isolated[0] != '\0') ? isolated : "none");
+      print_audit(cpu, "isolcpus", audit_cpu_in_list(cpu, isolated) ? AUDIT_PASS : AUDIT_WARN, detail);
+      snprintf(detail, sizeof(detail), "nohz_full CPUs: %s", (nohz_full[0] != '\0') ? nohz_full : "none");
+      print_audit(cpu, "nohz_full", audit_cpu_in_list(cpu, nohz_full) ? AUDIT_PASS : AUDIT_WARN, detail);
+/* nohz_full offloads the CPU's RCU callbacks too */
+      snprintf(detail, sizeof(detail), "rcu_nocbs=%s", (rcu_nocbs[0] != '\0') ? rcu_nocbs : "(not set)");
+      print_audit(cpu, "rcu_nocbs", (audit_cpu_in_list(cpu, rcu_nocbs) || audit_cpu_in_list(cpu, nohz_full)) ? AUDIT_PASS : AUDIT_WARN, detail);
+      audit_irqs(cpu);
+      snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_governor", cpu);
+      read_sysfs_line(path, value, sizeof(value));
+      if (strcmp(value, "unknown") == 0) print_audit(cpu, "cpufreq", AUDIT_PASS, "no cpufreq governor; the frequency is not managed by the kernel");
+      else {
+         snprintf(detail, sizeof(detail), "governor %s", value);
+         print_audit(cpu, "cpufreq", (strcmp(value, "performance") == 0) ? AUDIT_PASS : AUDIT_WARN, detail);
+      }
+      audit_cstates(cpu);
+      audit_tick(cpu);
+   }
+   if (format == CSV_FORMAT) printf("Audit verdicts,%d,%d,%d\n", audit_counts[AUDIT_PASS], audit_counts[AUDIT_WARN], audit_counts[AUDIT_FAIL]);
+   else if (format == XML_FORMAT) printf("   <pass>%d</pass><warn>%d</warn><fail>%d</fail>\n</audit>\n", audit_counts[AUDIT_PASS], audit_counts[AUDIT_WARN], audit_counts[AUDIT_FAIL]);
+   else printf("Audit:  %d pass, %d warn, %d fail\n", audit_counts[AUDIT_PASS], audit_counts[AUDIT_WARN], audit_counts[AUDIT_FAIL]);
+   fflush(stdout);
+}
+
+/* The measured pass runs the kernel in chunks.  Between chunks the sampler checks the flags the signal
+handlers set, and with "--interval" reads the clock to see whether the window is over.  A chunk is short
+enough that a window closes, or a signal is acted on, within a few msecs.  The kernels carry their last
+reading from one chunk to the next (chunk_stamp, chunk_cycles), so the work between chunks is measured
+as part of the next iteration, and a stall there is still a spike; its time is also added to the overhead.
+The wakeup method sleeps anyway, so its chunks are a single wakeup.
+*/
+#define SAMPLE_CHUNK 65536L
+static unsigned long window_interval=0L;      /* nsecs; 0 without "--interval" */
+
+/* Set by the signal handlers; nothing else writes them.  SIGINT and SIGTERM end the measured pass, SIGUSR1
+   asks every sampler for a snapshot and SIGHUP asks for the "--output" file to be reopened.
+*/
+static volatile sig_atomic_t stop_requested=0;
+static volatile sig_atomic_t snapshot_requests=0;
+static volatile sig_atomic_t reopen_requests=0;
+static sig_atomic_t reopens_done=0;    /* under output_lock */
+static const char *output_path=NULL;
+
+static void stop_handler(int sig) {
+   stop_requested=sig;
+}
+
+static void snapshot_handler(int sig __attribute__ ((__unused__))) {
+   snapshot_requests++;
+}
+
+static void reopen_handler(int sig __attribute__ ((__unused__))) {
+   reopen_requests++;
+}
+
+/* SA_RESETHAND: a second SIGINT kills a run that doesn't stop */
+static void install_signal_handlers(void) {
+   struct sigaction sa;
+   memset(&sa, 0, sizeof(sa));
+   sigemptyset(&sa.sa_mask);
+   sa.sa_handler=stop_handler;
+   sa.sa_flags=SA_RESETHAND;
+   sigaction(SIGINT, &sa, NULL);
+   sigaction(SIGTERM, &sa, NULL);
+   sa.sa_flags=SA_RESTART;
+   sa.sa_handler=snapshot_handler;
+   sigaction(SIGUSR1, &sa, NULL);
+   sa.sa_handler=reopen_handler;
+   sigaction(SIGHUP, &sa, NULL);
+}
+
+/* SIGHUP: once logrotate has moved the output file, new output goes to a new file of the same name.
+   Whichever sampler gets here first does it.
+*/
+static void reopen_output(void) {
+   pthread_mutex_lock(&output_lock);
+   if (reopens_done != reopen_requests) {
+      reopens_done=reopen_requests;
+      fflush(stdout);
+      if ((output_path != NULL) && (freopen(output_path, "a", stdout) == NULL)) {
+         fprintf(stderr, "unable to reopen %s: %s\n", output_path, strerror(errno));
+         exit (1);
+      }
+   }
+   pthread_mutex_unlock(&output_lock);
+}
+
+/* SIGUSR1: print the spikes still buffered and the totals so far, without stopping */
+static void print_snapshot(sampler_struct *s, unsigned long iterations) {
+   const char *hist_unit=(s->method==TIME_METHOD) ? nsec_string : spike_unit;
+   unsigned long total=0L, p50=0L, p99=0L, p9999=0L, now, min_spike;
+   timesignature stamp;
+   char elapsed[32];
+   if (s->spike_ndx > 0) print_big_diff(s);
+   tt_gettime(&stamp);
+   now=tt_time_diff(&stamp, &s->start_time);
+   snprintf(elapsed, sizeof(elapsed), "%lu.%.*lu", now/1000000000L, timesource->digits, (now%1000000000L)/timesource->scale);
+   min_spike=(s->min_spike == ULONG_MAX) ? 0L : spike_units(s->method, s->min_spike);
+/* With "--interval" the reporter owns the merged histogram; the windows carry the percentiles */
+   if ((s->hist != NULL) && (s->windows == NULL)) total=hist_total(s->hist);
+   if (total > 0) {
+      p50=hist_percentile(s->hist, total, 50.0, s->spike_count ? s->max_spike : ULONG_MAX);
+      p99=hist_percentile(s->hist, total, 99.0, s->spike_count ? s->max_spike : ULONG_MAX);
+      p9999=hist_percentile(s->hist, total, 99.99, s->spike_count ? s->max_spike : ULONG_MAX);
+   }
+   pthread_mutex_lock(&output_lock);
+   if (format == CSV_FORMAT) {
+      printf("Snapshot,%d,%s,%lu,%lu,%lu,%lu", s->cpu, elapsed, iterations, s->spike_count, spike_units(s->method, s->max_spike), min_spike);
+      if (total > 0) printf(",%lu,%lu,%lu", p50, p99, p9999);
+      printf("\n");
+   } else if (format == XML_FORMAT) {
+      printf("      <snapshot><cpu>%d</cpu><elapsed>%s</elapsed><iterations>%lu</iterations><spikes>%lu</spikes><maximum_spike>%lu</maximum_spike><minimum_spike>%lu</minimum_spike>",
+         s->cpu, elapsed, iterations, s->spike_count, spike_units(s->method, s->max_spike), min_spike);
+      if (total > 0) printf("<p50>%lu</p50><p99>%lu</p99><p99.99>%lu</p99.99>", p50, p99, p9999);
+      printf("</snapshot>\n");
+   } else {
+      printf("Snapshot");
+      if (s->cpu >= 0) printf(" of CPU %d", s->cpu);
+      printf(" at %s seconds:  %lu iterations, %lu spikes, maximum %lu %s, minimum %lu %s", elapsed, iterations, s->spike_count,
+         spike_units(s->method, s->max_spike), spike_unit, min_spike, spike_unit);
+      if (total > 0) printf(", p50 %lu, p99 %lu, p99.99 %lu %s", p50, p99, p9999, hist_unit);
+      printf("\n");
+   }
+   fflush(stdout);
+   pthread_mutex_unlock(&output_lock);
+}
+
+static inline unsigned long window_overhead(sampler_struct *s) {
+   return CYCLE_METHOD(s->method) ? s->overhead_cycles : s->overhead_nsec;
+}
+
+static inline void metrics_write_begin(unsigned long *seq) {
+   __atomic_store_n(seq, *seq+1, __ATOMIC_RELAXED);
+   __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void metrics_write_end(unsigned long *seq) {
+   __atomic_store_n(seq, *seq+1, __ATOMIC_RELEASE);
+}
+
+static void publish_histogram(sampler_metrics_struct *m, const histogram_struct *hist) {
+   metrics_write_begin(&m->hist_seq);
+   memcpy(&m->hist, hist, sizeof(histogram_struct));
+   metrics_write_end(&m->hist_seq);
+}
+
+/* Called between chunks, never from the sampling loops */
+static void publish_metrics(sampler_struct *s, unsigned long iterations) {
+   sampler_metrics_struct *m=s->metrics;
+   metrics_write_begin(&m->seq);
+   m->iterations=iterations;
+   m->spike_count=s->spike_count;
+   m->max_spike=s->max_spike;
+   m->overhead=window_overhead(s);
+   m->smi_spikes=s->smi_spikes;
+   metrics_write_end(&m->seq);
+   if ((s->hist != NULL) && (s->windows == NULL)) publish_histogram(m, s->hist);
+}
+
+/* "--pm-qos": keep the CPUs out of deep C-states for the run.  The system-wide way is to hold
+/dev/cpu_dma_latency open with the limit written to it; the per-CPU way is each sampled CPU's
+pm_qos_resume_latency_us, which is put back when the run ends.  With "--pm-qos-ab" the limit is held in the
+even "--interval" windows and released in the odd ones.  The switch is made between chunks by the sampler
+that closes the window, the first sampler for the system-wide limit, each sampler for its own CPU; the
+first sampler also reads the RAPL package energy counter at every switch so the two settings' power can be
+compared.
+*/
+#define PM_QOS_DMA      1
+#define PM_QOS_RESUME   2
+#define PM_QOS_NO_CONSTRAINT 2000000000   /* cpu_dma_latency's default */
+#define PM_QOS_OWNER_SETTING 1
+#define PM_QOS_OWNER_ENERGY  2
+typedef struct pm_qos {
+   int mode;                           /* 0, PM_QOS_DMA or PM_QOS_RESUME */
+   int ab;
+   long usecs;
+   int dma_fd;                         /* /dev/cpu_dma_latency while the limit is held */
+   int energy_fd;                      /* RAPL package energy_uj, or -1 */
+   unsigned long energy_range;         /* where energy_uj wraps */
+   unsigned long energy_start;
+   unsigned long energy_uj[2];         /* unconstrained and constrained windows */
+   unsigned long energy_nsec[2];
+} pm_qos_struct;
+static pm_qos_struct pm_qos = { 0, 0, 0L, -1, -1, 0L, 0L, { 0L, 0L }, { 0L, 0L } };
+
+static int write_sysfs_line(const char *path, const char *line) {
+   int fd=open(path, O_WRONLY), rv=-1;
+   if (fd < 0) return -1;
+   if (write(fd, line, strlen(line)) == (ssize_t)strlen(line)) rv=0;
+   close(fd);
+   return rv;
+}
+
+static unsigned long read_energy_uj(void) {
+   char value[32];
+   ssize_t length=pread(pm_qos.energy_fd, value, sizeof(value)-1, 0);
+   if (length <= 0) return 0L;
+   value[length]='\0';
+   return strtoul(value, NULL, 10);
+}
+
+/* Hold or release the limit this sampler is responsible for */
+static int pm_qos_apply(sampler_struct *s, int constrained) {
+   char path[PATH_MAX], value[32];
+   if (pm_qos.mode == PM_QOS_DMA) {
+      int32_t usecs=constrained ? (int32_t)pm_qos.usecs : PM_QOS_NO_CONSTRAINT;
+      return (write(pm_qos.dma_fd, &usecs, sizeof(usecs)) == sizeof(usecs)) ? 0 : -1;
+   }
+/* For this file "0" means no limit and "n/a" means no latency at all */
+   snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/power/pm_qos_resume_latency_us", s->cpu);
+   if (!constrained) snprintf(value, sizeof(value), "%s", s->pm_qos_saved);
+   else if (pm_qos.usecs == 0) snprintf(value, sizeof(value), "n/a");
+   else snprintf(value, sizeof(value), "%ld", pm_qos.usecs);
+   return write_sysfs_line(path, value);
+}
+
+/* The energy used since the last switch goes to the setting that was in force */
+static void pm_qos_account_energy(unsigned long nsec, int constrained) {
+   unsigned long now=read_energy_uj();
+   pm_qos.energy_uj[constrained]+=(now >= pm_qos.energy_start) ? now-pm_qos.energy_start : now+pm_qos.energy_range-pm_qos.energy_start;
+   pm_qos.energy_nsec[constrained]+=nsec;
+   pm_qos.energy_start=now;
+}
+
+static void pm_qos_start(sampler_struct *samplers, int sampler_count) {
+   char path[PATH_MAX], value[32];
+   int ndx;
+   if (pm_qos.mode == PM_QOS_DMA) {
+      pm_qos.dma_fd=open("/dev/cpu_dma_latency", O_RDWR);
+      if (pm_qos.dma_fd < 0) {
+         fprintf (stderr, "unable to open /dev/cpu_dma_latency: %s\n", strerror(errno));
+         exit (1);
+      }
+      samplers[0].pm_qos_owner=PM_QOS_OWNER_SETTING;
+   } else {
+      for (ndx=0; ndx<sampler_count; ndx++) {
+         snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/power/pm_qos_resume_latency_us", samplers[ndx].cpu);
+         read_sysfs_line(path, samplers[ndx].pm_qos_saved, sizeof(samplers[ndx].pm_qos_saved));
+         if (strcmp(samplers[ndx].pm_qos_saved, "unknown") == 0) {
+            fprintf (stderr, "CPU %d has no pm_qos_resume_latency_us\n", samplers[ndx].cpu);
+            exit (1);
+         }
+         samplers[ndx].pm_qos_owner=PM_QOS_OWNER_SETTING;
+      }
+   }
+   for (ndx=0; ndx<((pm_qos.mode == PM_QOS_DMA) ? 1 : sampler_count); ndx++) {
+      if (pm_qos_apply(&samplers[ndx], 1) != 0) {
+         fprintf (stderr, "unable to set the PM QoS latency limit: %s\n", strerror(errno));
+         exit (1);
+      }
+   }
+   if (pm_qos.ab == 1) {
+      pm_qos.energy_fd=open("/sys/class/powercap/intel-rapl:0/energy_uj", O_RDONLY);
+      if (pm_qos.energy_fd >= 0) {
+         read_sysfs_line("/sys/class/powercap/intel-rapl:0/max_energy_range_uj", value, sizeof(value));
+         pm_qos.energy_range=strtoul(value, NULL, 10);
+         samplers[0].pm_qos_owner|=PM_QOS_OWNER_ENERGY;
+      }
+   }
+/* Recorded with the rest of the header, ahead of the spikes */
+   if (format == CSV_FORMAT) printf("PM QoS,%s,%ld,%s\n", (pm_qos.mode == PM_QOS_DMA) ? "cpu_dma_latency" : "pm_qos_resume_latency_us", pm_qos.usecs, pm_qos.ab ? "A/B" : "held");
+   else if (format == XML_FORMAT) printf("<PMQoS>\n  <control>%s</control>\n  <usecs>%ld</usecs>\n  <ab>%d</ab>\n</PMQoS>\n", (pm_qos.mode == PM_QOS_DMA) ? "cpu_dma_latency" : "pm_qos_resume_latency_us", pm_qos.usecs, pm_qos.ab);
+   else printf("PM QoS:  %s limited to %ld usecs, %s\n", (pm_qos.mode == PM_QOS_DMA) ? "cpu_dma_latency" : "each sampled CPU's pm_qos_resume_latency_us", pm_qos.usecs,
+      pm_qos.ab ? "held in even windows and released in odd ones" : "held for the whole run");
+}
+
+static void pm_qos_stop(sampler_struct *samplers, int sampler_count) {
+   int ndx;
+   if (pm_qos.mode == PM_QOS_DMA) {
+      close(pm_qos.dma_fd);
+      pm_qos.dma_fd=-1;
+   } else {
+      for (ndx=0; ndx<sampler_count; ndx++) pm_qos_apply(&samplers[ndx], 0);
+   }
+   if (pm_qos.energy_fd >= 0) close(pm_qos.energy_fd);
+}
+
+static void print_pm_qos_ab(sampler_struct *samplers, int sampler_count) {
+   const char *hist_unit=(samplers[0].method==TIME_METHOD) ? nsec_string : spike_unit;
+   const char *setting[2]={"released", "held"};
+   unsigned long total, p99, p9999;
+   int ndx, constrained;
+   double watts;
+   if (format == CSV_FORMAT) printf("PM QoS limit,CPU,windows,iterations,spikes,maximum spike (%s),p99 (%s),p99.99 (%s)\n", spike_unit, hist_unit, hist_unit);
+   else if (format == XML_FORMAT) printf("      <PMQoSComparison>\n");
+   else printf("PM QoS A/B comparison:\n");
+   for (ndx=0; ndx<sampler_count; ndx++) {
+      for (constrained=1; constrained>=0; constrained--) {
+         pm_qos_stats_struct *q=&samplers[ndx].pm_qos_stats[constrained];
+         unsigned long cap=(q->spike_count > 0) ? q->max_spike : ULONG_MAX;
+         total=hist_total(&q->hist);
+         p99=(total > 0) ? hist_percentile(&q->hist, total, 99.0, cap) : 0L;
+         p9999=(total > 0) ? hist_percentile(&q->hist, total, 99.99, cap) : 0L;
+         if (format == CSV_FORMAT) printf("%s,%d,%lu,%lu,%lu,%lu,%lu,%lu\n", setting[constrained], samplers[ndx].cpu, q->windows, q->iterations, q->spike_count,
+            spike_units(samplers[ndx].method, q->max_spike), p99, p9999);
+         else if (format == XML_FORMAT) printf("         <setting><limit>%s</limit><cpu>%d</cpu><windows>%lu</windows><iterations>%lu</iterations><spikes>%lu</spikes><maximum_spike>%lu</maximum_spike><p99>%lu</p99><p99.99>%lu</p99.99></setting>\n",
+            setting[constrained], samplers[ndx].cpu, q->windows, q->iterations, q->spike_count, spike_units(samplers[ndx].method, q->max_spike), p99, p9999);
+         else {
+            printf("   limit %-8s", setting[constrained]);
+            if (samplers[ndx].cpu >= 0) printf(" CPU %d", samplers[ndx].cpu);
+            printf(":  %lu windows, %lu iterations, %lu spikes, maximum %lu %s, p99 %lu, p99.99 %lu %s\n", q->windows, q->iterations, q->spike_count,
+               spike_units(samplers[ndx].method, q->max_spike), spike_unit, p99, p9999, hist_unit);
+         }
+      }
+   }
+   for (constrained=1; constrained>=0; constrained--) {
+      if (pm_qos.energy_nsec[constrained] == 0) continue;
+      watts=(double)pm_qos.energy_uj[constrained]*1000.0/(double)pm_qos.energy_nsec[constrained];
+      if (format == CSV_FORMAT) printf("PM QoS package power (W),%s,%.2f\n", setting[constrained], watts);
+      else if (format == XML_FORMAT) printf("         <power><limit>%s</limit><watts>%.2f</watts></power>\n", setting[constrained], watts);
+      else printf("   limit %-8s package power %.2f W\n", setting[constrained], watts);
+   }
+   if (pm_qos.energy_fd < 0) {
+      if ((format != CSV_FORMAT) && (format != XML_FORMAT)) printf("   (no RAPL energy counter, so no power figures)\n");
+   }
+   if (format == XML_FORMAT) printf("      </PMQoSComparison>\n");
+}
+
+/* Hand the window over and start the next one; with "last" the run is over and there is no next one */
+static void close_window(sampler_struct *s, unsigned long now, int last) {
+   window_ring_struct *ring=s->windows;
+   stats_window_struct *w=s->window, *next;
+   unsigned long head=ring->head;
+   if ((last == 0) && (head+1-__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= WINDOW_SLOTS)) {
+      w->overruns++;
+      return;
+   }
+   w->end=now;
+   w->overhead=window_overhead(s)-w->overhead;
+   if (s->pm_qos_owner & PM_QOS_OWNER_ENERGY) pm_qos_account_energy(w->end-w->start, w->constrained);
+   __atomic_store_n(&ring->head, head+1, __ATOMIC_RELEASE);
+   if (last == 1) return;
+   next=&ring->slot[(head+1)%WINDOW_SLOTS];
+   next->number=w->number+1;
+   next->start=now;
+   next->overhead=window_overhead(s);
+   if (pm_qos.ab == 1) {
+      next->constrained=((next->number%2) == 0);
+      if (s->pm_qos_owner & PM_QOS_OWNER_SETTING) pm_qos_apply(s, next->constrained);
+   }
+   s->hist=&next->hist;
+   s->window=next;
+}
+
+static void run_chunks(sampler_struct *s, unsigned long loopcount, unsigned long threshold) {
+   void (*kernel)(sampler_struct *, unsigned long, unsigned long)=s->sample_kernel[1]->kernel;
+   unsigned long done, chunk, chunk_size, now=0L, window_end=0L;
+   sig_atomic_t snapshots=snapshot_requests;
+   timesignature stamp;
+   chunk_size=(s->method==WAKEUP_METHOD) ? 1 : SAMPLE_CHUNK;
+   s->iterations=0L;
+   if (s->windows != NULL) {
+      tt_gettime(&stamp);
+      now=tt_time_diff(&stamp, &s->start_time);
+      s->window=&s->windows->slot[0];
+      s->window->start=now;
+      s->window->overhead=window_overhead(s);
+      s->window->constrained=pm_qos.ab;
+      s->hist=&s->window->hist;
+      window_end=now+window_interval;
+/* A run that follows another may start with the limit released */
+      if ((pm_qos.ab == 1) && (s->pm_qos_owner & PM_QOS_OWNER_SETTING)) pm_qos_apply(s, 1);
+      if (s->pm_qos_owner & PM_QOS_OWNER_ENERGY) pm_qos.energy_start=read_energy_uj();
+   }
+   for (done=0; (done<loopcount) && (stop_requested == 0); done+=chunk) {
+      chunk=(loopcount-done < chunk_size) ? loopcount-done : chunk_size;
+      kernel(s, chunk, threshold);
+      s->iterations+=chunk;
+      if (s->windows != NULL) {
+         s->window->iterations+=chunk;
+         tt_gettime(&stamp);
+         now=tt_time_diff(&stamp, &s->start_time);
+         if (now >= window_end) {
+            close_window(s, now, 0);
+            while (window_end <= now) window_end+=window_interval;
+         }
+      }
+      if (snapshots != snapshot_requests) {
+         snapshots=snapshot_requests;
+         print_snapshot(s, done+chunk);
+      }
+      if (reopens_done != reopen_requests) reopen_output();
+      if (s->metrics != NULL) publish_metrics(s, done+chunk);
+   }
+   if (s->windows != NULL) {
+/* A run that ends right on a window boundary leaves an empty window behind; it isn't reported */
+      if (s->window->iterations > 0) close_window(s, now, 1);
+      s->window=NULL;
+      s->hist=&s->histogram;
+   }
+}
+
+static void run_sampler(sampler_struct *s) {
+   unsigned long count, diff;
+   unsigned long threshold, loopcount;
+   histogram_struct *hist=s->hist;
+   timesignature t0_stamp;
+   int warm_up;
+
+/* perf_event counters count the thread that opens them, so each sampler opens its own */
+   if (s->perf != NULL) perf_open(s->perf, perf_available);
+   warm_up=0;
+   while ( warm_up++ < 2 ) {
+      if ( warm_up == 1 ) {
+/* A full buffer of wakeups could take seconds; a few are enough to fault in the sleep path */
+         loopcount=(s->method==WAKEUP_METHOD) ? 16 : MAX_SPIKES;
+         threshold=0L;
+         s->quiet=1;
+      } else {
+         loopcount=s->loopcount;
+         threshold=s->threshold;
+         s->quiet=0;
+         s->spike_ndx=0L;
+         s->spike_drops=0L;
+         s->last_printed=0L;
+/* With "--record-only" even the header is printed before the measurement starts */
+         if ((record_only == 1) && (spike_header_printed == 0)) print_spike_header(s->cpu);
+         s->spike_count=0L;
+         s->max_spike=0L;
+         s->min_spike=ULONG_MAX;
+         s->overhead_nsec=0L;
+         s->overhead_cycles=0L;
+         if (hist != NULL) memset(hist, 0, sizeof(histogram_struct));
+         s->smi_spikes=0L;
+/* With several samplers, wait until all of them have warmed up so they measure the same window,
+   then once more while main() sets run_epoch
+*/
+         if (s->start_barrier != NULL) {
+            pthread_barrier_wait(s->start_barrier);
+            pthread_barrier_wait(s->start_barrier);
+         }
+         if ((s->msr_fd >= 0) && (msr_pread(s->msr_fd, MSR_SMI_COUNT, &s->smi_count) != 0)) s->msr_fd=-1;
+         if (s->perf != NULL) perf_deltas(s->perf, NULL);
+      }
+      tt_gettime (&t0_stamp);
+      tt_time_diff(&t0_stamp,&t0_stamp);
+      s->start_time = t0_stamp;
+/* All samplers share one epoch so their elapsed times can be merged into a single report */
+      if ((warm_up == 2) && (s->start_barrier != NULL)) s->start_time = run_epoch;
+      if ((warm_up == 2) && (s->log != NULL)) {
+         s->log->header->epoch_sec=s->start_time.tv_sec;
+         s->log->header->epoch_nsec=s->start_time.tv_nsec;
+      }
+      if (s->method==WAKEUP_METHOD) {
+         s->wakeup_deadline=t0_stamp;
+      } else if (s->method==CYCLES_METHOD) {
+/* Get an initial value for min_spike */
+         unsigned long cycle_stamp[2];
+         cycle_stamp[0]=get_cycles_p();
+         for (count = 1; count <= 1024; count++) {
+            cycle_stamp[count%2]=get_cycles_p();
+            diff = cycle_stamp[count%2] - cycle_stamp[(count-1)%2];
+            if (diff < s->min_spike) s->min_spike = diff;
+         }
+      }
+      s->hog_cycles=0L;
+/* Each pass starts from a fresh reading; the warm-up and the barriers are not part of the measured pass */
+      s->chunk_carry=0;
+      s->migrations=0L;
+      if (warm_up == 2) run_chunks(s, loopcount, threshold);
+      else s->sample_kernel[0]->kernel(s, loopcount, threshold);
+   }
+/* The full buffer has been dumped when it was filled;
+   now that the loop is done the buffer has probably accumulated more spikes.  A lone sampler dumps it now;
+   with several samplers the leftovers are merged by main() once every sampler has finished.
+*/
+   if ((s->start_barrier == NULL) && (s->spike_ndx>0)) print_big_diff(s);
+   if (s->perf != NULL) perf_close(s->perf);
+}
+
+static void *sampler_thread(void *arg) {
+   run_sampler((sampler_struct *)arg);
+   return NULL;
+}
+
+/* "--noise" interference generators: threads on CPUs that aren't being measured, keeping the memory system
+busy while the samplers run so the isolation of the measured CPUs can be judged.  "stream" threads run the
+STREAM triad over three arrays; "chase" threads follow a random cyclic chain of cache lines, which defeats
+the prefetchers and keeps evicting the shared last-level cache.  Each thread allocates and touches its own
+buffers on its own CPU before the measured run starts.
+*/
+#define NOISE_STREAM 1
+#define NOISE_CHASE  2
+#define NOISE_MEM    (NOISE_STREAM|NOISE_CHASE)
+typedef struct noise {
+   int kind;                           /* NOISE_STREAM or NOISE_CHASE */
+   int cpu;
+   size_t bytes;
+   double *a, *b, *c;
+   char *lines;
+   unsigned long passes;
+   unsigned long units;                /* bytes moved (stream) or loads made (chase) */
+   double seconds;
+   pthread_t thread;
+} noise_struct;
+static int noise_stop=0;
+static int noise_ready=0;
+
+static void noise_chase_init(noise_struct *n) {
+   chase_chain_init(n->lines, n->bytes/CACHE_LINE_SIZE, 0x2545F4914F6CDD1DUL+n->cpu);
+}
+
+static void *noise_thread(void *arg) {
+   noise_struct *n=(noise_struct *)arg;
+   size_t count, ndx;
+   struct timespec start, finish;
+   if (n->kind == NOISE_STREAM) {
+      count=n->bytes/(3*sizeof(double));
+      if ((posix_memalign((void **)&n->a, CACHE_LINE_SIZE, count*sizeof(double)) != 0) ||
+          (posix_memalign((void **)&n->b, CACHE_LINE_SIZE, count*sizeof(double)) != 0) ||
+          (posix_memalign((void **)&n->c, CACHE_LINE_SIZE, count*sizeof(double)) != 0)) count=0;
+      for (ndx=0; ndx<count; ndx++) { n->a[ndx]=0.0; n->b[ndx]=1.0; n->c[ndx]=2.0; }
+   } else {
+      count=n->bytes/CACHE_LINE_SIZE;
+      if (posix_memalign((void **)&n->lines, CACHE_LINE_SIZE, count*CACHE_LINE_SIZE) != 0) count=0;
+      else noise_chase_init(n);
+   }
+   __atomic_add_fetch(&noise_ready, 1, __ATOMIC_RELEASE);
+   if (count == 0) return NULL;
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   while (__atomic_load_n(&noise_stop, __ATOMIC_RELAXED) == 0) {
+      if (n->kind == NOISE_STREAM) {
+         for (ndx=0; ndx<count; ndx++) n->a[ndx]=n->b[ndx]+3.0*n->c[ndx];
+         n->units+=3*count*sizeof(double);
+      } else {
+         char * volatile *line=(char * volatile *)n->lines;
+         for (ndx=0; ndx<count; ndx++) line=(char * volatile *)*line;
+         n->units+=count;
+      }
+      n->passes++;
+   }
+   clock_gettime(CLOCK_MONOTONIC, &finish);
+   n->seconds=(finish.tv_sec-start.tv_sec)+(finish.tv_nsec-start.tv_nsec)/1e9;
+   return NULL;
+}
+
+/* Start a noise thread on each CPU and wait until all of them have their buffers ready */
+static void start_noise(noise_struct *noise, int noise_count) {
+   pthread_attr_t attr;
+   struct sched_param noise_sp = { 0 };
+   cpu_set_t one_cpu;
+   int ndx, rv;
+   noise_stop=0;
+   noise_ready=0;
+   for (ndx=0; ndx<noise_count; ndx++) {
+      pthread_attr_init(&attr);
+      CPU_ZERO(&one_cpu);
+      CPU_SET(noise[ndx].cpu, &one_cpu);
+      pthread_attr_setaffinity_np(&attr, sizeof(one_cpu), &one_cpu);
+/* main() is already at the samplers' policy and priority; noise is ordinary load, not a real-time thread */
+      pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+      pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+      pthread_attr_setschedparam(&attr, &noise_sp);
+      rv = pthread_create(&noise[ndx].thread, &attr, noise_thread, &noise[ndx]);
+      pthread_attr_destroy(&attr);
+      if (rv != 0) {
+         fprintf (stderr, "unable to start the noise thread on CPU %d: %s\n", noise[ndx].cpu, strerror(rv));
+         exit (1);
+      }
+   }
+   while (__atomic_load_n(&noise_ready, __ATOMIC_ACQUIRE) < noise_count) usleep(1000);
+}
+
+static void stop_noise(noise_struct *noise, int noise_count) {
+   int ndx;
+   __atomic_store_n(&noise_stop, 1, __ATOMIC_RELAXED);
+   for (ndx=0; ndx<noise_count; ndx++) {
+      pthread_join(noise[ndx].thread, NULL);
+      free(noise[ndx].a); free(noise[ndx].b); free(noise[ndx].c); free(noise[ndx].lines);
+      noise[ndx].a=noise[ndx].b=noise[ndx].c=NULL;
+      noise[ndx].lines=NULL;
+   }
+}
+
+/* Mark where the quiet and the loaded run start in the spike output */
+static void print_noise_phase(const char *phase, noise_struct *noise, int noise_count) {
+   int ndx;
+   if (format == CSV_FORMAT) {
+      printf("Run,%s", phase);
+      for (ndx=0; ndx<noise_count; ndx++) printf(",%s on CPU %d", (noise[ndx].kind == NOISE_STREAM)?"stream":"chase", noise[ndx].cpu);
+      printf("\n");
+   } else if (format == XML_FORMAT) {
+      printf("      <run>%s</run>\n", phase);
+   } else {
+      printf("%s run", (phase[0]=='q') ? "Quiet" : "Loaded");
+      if (noise_count > 0) printf(", noise:");
+      for (ndx=0; ndx<noise_count; ndx++) printf(" %s on CPU %d", (noise[ndx].kind == NOISE_STREAM)?"stream":"chase", noise[ndx].cpu);
+      printf("\n");
+   }
+}
+
+/* What the noise threads achieved while the loaded run was measured */
+static void print_noise_summary(noise_struct *noise, int noise_count) {
+   int ndx;
+   double rate;
+   if (format == CSV_FORMAT) printf("noise CPU,kind,MB,passes,rate\n");
+   for (ndx=0; ndx<noise_count; ndx++) {
+      noise_struct *n=&noise[ndx];
+      if (n->seconds <= 0.0) continue;
+      rate=(n->kind == NOISE_STREAM) ? n->units/n->seconds/1e9 : n->seconds*1e9/n->units;
+      if (format == CSV_FORMAT) printf("%d,%s,%lu,%lu,%.2f %s\n", n->cpu, (n->kind == NOISE_STREAM)?"stream":"chase", n->bytes>>20, n->passes, rate, (n->kind == NOISE_STREAM)?"GB/s":"nsec/load");
+      else if (format == XML_FORMAT) printf("      <noise><cpu>%d</cpu><kind>%s</kind><MB>%lu</MB><passes>%lu</passes><%s>%.2f</%s></noise>\n", n->cpu, (n->kind == NOISE_STREAM)?"stream":"chase", n->bytes>>20, n->passes, (n->kind == NOISE_STREAM)?"GBps":"nsec_per_load", rate, (n->kind == NOISE_STREAM)?"GBps":"nsec_per_load");
+      else printf("Noise on CPU %d:  %s over %lu MB, %lu passes, %.2f %s\n", n->cpu, (n->kind == NOISE_STREAM)?"stream":"chase", n->bytes>>20, n->passes, rate, (n->kind == NOISE_STREAM)?"GB/s":"nsec per load");
+   }
+}
+
+/* The quiet run's results, kept for the side-by-side report once the loaded run is done */
+typedef struct run_stats {
+   unsigned long spike_count;
+   unsigned long max_spike;
+   unsigned long min_spike;
+   histogram_struct histogram;
+} run_stats_struct;
+
+static void save_run_stats(run_stats_struct *stats, sampler_struct *samplers, int sampler_count) {
+   int this;
+   for (this=0; this<sampler_count; this++) {
+      stats[this].spike_count=samplers[this].spike_count;
+      stats[this].max_spike=samplers[this].max_spike;
+      stats[this].min_spike=samplers[this].min_spike;
+      if (samplers[this].hist != NULL) stats[this].histogram=*samplers[this].hist;
+   }
+}
+
+static void print_noise_comparison(run_stats_struct *quiet, sampler_struct *samplers, int sampler_count) {
+   run_stats_struct loaded;
+   run_stats_struct *run[2];
+   static const char *run_name[2]={"quiet", "loaded"};
+   const char *hist_unit=(samplers[0].method==TIME_METHOD) ? nsec_string : spike_unit;
+   unsigned long total, p99[2]={0,0}, p9999[2]={0,0};
+   int this, which;
+   if (format == CSV_FORMAT) {
+      printf("%srun,spikes,maximum spike (%s),minimum spike (%s)", (samplers[0].cpu>=0)?"CPU,":"", spike_unit, spike_unit);
+      if (samplers[0].hist != NULL) printf(",p99 (%s),p99.99 (%s)", hist_unit, hist_unit);
+      printf("\n");
+   } else if (format == FREEFORM_FORMAT) {
+      printf("Quiet vs loaded:\n");
+   }
+   for (this=0; this<sampler_count; this++) {
+      save_run_stats(&loaded, &samplers[this], 1);
+      run[0]=&quiet[this];
+      run[1]=&loaded;
+      for (which=0; which<2; which++) {
+         if (samplers[this].hist == NULL) continue;
+         total=hist_total(&run[which]->histogram);
+         if (total == 0) continue;
+         p99[which]=hist_percentile(&run[which]->histogram, total, 99.0, (run[which]->spike_count > 0) ? run[which]->max_spike : ULONG_MAX);
+         p9999[which]=hist_percentile(&run[which]->histogram, total, 99.99, (run[which]->spike_count > 0) ? run[which]->max_spike : ULONG_MAX);
+      }
+      if (format == CSV_FORMAT) {
+         for (which=0; which<2; which++) {
+            if (samplers[this].cpu>=0) printf("%d,", samplers[this].cpu);
+            printf("%s,%lu,%lu,%lu", run_name[which], run[which]->spike_count, spike_units(samplers[this].method, run[which]->max_spike), spike_units(samplers[this].method, run[which]->min_spike));
+            if (samplers[this].hist != NULL) printf(",%lu,%lu", p99[which], p9999[which]);
+            printf("\n");
+         }
+      } else if (format == XML_FORMAT) {
+         printf("      <noise_comparison>\n");
+         if (samplers[this].cpu>=0) printf("         <cpu>%d</cpu>\n", samplers[this].cpu);
+         for (which=0; which<2; which++) {
+            printf("         <%s><spikes>%lu</spikes><maximum_spike>%lu</maximum_spike><minimum_spike>%lu</minimum_spike>", run_name[which], run[which]->spike_count, spike_units(samplers[this].method, run[which]->max_spike), spike_units(samplers[this].method, run[which]->min_spike));
+            if (samplers[this].hist != NULL) printf("<p99>%lu</p99><p99.99>%lu</p99.99>", p99[which], p9999[which]);
+            printf("</%s>\n", run_name[which]);
+         }
+         printf("      </noise_comparison>\n");
+      } else {
+         if (samplers[this].cpu>=0) printf("   CPU %3d:", samplers[this].cpu);
+         else printf("  ");
+         printf(" spikes %lu -> %lu, maximum %lu -> %lu %s", run[0]->spike_count, run[1]->spike_count, spike_units(samplers[this].method, run[0]->max_spike), spike_units(samplers[this].method, run[1]->max_spike), spike_unit);
+         if (samplers[this].hist != NULL) printf(", p99 %lu -> %lu %s, p99.99 %lu -> %lu %s", p99[0], p99[1], hist_unit, p9999[0], p9999[1], hist_unit);
+         printf("\n");
+      }
+   }
+}
+
+/* "--method pingpong": the round-trip latency of handing a cache line back and forth between two pinned
+threads, for every pair of the chosen CPUs.  The initiator stores an odd sequence number into the shared
+line and spins until the responder has answered with the next even one; each round trip is timed with
+rdtscp.  Pairs are measured one after the other so they never disturb each other, and the initiator is
+always the lower-numbered CPU.  Round trips at or above the threshold are kept as the pair's spikes.
+*/
+#define PINGPONG_SPIKES 32
+#define PINGPONG_WARMUP 1000
+typedef struct pingpong_pair {
+   int cpu[2];
+   unsigned long min, median, p99, max;
+   unsigned long spike_count;
+   spike_data_struct spikes[PINGPONG_SPIKES];
+} pingpong_pair_struct;
+
+typedef struct pingpong {
+   unsigned long line __attribute__ ((aligned (CACHE_LINE_SIZE)));
+   unsigned long loopcount __attribute__ ((aligned (CACHE_LINE_SIZE)));
+   unsigned long threshold;
+   pthread_barrier_t ready;
+   pingpong_pair_struct *pair;
+   histogram_struct hist;
+} pingpong_struct;
+
+static void *pingpong_responder(void *arg) {
+   pingpong_struct *p=(pingpong_struct *)arg;
+   unsigned long seq, last=2*(p->loopcount+PINGPONG_WARMUP);
+   pthread_barrier_wait(&p->ready);
+   for (seq=1; seq<last; seq+=2) {
+      while (__atomic_load_n(&p->line, __ATOMIC_ACQUIRE) != seq) ;
+      __atomic_store_n(&p->line, seq+1, __ATOMIC_RELEASE);
+   }
+   return NULL;
+}
+
+static void *pingpong_initiator(void *arg) {
+   pingpong_struct *p=(pingpong_struct *)arg;
+   pingpong_pair_struct *pair=p->pair;
+   unsigned long count, seq, diff, t0, t1;
+   timesignature start, now;
+   pthread_barrier_wait(&p->ready);
+   tt_gettime(&start);
+   for (count=0, seq=1; count<p->loopcount+PINGPONG_WARMUP; count++, seq+=2) {
+      t0=get_cycles_p();
+      __atomic_store_n(&p->line, seq, __ATOMIC_RELEASE);
+      while (__atomic_load_n(&p->line, __ATOMIC_ACQUIRE) != seq+1) ;
+      t1=get_cycles_p();
+      if (count < PINGPONG_WARMUP) continue;
+      diff=t1-t0;
+      hist_record(&p->hist, diff);
+      if (diff < pair->min) pair->min=diff;
+      if (diff > pair->max) pair->max=diff;
+      if (diff >= p->threshold) {
+         if (pair->spike_count < PINGPONG_SPIKES) {
+            spike_data_struct *spike=&pair->spikes[pair->spike_count];
+            tt_gettime(&now);
+            memset(spike, 0, sizeof(spike_data_struct));
+            spike->time=tt_time_diff(&now, &start);
+            spike->spike=diff;
+            spike->cpu=(uint32_t)pair->cpu[1];
+         }
+         pair->spike_count++;
+      }
+   }
+   return NULL;
+}
+
+static void run_pingpong_pair(pingpong_struct *p, int requested_policy, int requested_priority) {
+   pthread_attr_t attr;
+   pthread_t thread[2];
+   struct sched_param thread_sp = { requested_priority };
+   cpu_set_t one_cpu;
+   void *(*role[2])(void *)={pingpong_initiator, pingpong_responder};
+   unsigned long total;
+   int ndx, rv;
+   memset(&p->hist, 0, sizeof(histogram_struct));
+   p->line=0L;
+   p->pair->min=ULONG_MAX;
+   pthread_barrier_init(&p->ready, NULL, 2);
+   for (ndx=0; ndx<2; ndx++) {
+      pthread_attr_init(&attr);
+      CPU_ZERO(&one_cpu);
+      CPU_SET(p->pair->cpu[ndx], &one_cpu);
+      pthread_attr_setaffinity_np(&attr, sizeof(one_cpu), &one_cpu);
+      pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+      pthread_attr_setschedpolicy(&attr, requested_policy);
+      pthread_attr_setschedparam(&attr, &thread_sp);
+      rv = pthread_create(&thread[ndx], &attr, role[ndx], p);
+      if (rv == EPERM) {
+         pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+         rv = pthread_create(&thread[ndx], &attr, role[ndx], p);
+      }
+      pthread_attr_destroy(&attr);
+      if (rv != 0) {
+         fprintf (stderr, "unable to start the pingpong thread on CPU %d: %s\n", p->pair->cpu[ndx], strerror(rv));
+         exit (1);
+      }
+   }
+   for (ndx=0; ndx<2; ndx++) pthread_join(thread[ndx], NULL);
+   pthread_barrier_destroy(&p->ready);
+   total=hist_total(&p->hist);
+   p->pair->median=hist_percentile(&p->hist, total, 50.0, p->pair->max);
+   p->pair->p99=hist_percentile(&p->hist, total, 99.0, p->pair->max);
+}
+
+/* One of the three matrices; the initiator's CPU is the row */
+static void print_pingpong_matrix(const char *name, pingpong_pair_struct *pairs, int *cpus, int cpu_count, size_t field) {
+   int row, column;
+   pingpong_pair_struct *pair;
+   if (format == CSV_FORMAT) {
+      printf("%s round trip (%s)", name, cycle_string);
+      for (column=0; column<cpu_count; column++) printf(",CPU %d", cpus[column]);
+      printf("\n");
+   } else {
+      printf("%s round trip (%s)\n%8s", name, cycle_string, "");
+      for (column=0; column<cpu_count; column++) printf(" %7d", cpus[column]);
+      printf("\n");
+   }
+   for (row=0; row<cpu_count; row++) {
+      printf((format == CSV_FORMAT) ? "CPU %d" : "%8d", cpus[row]);
+      for (column=0; column<cpu_count; column++) {
+         if (row == column) {
+            printf((format == CSV_FORMAT) ? "," : "       -");
+            continue;
+         }
+         pair=&pairs[(row < column) ? row*cpu_count+column : column*cpu_count+row];
+         printf((format == CSV_FORMAT) ? ",%lu" : " %7lu", *(unsigned long *)((char *)pair+field));
+      }
+      printf("\n");
+   }
+}
+
+static void print_pingpong(pingpong_pair_struct *pairs, int *cpus, int cpu_count) {
+   int row, column;
+   unsigned long ndx;
+   pingpong_pair_struct *pair;
+   if (format == XML_FORMAT) {
+      printf("      <pingpong>\n");
+      for (row=0; row<cpu_count; row++) for (column=row+1; column<cpu_count; column++) {
+         pair=&pairs[row*cpu_count+column];
+         printf("         <pair><cpu>%d</cpu><cpu>%d</cpu><min>%lu</min><median>%lu</median><p99>%lu</p99><max>%lu</max><spikes>%lu</spikes>", pair->cpu[0], pair->cpu[1], pair->min, pair->median, pair->p99, pair->max, pair->spike_count);
+         for (ndx=0; (ndx<pair->spike_count) && (ndx<PINGPONG_SPIKES); ndx++) {
+            print_seconds("\n            <datum><elapsed>", pair->spikes[ndx].time, "</elapsed>");
+            printf("<spike>%lu</spike></datum>", (unsigned long)pair->spikes[ndx].spike);
+         }
+         printf("\n         </pair>\n");
+      }
+      printf("      </pingpong>\n");
+      return;
+   }
+   print_pingpong_matrix("Minimum", pairs, cpus, cpu_count, offsetof(pingpong_pair_struct, min));
+   print_pingpong_matrix("Median", pairs, cpus, cpu_count, offsetof(pingpong_pair_struct, median));
+   print_pingpong_matrix("p99", pairs, cpus, cpu_count, offsetof(pingpong_pair_struct, p99));
+   if (format == CSV_FORMAT) printf("CPU,CPU,Elapsed time (seconds),round trip (%s)\n", cycle_string);
+   for (row=0; row<cpu_count; row++) for (column=row+1; column<cpu_count; column++) {
+      pair=&pairs[row*cpu_count+column];
+      if (pair->spike_count == 0) continue;
+      if (format == FREEFORM_FORMAT) printf("CPU %d <-> CPU %d:  %lu spikes, maximum %lu %s\n", pair->cpu[0], pair->cpu[1], pair->spike_count, pair->max, cycle_string);
+      for (ndx=0; (ndx<pair->spike_count) && (ndx<PINGPONG_SPIKES); ndx++) {
+         if (format == CSV_FORMAT) {
+            printf("%d,%d,", pair->cpu[0], pair->cpu[1]);
+            print_seconds("", pair->spikes[ndx].time, ",");
+            printf("%lu\n", (unsigned long)pair->spikes[ndx].spike);
+         } else {
+            print_seconds("   ", pair->spikes[ndx].time, "");
+            printf(" Latency spike of %lu %s\n", (unsigned long)pair->spikes[ndx].spike, cycle_string);
+         }
+      }
+   }
+}
+
+/* Every pair in turn; returns after printing the matrices */
+static void run_pingpong(cpu_set_t *pingpong_cpus, unsigned long loopcount, unsigned long threshold, int requested_policy, int requested_priority) {
+   pingpong_struct *p;
+   pingpong_pair_struct *pairs;
+   int *cpus, cpu_count=CPU_COUNT(pingpong_cpus), cpu, row, column;
+   cpus=(int *)malloc(cpu_count*sizeof(int));
+   pairs=(pingpong_pair_struct *)calloc(cpu_count*cpu_count, sizeof(pingpong_pair_struct));
+   if ((posix_memalign((void **)&p, CACHE_LINE_SIZE, sizeof(pingpong_struct)) != 0) || (cpus == NULL) || (pairs == NULL)) {
+      perror("unable to allocate memory for the pingpong matrix");
+      exit (1);
+   }
+   for (cpu=0, row=0; row<cpu_count; cpu++) if (CPU_ISSET(cpu, pingpong_cpus)) cpus[row++]=cpu;
+   p->loopcount=loopcount;
+   p->threshold=threshold;
+   for (row=0; row<cpu_count; row++) for (column=row+1; column<cpu_count; column++) {
+      p->pair=&pairs[row*cpu_count+column];
+      p->pair->cpu[0]=cpus[row];
+      p->pair->cpu[1]=cpus[column];
+      if (chatty >= 2) printf("%spingpong between CPU %d and CPU %d%s\n", XML_head, cpus[row], cpus[column], XML_tail);
+      run_pingpong_pair(p, requested_policy, requested_priority);
+   }
+   print_pingpong(pairs, cpus, cpu_count);
+   free(p);
+   free(pairs);
+   free(cpus);
+}
+
+/* The "--interval" reporter.  It polls every sampler's window ring, prints each finished window in the
+"--format" (or as a JSON line to the "--json" file), folds its histogram into the run's and gives the slot
+back.  Like the writer it is housekeeping work and runs with SCHED_OTHER.
+*/
+typedef struct reporter {
+   sampler_struct *samplers;
+   int sampler_count;
+   int done;                           /* set by run_samplers() once every sampler has finished */
+   FILE *json;                         /* NULL: windows are printed on stdout in the --format */
+   pthread_t thread;
+} reporter_struct;
+static reporter_struct reporter;
+
+static void print_window(reporter_struct *r, sampler_struct *s, stats_window_struct *w) {
+   static int header_printed=0;
+   const char *hist_unit=(s->method==TIME_METHOD) ? nsec_string : spike_unit;
+   const char *overhead_unit=CYCLE_METHOD(s->method) ? "cycles" : "seconds";
+   unsigned long total=hist_total(&w->hist), cap=(w->spike_count > 0) ? w->max_spike : ULONG_MAX;
+   unsigned long p50=0L, p99=0L, p999=0L, p9999=0L;
+   char start[32], end[32], overhead[32];
+   if (total > 0) {
+      p50=hist_percentile(&w->hist, total, 50.0, cap);
+      p99=hist_percentile(&w->hist, total, 99.0, cap);
+      p999=hist_percentile(&w->hist, total, 99.9, cap);
+      p9999=hist_percentile(&w->hist, total, 99.99, cap);
+   }
+   snprintf(start, sizeof(start), "%lu.%.*lu", w->start/1000000000L, timesource->digits, (w->start%1000000000L)/timesource->scale);
+   snprintf(end, sizeof(end), "%lu.%.*lu", w->end/1000000000L, timesource->digits, (w->end%1000000000L)/timesource->scale);
+   if (CYCLE_METHOD(s->method)) snprintf(overhead, sizeof(overhead), "%lu", w->overhead);
+   else snprintf(overhead, sizeof(overhead), "%lu.%.*lu", w->overhead/1000000000L, timesource->digits, (w->overhead%1000000000L)/timesource->scale);
+/* The lock also covers the JSON lines, since "--json -" shares stdout with the spikes */
+   pthread_mutex_lock(&output_lock);
+   if (r->json != NULL) {
+      fprintf(r->json, "{\"window\":%lu,\"cpu\":%d,\"start\":%s,\"end\":%s,\"iterations\":%lu,\"spikes\":%lu,\"max_spike\":%lu,\"spike_unit\":\"%s\","
+                       "\"p50\":%lu,\"p99\":%lu,\"p99_9\":%lu,\"p99_99\":%lu,\"percentile_unit\":\"%s\",\"overhead\":%s,\"overhead_unit\":\"%s\",\"overruns\":%lu%s}\n",
+         w->number, s->cpu, start, end, w->iterations, w->spike_count, spike_units(s->method, w->max_spike), spike_unit,
+         p50, p99, p999, p9999, hist_unit, overhead, overhead_unit, w->overruns, (pm_qos.ab == 0) ? "" : w->constrained ? ",\"pm_qos\":true" : ",\"pm_qos\":false");
+   } else if (format == CSV_FORMAT) {
+      if (header_printed == 0) {
+         printf("Window,number,CPU,start (seconds),end (seconds),iterations,spikes,maximum spike (%s),p50 (%s),p99 (%s),p99.9 (%s),p99.99 (%s),overhead (%s),overruns%s\n",
+            spike_unit, hist_unit, hist_unit, hist_unit, hist_unit, overhead_unit, (pm_qos.ab == 1) ? ",PM QoS limit" : "");
+         header_printed=1;
+      }
+      printf("window,%lu,%d,%s,%s,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%s,%lu", w->number, s->cpu, start, end, w->iterations, w->spike_count,
+         spike_units(s->method, w->max_spike), p50, p99, p999, p9999, overhead, w->overruns);
+      if (pm_qos.ab == 1) printf(",%d", w->constrained);
+      printf("\n");
+   } else if (format == XML_FORMAT) {
+      printf("      <window><number>%lu</number><cpu>%d</cpu><start>%s</start><end>%s</end><iterations>%lu</iterations><spikes>%lu</spikes>"
+             "<maximum_spike>%lu</maximum_spike><p50>%lu</p50><p99>%lu</p99><p99.9>%lu</p99.9><p99.99>%lu</p99.99><overhead>%s</overhead><overruns>%lu</overruns>%s</window>\n",
+         w->number, s->cpu, start, end, w->iterations, w->spike_count, spike_units(s->method, w->max_spike), p50, p99, p999, p9999, overhead, w->overruns,
+         (pm_qos.ab == 0) ? "" : w->constrained ? "<pm_qos>1</pm_qos>" : "<pm_qos>0</pm_qos>");
+   } else {
+      printf("Window %lu", w->number);
+      if (s->cpu >= 0) printf(" on CPU %d", s->cpu);
+      printf(", %s to %s seconds:  %lu iterations, %lu spikes, maximum %lu %s, p50 %lu, p99 %lu, p99.9 %lu, p99.99 %lu %s, overhead %s %s",
+         start, end, w->iterations, w->spike_count, spike_units(s->method, w->max_spike), spike_unit, p50, p99, p999, p9999, hist_unit, overhead, overhead_unit);
+      if (w->overruns > 0) printf(", %lu overruns", w->overruns);
+      if (pm_qos.ab == 1) printf(w->constrained ? ", PM QoS limit held" : ", PM QoS limit released");
+      printf("\n");
+   }
+   fflush(stdout);
+   pthread_mutex_unlock(&output_lock);
+}
+
+static void report_windows(reporter_struct *r) {
+   int ndx;
+   for (ndx=0; ndx<r->sampler_count; ndx++) {
+      sampler_struct *s=&r->samplers[ndx];
+      window_ring_struct *ring=s->windows;
+      unsigned long tail=ring->tail, head=__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+      while (tail < head) {
+         stats_window_struct *w=&ring->slot[tail%WINDOW_SLOTS];
+         print_window(r, s, w);
+         if (pm_qos.ab == 1) {
+            pm_qos_stats_struct *q=&s->pm_qos_stats[w->constrained];
+            q->windows++;
+            q->iterations+=w->iterations;
+            q->spike_count+=w->spike_count;
+            if (w->max_spike > q->max_spike) q->max_spike=w->max_spike;
+            hist_merge(&q->hist, &w->hist);
+         }
+         hist_merge(&s->histogram, &w->hist);
+         if (s->metrics != NULL) publish_histogram(s->metrics, &s->histogram);
+         memset(w, 0, sizeof(stats_window_struct));
+         tail++;
+         __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+      }
+   }
+}
+
+static void *reporter_thread(void *arg) {
+   reporter_struct *r=(reporter_struct *)arg;
+   while (__atomic_load_n(&r->done, __ATOMIC_ACQUIRE) == 0) {
+      report_windows(r);
+      usleep(10000);
+   }
+   report_windows(r);
+   return NULL;
+}
+
+/* The "--metrics" exporter.  It serves the samplers' totals, maximum spike, overhead, SMI counts and
+histogram as OpenMetrics text over HTTP, on a UNIX domain socket or a port on 127.0.0.1, so a long run can
+be scraped instead of having its stdout parsed.  Everything it reports is copied out of the seqlock
+snapshots; it never touches the samplers' own counters.  It is housekeeping and runs with SCHED_OTHER,
+off the sampled CPUs.
+*/
+typedef struct exporter {
+   sampler_struct *samplers;
+   int sampler_count;
+   int fd;                             /* the listening socket */
+   const char *path;                   /* the UNIX socket, or NULL for a TCP port */
+   int done;
+   unsigned long scrapes;
+   pthread_t thread;
+} exporter_struct;
+static exporter_struct exporter;
+
+/* Copy one sampler's snapshot out, retrying while the writer is in the middle of an update */
+static void metrics_read(sampler_metrics_struct *m, sampler_metrics_struct *copy) {
+   unsigned long seq;
+   do {
+      while ((seq=__atomic_load_n(&m->seq, __ATOMIC_ACQUIRE)) & 1) sched_yield();
+      copy->iterations=m->iterations;
+      copy->spike_count=m->spike_count;
+      copy->max_spike=m->max_spike;
+      copy->overhead=m->overhead;
+      copy->smi_spikes=m->smi_spikes;
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+   } while (__atomic_load_n(&m->seq, __ATOMIC_RELAXED) != seq);
+   do {
+      while ((seq=__atomic_load_n(&m->hist_seq, __ATOMIC_ACQUIRE)) & 1) sched_yield();
+      memcpy(&copy->hist, &m->hist, sizeof(histogram_struct));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+   } while (__atomic_load_n(&m->hist_seq, __ATOMIC_RELAXED) != seq);
+}
+
+/* OpenMetrics wants base units: seconds for the time-based methods, cycles for the cycle-based ones */
+static void print_metric_value(FILE *f, int method, unsigned long value) {
+   if (CYCLE_METHOD(method)) fprintf(f, "%lu", value);
+   else fprintf(f, "%.9f", (double)value/1e9);
+}
+
+static void print_metrics(FILE *f, exporter_struct *e, sampler_metrics_struct *copy) {
+   int ndx, method=e->samplers[0].method;
+   unsigned int bucket, top;
+   unsigned long running;
+   const char *unit=CYCLE_METHOD(method) ? "cycles" : "seconds";
+   unsigned long SMI_count;
+   for (ndx=0; ndx<e->sampler_count; ndx++) metrics_read(e->samplers[ndx].metrics, &copy[ndx]);
+   fprintf(f, "# TYPE hptt_iterations counter\n# HELP hptt_iterations Loop iterations measured.\n");
+   for (ndx=0; ndx<e->sampler_count; ndx++) fprintf(f, "hptt_iterations_total{cpu=\"%d\"} %lu\n", e->samplers[ndx].cpu, copy[ndx].iterations);
+   fprintf(f, "# TYPE hptt_spikes counter\n# HELP hptt_spikes Iterations at or over the threshold.\n");
+   for (ndx=0; ndx<e->sampler_count; ndx++) fprintf(f, "hptt_spikes_total{cpu=\"%d\"} %lu\n", e->samplers[ndx].cpu, copy[ndx].spike_count);
+   fprintf(f, "# TYPE hptt_max_spike_%s gauge\n# UNIT hptt_max_spike_%s %s\n# HELP hptt_max_spike_%s Longest spike so far.\n", unit, unit, unit, unit);
+   for (ndx=0; ndx<e->sampler_count; ndx++) {
+      fprintf(f, "hptt_max_spike_%s{cpu=\"%d\"} ", unit, e->samplers[ndx].cpu);
+      print_metric_value(f, method, copy[ndx].max_spike);
+      fprintf(f, "\n");
+   }
+   fprintf(f, "# TYPE hptt_overhead_%s counter\n# UNIT hptt_overhead_%s %s\n# HELP hptt_overhead_%s Time spent recording spikes instead of sampling.\n", unit, unit, unit, unit);
+   for (ndx=0; ndx<e->sampler_count; ndx++) {
+      fprintf(f, "hptt_overhead_%s_total{cpu=\"%d\"} ", unit, e->samplers[ndx].cpu);
+      print_metric_value(f, method, copy[ndx].overhead);
+      fprintf(f, "\n");
+   }
+   if (options[SMI_SPIKES_OPTION]==1) {
+      fprintf(f, "# TYPE hptt_smi_spikes counter\n# HELP hptt_smi_spikes Spikes that had an SMI since the previous spike.\n");
+      for (ndx=0; ndx<e->sampler_count; ndx++) fprintf(f, "hptt_smi_spikes_total{cpu=\"%d\"} %lu\n", e->samplers[ndx].cpu, copy[ndx].smi_spikes);
+   }
+/* msr_read() is only used here while the samplers run, so its descriptor cache needs no lock */
+   if ((options[SMI_OPTION]==1) && (msr_read(MSR_SMI_COUNT, &SMI_count, 0L) >= 0))
+      fprintf(f, "# TYPE hptt_smi counter\n# HELP hptt_smi MSR_SMI_COUNT of the CPU the exporter runs on.\nhptt_smi_total %lu\n", SMI_count);
+/* Only the buckets up to the highest one in use, and only those that add something; "le" is inclusive,
+   so a bucket's bound is its highest value
+*/
+   if (e->samplers[0].hist != NULL) {
+      fprintf(f, "# TYPE hptt_latency_%s histogram\n# UNIT hptt_latency_%s %s\n# HELP hptt_latency_%s Every iteration's time.\n", unit, unit, unit, unit);
+      for (ndx=0; ndx<e->sampler_count; ndx++) {
+         histogram_struct *hist=&copy[ndx].hist;
+         for (top=HIST_BUCKETS; (top > 0) && (hist->count[top-1] == 0); top--) ;
+         for (running=0L, bucket=0; bucket<top; bucket++) {
+            if (hist->count[bucket] == 0) continue;
+            running+=hist->count[bucket];
+            fprintf(f, "hptt_latency_%s_bucket{cpu=\"%d\",le=\"", unit, e->samplers[ndx].cpu);
+            print_metric_value(f, method, hist_high(bucket));
+            fprintf(f, "\"} %lu\n", running);
+         }
+         fprintf(f, "hptt_latency_%s_bucket{cpu=\"%d\",le=\"+Inf\"} %lu\n", unit, e->samplers[ndx].cpu, running);
+         fprintf(f, "hptt_latency_%s_count{cpu=\"%d\"} %lu\n", unit, e->samplers[ndx].cpu, running);
+      }
+   }
+   fprintf(f, "# EOF\n");
+}
+
+/* One scrape: whatever the request was, the answer is the whole exposition */
+static void serve_scrape(exporter_struct *e, int fd, sampler_metrics_struct *copy) {
+   char request[1024], *body=NULL, header[256];
+   size_t body_size=0;
+   FILE *f;
+   struct pollfd pfd = { fd, POLLIN, 0 };
+   if ((poll(&pfd, 1, 1000) > 0) && (recv(fd, request, sizeof(request), 0) < 0)) return;
+   f=open_memstream(&body, &body_size);
+   if (f == NULL) return;
+   print_metrics(f, e, copy);
+   fclose(f);
+   snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\nContent-Length: %zu\r\n\r\n", body_size);
+   if (send(fd, header, strlen(header), MSG_NOSIGNAL) > 0) send(fd, body, body_size, MSG_NOSIGNAL);
+   free(body);
+   e->scrapes++;
+}
+
+static void *exporter_thread(void *arg) {
+   exporter_struct *e=(exporter_struct *)arg;
+   sampler_metrics_struct *copy;
+   struct pollfd pfd = { e->fd, POLLIN, 0 };
+   int fd;
+   if (posix_memalign((void **)&copy, CACHE_LINE_SIZE, e->sampler_count*sizeof(sampler_metrics_struct)) != 0) return NULL;
+   while (__atomic_load_n(&e->done, __ATOMIC_ACQUIRE) == 0) {
+      if (poll(&pfd, 1, 100) <= 0) continue;
+      fd=accept(e->fd, NULL, NULL);
+      if (fd < 0) continue;
+      serve_scrape(e, fd, copy);
+      close(fd);
+   }
+   free(copy);
+   return NULL;
+}
+
+/* "address" is a port number on 127.0.0.1 if it is all digits, otherwise the path of a UNIX socket */
+static int start_exporter(const char *address, sampler_struct *samplers, int sampler_count, cpu_set_t *avoid) {
+   pthread_attr_t attr;
+   struct sched_param exporter_sp = { 0 };
+   cpu_set_t exporter_cpus;
+   struct stat st;
+   int rv, cpu, one=1;
+   char *endptr;
+   unsigned long port=strtoul(address, &endptr, 10);
+   exporter.samplers=samplers;
+   exporter.sampler_count=sampler_count;
+   exporter.done=0;
+   exporter.path=NULL;
+   if ((*address != '\0') && (*endptr == '\0')) {
+      struct sockaddr_in sin;
+      if ((port == 0) || (port > 65535)) {
+         fprintf (stderr, "illegal port %s for --metrics\n", address);
+         return -1;
+      }
+      memset(&sin, 0, sizeof(sin));
+      sin.sin_family=AF_INET;
+      sin.sin_port=htons((unsigned short)port);
+      sin.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+      exporter.fd=socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+      if (exporter.fd >= 0) setsockopt(exporter.fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+      if ((exporter.fd < 0) || (bind(exporter.fd, (struct sockaddr *)&sin, sizeof(sin)) != 0)) {
+         fprintf (stderr, "unable to bind 127.0.0.1:%lu for --metrics: %s\n", port, strerror(errno));
+         return -1;
+      }
+   } else {
+      struct sockaddr_un sun;
+      if (strlen(address) >= sizeof(sun.sun_path)) {
+         fprintf (stderr, "--metrics socket path %s is too long\n", address);
+         return -1;
+      }
+      memset(&sun, 0, sizeof(sun));
+      sun.sun_family=AF_UNIX;
+      strcpy(sun.sun_path, address);
+/* A socket left behind by an earlier run is replaced; anything else at that path is not */
+      if ((stat(address, &st) == 0) && S_ISSOCK(st.st_mode)) unlink(address);
+      exporter.fd=socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+      if ((exporter.fd < 0) || (bind(exporter.fd, (struct sockaddr *)&sun, sizeof(sun)) != 0)) {
+         fprintf (stderr, "unable to bind %s for --metrics: %s\n", address, strerror(errno));
+         return -1;
+      }
+      exporter.path=address;
+   }
+   if (listen(exporter.fd, 8) != 0) {
+      fprintf (stderr, "unable to listen for --metrics: %s\n", strerror(errno));
+      return -1;
+   }
+   pthread_attr_init(&attr);
+   sched_getaffinity(0, sizeof(exporter_cpus), &exporter_cpus);
+   for (cpu=0; cpu<CPU_SETSIZE; cpu++) if (CPU_ISSET(cpu, avoid)) CPU_CLR(cpu, &exporter_cpus);
+   if (CPU_COUNT(&exporter_cpus) > 0) pthread_attr_setaffinity_np(&attr, sizeof(exporter_cpus), &exporter_cpus);
+   else if (chatty >= 1) printf ("%severy CPU runs a sampler; the metrics exporter shares them%s\n", XML_head, XML_tail);
+   pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+   pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+   pthread_attr_setschedparam(&attr, &exporter_sp);
+   rv = pthread_create(&exporter.thread, &attr, exporter_thread, &exporter);
+   pthread_attr_destroy(&attr);
+   if (chatty >= 2) printf ("%spthread_create() for the metrics exporter: %d%s\n", XML_head, rv, XML_tail);
+   if (rv != 0) {
+      fprintf (stderr, "unable to start the metrics exporter: %s\n", strerror(rv));
+      return -1;
+   }
+   return 0;
+}
+
+static void stop_exporter(void) {
+   __atomic_store_n(&exporter.done, 1, __ATOMIC_RELEASE);
+   pthread_join(exporter.thread, NULL);
+   close(exporter.fd);
+   if (exporter.path != NULL) unlink(exporter.path);
+}
+
+/* One measurement: the writer (if any) is started, the samplers run to their loopcount, and everything they
+   found is printed by the time this returns.
+*/
+static void run_samplers(sampler_struct *samplers, int sampler_count, int use_cpus, int use_writer, int requested_policy, int requested_priority) {
+   int ndx, rv;
+
+   if ( use_writer == 1 ) {
+/* The writer is ordinary housekeeping work, so it gets SCHED_OTHER on its own CPU.  It starts over for each
+   run, since every run's elapsed times start from 0.
+*/
+      pthread_attr_t attr;
+      struct sched_param writer_sp = { 0 };
+      cpu_set_t writer_cpu;
+      writer.done=0;
+      for (ndx=0; ndx<sampler_count; ndx++) samplers[ndx].ring->last_printed=0L;
+      pthread_attr_init(&attr);
+      CPU_ZERO(&writer_cpu);
+      CPU_SET(writer.cpu, &writer_cpu);
+      pthread_attr_setaffinity_np(&attr, sizeof(writer_cpu), &writer_cpu);
+      pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+      pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+      pthread_attr_setschedparam(&attr, &writer_sp);
+      rv = pthread_create(&writer.thread, &attr, writer_thread, &writer);
+      pthread_attr_destroy(&attr);
+      if (chatty >= 2) printf ("%spthread_create() for the writer on CPU %d: %d%s\n", XML_head, writer.cpu, rv, XML_tail);
+      if (rv != 0) {
+         fprintf (stderr, "unable to start the writer on CPU %d: %s\n", writer.cpu, strerror(rv));
+         exit (1);
+      }
+   }
+
+   if ( samplers[0].windows != NULL ) {
+/* The reporter is housekeeping like the writer: SCHED_OTHER, and on the writer's CPU when there is one */
+      pthread_attr_t attr;
+      struct sched_param reporter_sp = { 0 };
+      cpu_set_t reporter_cpu;
+      for (ndx=0; ndx<sampler_count; ndx++) {
+         memset(samplers[ndx].windows, 0, sizeof(window_ring_struct));
+         memset(samplers[ndx].pm_qos_stats, 0, sizeof(samplers[ndx].pm_qos_stats));
+      }
+      memset(pm_qos.energy_uj, 0, sizeof(pm_qos.energy_uj));
+      memset(pm_qos.energy_nsec, 0, sizeof(pm_qos.energy_nsec));
+      reporter.samplers=samplers;
+      reporter.sampler_count=sampler_count;
+      reporter.done=0;
+      pthread_attr_init(&attr);
+      if ( use_writer == 1 ) {
+         CPU_ZERO(&reporter_cpu);
+         CPU_SET(writer.cpu, &reporter_cpu);
+         pthread_attr_setaffinity_np(&attr, sizeof(reporter_cpu), &reporter_cpu);
+      }
+      pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+      pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+      pthread_attr_setschedparam(&attr, &reporter_sp);
+      rv = pthread_create(&reporter.thread, &attr, reporter_thread, &reporter);
+      pthread_attr_destroy(&attr);
+      if (chatty >= 2) printf ("%spthread_create() for the interval reporter: %d%s\n", XML_head, rv, XML_tail);
+      if (rv != 0) {
+         fprintf (stderr, "unable to start the interval reporter: %s\n", strerror(rv));
+         exit (1);
+      }
+   }
+
+   if ( use_cpus == 0 ) {
+/* A lone sampler pinned with --cpu is pinned here, after the helper threads have inherited main()'s affinity */
+      if ( samplers[0].cpu >= 0 ) {
+         cpu_set_t one_cpu;
+         CPU_ZERO(&one_cpu);
+         CPU_SET(samplers[0].cpu, &one_cpu);
+         if (sched_setaffinity(0, sizeof(one_cpu), &one_cpu) != 0) {
+            fprintf (stderr, "unable to pin the sampler to CPU %d: %s\n", samplers[0].cpu, strerror(errno));
+            exit (1);
+         }
+      }
+      run_sampler(samplers);
+   } else {
+/* One sampler thread per requested CPU, each pinned and scheduled with the policy and priority chosen above.
+   They warm up on their own and then wait for each other at the start barrier, so all of them measure the same window.
+*/
+      pthread_attr_t attr;
+      struct sched_param thread_sp = { requested_priority };
+      cpu_set_t one_cpu;
+      print_spike_header(0);
+      for (ndx=0; ndx<sampler_count; ndx++) {
+         pthread_attr_init(&attr);
+         CPU_ZERO(&one_cpu);
+         CPU_SET(samplers[ndx].cpu, &one_cpu);
+         pthread_attr_setaffinity_np(&attr, sizeof(one_cpu), &one_cpu);
+         pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+         pthread_attr_setschedpolicy(&attr, requested_policy);
+         pthread_attr_setschedparam(&attr, &thread_sp);
+         rv = pthread_create(&samplers[ndx].thread, &attr, sampler_thread, &samplers[ndx]);
+         if (rv == EPERM) {
+            if (chatty >= 1) printf ("%snot permitted to use %s for the sampler on CPU %d; it inherits the current policy%s\n", XML_head, scheduler_string(requested_policy), samplers[ndx].cpu, XML_tail);
+            pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+            rv = pthread_create(&samplers[ndx].thread, &attr, sampler_thread, &samplers[ndx]);
+         }
+         pthread_attr_destroy(&attr);
+         if (chatty >= 2) printf ("%spthread_create() for CPU %d: %d%s\n", XML_head, samplers[ndx].cpu, rv, XML_tail);
+         if (rv != 0) {
+            fprintf (stderr, "unable to start the sampler on CPU %d: %s\n", samplers[ndx].cpu, strerror(rv));
+            exit (1);
+         }
+      }
+      fflush( stdout );
+/* The first wait releases once every sampler is warm; the second once run_epoch is set */
+      pthread_barrier_wait(samplers[0].start_barrier);
+      tt_gettime(&run_epoch);
+      pthread_barrier_wait(samplers[0].start_barrier);
+      for (ndx=0; ndx<sampler_count; ndx++) pthread_join(samplers[ndx].thread, NULL);
+      print_merged_spikes(samplers, sampler_count);
+   }
+   if ( samplers[0].windows != NULL ) {
+      __atomic_store_n(&reporter.done, 1, __ATOMIC_RELEASE);
+      pthread_join(reporter.thread, NULL);
+   }
+   if ( use_writer == 1 ) {
+      __atomic_store_n(&writer.done, 1, __ATOMIC_RELEASE);
+      pthread_join(writer.thread, NULL);
+   }
+}
+
+/* "--matrix FILE": run each configuration in FILE "--repeat" times and compare the results with a baseline.
+
+   Each line of FILE is "name: options", where the options are any of this program's; a line named "all"
+   gives options that every configuration starts with, and '#' starts a comment.  Every run is a fresh
+   child process started with the "all" options, the configuration's options and "-f csv -o histogram -v1",
+   so each one goes through the same warm-up pass and starts from the same state; the runs go round-robin
+   through the configurations, so a slow drift of the machine is spread over all of them.  From each run's
+   CSV come its own count of spikes (summed over the samplers, and without the CPU migrations) and the
+   histogram's percentiles and maximum (the worst of the samplers when there are several).
+
+   "--save-baseline FILE" writes every run's results, with the host, kernel, BIOS and tuned profile they were
+   measured on.  "--baseline FILE" compares the runs with a saved baseline: for each configuration and
+   metric, a two-sided Mann-Whitney U test of the runs against the baseline's runs, and a regression when
+   the median got more than MATRIX_TOLERANCE worse with p below MATRIX_ALPHA.  The exit status is 2 if
+   anything regressed, so a kernel, BIOS or tuned-profile rollout can be gated on it; a configuration (or
+   the "all" line) whose options differ from the baseline's is refused, since its results do not compare.
+*/
+#define MATRIX_CONFIGS     64
+#define MATRIX_ARGS        64
+#define MATRIX_MAX_REPEAT  50
+#define MATRIX_TOLERANCE   0.10
+#define MATRIX_ALPHA       0.05
+#define MATRIX_SPIKES      0
+#define MATRIX_METRICS     6
+static const char *matrix_metrics[MATRIX_METRICS]={"spikes", "p50", "p99", "p99.9", "p99.99", "maximum"};
+
+typedef struct matrix_config {
+   char name[64];
+   char options[512];                  /* as written in the matrix file, for the baseline */
+   int argc;
+   char *argv[MATRIX_ARGS];
+   char unit[16];
+   int runs;
+   int failures;
+   double results[MATRIX_METRICS][MATRIX_MAX_REPEAT];
+   int baseline_runs[MATRIX_METRICS];
+   double baseline[MATRIX_METRICS][MATRIX_MAX_REPEAT];
+   int in_baseline;                    /* the baseline has a "config" line for it */
+   char baseline_options[512];
+} matrix_config_struct;
+
+typedef struct matrix_host {
+   char host[72];                      /* a utsname field is 65 bytes */
+   char kernel[136];
+   char bios[128];
+   char tuned[128];
+   char date[32];
+} matrix_host_struct;
+
+/* Whitespace-separated words; double quotes keep spaces in one word */
+static int matrix_split(char *line, char **words, int max) {
+   int count=0;
+   char *out;
+   while (*line != '\0') {
+      while (isspace((unsigned char)*line)) line++;
+      if ((*line == '\0') || (*line == '#')) break;
+      if (count >= max-1) return -1;
+      words[count++]=out=line;
+      while ((*line != '\0') && !isspace((unsigned char)*line)) {
+         if (*line == '"') {
+            for (line++; (*line != '\0') && (*line != '"'); ) *out++=*line++;
+            if (*line == '"') line++;
+         } else {
+            *out++=*line++;
+         }
+      }
+      if (*line != '\0') line++;
+      *out='\0';
+   }
+   words[count]=NULL;
+   return count;
+}
+
+static int read_matrix(const char *path, matrix_config_struct *configs, matrix_config_struct *all) {
+   FILE *f=fopen(path, "r");
+   char line[1024], *colon, *name, *options;
+   int count=0, number=0, words;
+   matrix_config_struct *c;
+   if (f == NULL) {
+      fprintf (stderr, "unable to open the matrix \"%s\": %s\n", path, strerror(errno));
+      return -1;
+   }
+   while (fgets(line, sizeof(line), f) != NULL) {
+      number++;
+      line[strcspn(line, "\r\n")]='\0';
+      for (name=line; isspace((unsigned char)*name); name++) ;
+      if ((*name == '\0') || (*name == '#')) continue;
+      colon=strchr(name, ':');
+      if (colon == NULL) {
+         fprintf (stderr, "%s line %d: expected \"name: options\"\n", path, number);
+         fclose(f);
+         return -1;
+      }
+      *colon='\0';
+      while ((colon > name) && isspace((unsigned char)colon[-1])) *--colon='\0';
+      for (options=colon+1; isspace((unsigned char)*options); options++) ;
+      if ((strlen(name) >= sizeof(c->name)) || (strlen(options) >= sizeof(c->options))) {
+         fprintf (stderr, "%s line %d: name or options too long\n", path, number);
+         fclose(f);
+         return -1;
+      }
+      if (strcmp(name, "all") == 0) {
+         c=all;
+      } else if (count >= MATRIX_CONFIGS) {
+         fprintf (stderr, "%s line %d: more than %d configurations\n", path, number, MATRIX_CONFIGS);
+         fclose(f);
+         return -1;
+      } else {
+         c=&configs[count++];
+      }
+      strcpy(c->name, name);
+      strcpy(c->options, options);
+      words=matrix_split(strdup(options), c->argv, MATRIX_ARGS);
+      if (words < 0) {
+         fprintf (stderr, "%s line %d: too many options\n", path, number);
+         fclose(f);
+         return -1;
+      }
+      c->argc=words;
+   }
+   fclose(f);
+   if (count == 0) fprintf (stderr, "no configurations in the matrix \"%s\"\n", path);
+   return count;
+}
+
+/* One run of one configuration in a child process; its CSV is read from a pipe as it comes */
+static int matrix_run(const char *exe, matrix_config_struct *all, matrix_config_struct *c, double *results) {
+   static char *forced[]={"-f", "csv", "-o", "histogram", "-v1"};
+   char *argv[2*MATRIX_ARGS+8], line[1024], *field;
+   int argc=0, ndx, fd[2], status, in_summary=0, metric, seen=0;
+   unsigned long value;
+   pid_t pid;
+   FILE *output;
+   argv[argc++]=(char *)exe;
+   for (ndx=0; ndx<all->argc; ndx++) argv[argc++]=all->argv[ndx];
+   for (ndx=0; ndx<c->argc; ndx++) argv[argc++]=c->argv[ndx];
+   for (ndx=0; ndx<(int)(sizeof(forced)/sizeof(forced[0])); ndx++) argv[argc++]=forced[ndx];
+   argv[argc]=NULL;
+   if (pipe(fd) != 0) return -1;
+   fflush(stdout);
+   pid=fork();
+   if (pid < 0) return -1;
+   if (pid == 0) {
+      dup2(fd[1], STDOUT_FILENO);
+      close(fd[0]);
+      close(fd[1]);
+      execv(exe, argv);
+      fprintf (stderr, "unable to run %s: %s\n", exe, strerror(errno));
+      _exit (127);
+   }
+   close(fd[1]);
+   for (metric=0; metric<MATRIX_METRICS; metric++) results[metric]=0.0;
+   output=fdopen(fd[0], "r");
+   while ((output != NULL) && (fgets(line, sizeof(line), output) != NULL)) {
+/* The spike count comes from the run's own summary, which leaves out the migrations: a "Spikes" line,
+   or with "--cpus" the lines after the per-CPU summary header
+*/
+      if (strncmp(line, "Spikes,", 7) == 0) {
+         results[MATRIX_SPIKES]=(double)strtoul(line+7, NULL, 10);
+         continue;
+      }
+      if (strncmp(line, "CPU,spikes,", 11) == 0) {
+         in_summary=1;
+         results[MATRIX_SPIKES]=0.0;
+         continue;
+      }
+      if (in_summary) {
+         for (field=line; isdigit((unsigned char)*field); field++) ;
+         if ((field != line) && (*field == ',') && isdigit((unsigned char)field[1])) {
+            results[MATRIX_SPIKES]+=(double)strtoul(field+1, NULL, 10);
+            continue;
+         }
+         in_summary=0;
+      }
+      if (strncmp(line, "percentile,latency (", 20) == 0) {
+         snprintf(c->unit, sizeof(c->unit), "%.*s", (int)strcspn(line+20, ")"), line+20);
+      } else if (strncmp(line, "CPU,percentile,latency (", 24) == 0) {
+         snprintf(c->unit, sizeof(c->unit), "%.*s", (int)strcspn(line+24, ")"), line+24);
+      }
+/* With "--cpus" the histogram lines start with the CPU */
+      field=line;
+      if (isdigit((unsigned char)*field)) {
+         while (isdigit((unsigned char)*field)) field++;
+         if (*field++ != ',') continue;
+      }
+      if (strncmp(field, "iterations,", 11) == 0) seen=1;
+      for (metric=MATRIX_SPIKES+1; metric<MATRIX_METRICS; metric++) {
+         size_t len=strlen(matrix_metrics[metric]);
+         if ((strncmp(field, matrix_metrics[metric], len) == 0) && (field[len] == ',')) {
+            value=strtoul(field+len+1, NULL, 10);
+            if ((double)value > results[metric]) results[metric]=(double)value;
+         }
+      }
+   }
+   if (output != NULL) fclose(output);
+   else close(fd[0]);
+   if ((waitpid(pid, &status, 0) < 0) || !WIFEXITED(status) || (WEXITSTATUS(status) != 0) || (seen == 0)) return -1;
+   return 0;
+}
+
+static void matrix_host_info(matrix_host_struct *h) {
+   struct utsname u;
+   memset(h, 0, sizeof(matrix_host_struct));
+   if (uname(&u) == 0) {
+      snprintf(h->host, sizeof(h->host), "%s", u.nodename);
+      snprintf(h->kernel, sizeof(h->kernel), "%s %s", u.release, u.version);
+   }
+   read_sysfs_line("/sys/class/dmi/id/bios_version", h->bios, sizeof(h->bios));
+   read_sysfs_line("/etc/tuned/active_profile", h->tuned, sizeof(h->tuned));
+   snprintf(h->date, sizeof(h->date), "%lu", (unsigned long)time(NULL));
+}
+
+/* The baseline is a tab-separated text file: "host", "kernel", "bios", "tuned" and "date" lines, a "config"
+   line with the "all" options and each configuration's options, and a "result" line with every run of each metric
+*/
+static int save_baseline(const char *path, matrix_host_struct *h, matrix_config_struct *all, matrix_config_struct *configs, int count) {
+   FILE *f=fopen(path, "w");
+   int this, metric, run;
+   if (f == NULL) {
+      fprintf (stderr, "unable to create the baseline \"%s\": %s\n", path, strerror(errno));
+      return -1;
+   }
+   fprintf(f, "# HP-TimeTest %d.%d matrix baseline\n", Version.major, Version.minor);
+   fprintf(f, "host\t%s\nkernel\t%s\nbios\t%s\ntuned\t%s\ndate\t%s\n", h->host, h->kernel, h->bios, h->tuned, h->date);
+   fprintf(f, "config\tall\t%s\n", all->options);
+   for (this=0; this<count; this++) {
+      matrix_config_struct *c=&configs[this];
+      fprintf(f, "config\t%s\t%s\n", c->name, c->options);
+      for (metric=0; metric<MATRIX_METRICS; metric++) {
+         fprintf(f, "result\t%s\t%s\t%s\t", c->name, matrix_metrics[metric], (metric == MATRIX_SPIKES) ? "spikes" : c->unit);
+         for (run=0; run<c->runs; run++) fprintf(f, "%s%.0f", (run > 0) ? " " : "", c->results[metric][run]);
+         fprintf(f, "\n");
+      }
+   }
+   if (fclose(f) != 0) {
+      fprintf (stderr, "unable to write the baseline \"%s\": %s\n", path, strerror(errno));
+      return -1;
+   }
+   return 0;
+}
+
+static int load_baseline(const char *path, matrix_host_struct *h, matrix_config_struct *all, matrix_config_struct *configs, int count) {
+   FILE *f=fopen(path, "r");
+   char line[4096], *words[MATRIX_MAX_REPEAT+8], *value, *next;
+   int this, metric, fields;
+   if (f == NULL) {
+      fprintf (stderr, "unable to open the baseline \"%s\": %s\n", path, strerror(errno));
+      return -1;
+   }
+   memset(h, 0, sizeof(matrix_host_struct));
+   while (fgets(line, sizeof(line), f) != NULL) {
+      line[strcspn(line, "\r\n")]='\0';
+      if (line[0] == '#') continue;
+      for (fields=0, next=line; (fields < 5) && ((value=strsep(&next, "\t")) != NULL); ) words[fields++]=value;
+      if (fields < 2) continue;
+      if (strcmp(words[0], "host") == 0) snprintf(h->host, sizeof(h->host), "%s", words[1]);
+      else if (strcmp(words[0], "kernel") == 0) snprintf(h->kernel, sizeof(h->kernel), "%s", words[1]);
+      else if (strcmp(words[0], "bios") == 0) snprintf(h->bios, sizeof(h->bios), "%s", words[1]);
+      else if (strcmp(words[0], "tuned") == 0) snprintf(h->tuned, sizeof(h->tuned), "%s", words[1]);
+      else if (strcmp(words[0], "date") == 0) snprintf(h->date, sizeof(h->date), "%s", words[1]);
+      if ((strcmp(words[0], "config") == 0) && (fields >= 3)) {
+         matrix_config_struct *c=all;
+         if (strcmp(words[1], "all") != 0) {
+            for (this=0; (this<count) && (strcmp(configs[this].name, words[1]) != 0); this++) ;
+            c=(this < count) ? &configs[this] : NULL;
+         }
+         if (c != NULL) {
+            c->in_baseline=1;
+            snprintf(c->baseline_options, sizeof(c->baseline_options), "%s", words[2]);
+         }
+         continue;
+      }
+      if ((strcmp(words[0], "result") != 0) || (fields < 5)) continue;
+      for (this=0; (this<count) && (strcmp(configs[this].name, words[1]) != 0); this++) ;
+      for (metric=0; (metric<MATRIX_METRICS) && (strcmp(matrix_metrics[metric], words[2]) != 0); metric++) ;
+      if ((this == count) || (metric == MATRIX_METRICS)) continue;
+      configs[this].baseline_runs[metric]=0;
+      for (next=words[4]; (value=strsep(&next, " ")) != NULL; ) {
+         if ((*value != '\0') && (configs[this].baseline_runs[metric] < MATRIX_MAX_REPEAT))
+            configs[this].baseline[metric][configs[this].baseline_runs[metric]++]=strtod(value, NULL);
+      }
+   }
+   fclose(f);
+   return 0;
+}
+
+/* Results run with other options than the baseline's are not comparable; the "all" line is checked too */
+static int matrix_options_differ(matrix_config_struct *all, matrix_config_struct *configs, int count) {
+   int this, differ=0;
+   if (all->in_baseline && (strcmp(all->options, all->baseline_options) != 0)) {
+      fprintf (stderr, "the \"all\" options differ from the baseline's: \"%s\" here, \"%s\" in the baseline\n", all->options, all->baseline_options);
+      differ=1;
+   }
+   for (this=0; this<count; this++) {
+      matrix_config_struct *c=&configs[this];
+      if (c->in_baseline && (strcmp(c->options, c->baseline_options) != 0)) {
+         fprintf (stderr, "configuration \"%s\" differs from the baseline's: \"%s\" here, \"%s\" in the baseline\n", c->name, c->options, c->baseline_options);
+         differ=1;
+      }
+   }
+   if (differ) fprintf (stderr, "not comparing with a baseline run with other options; save a new baseline instead\n");
+   return differ;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+   double x=*(const double *)a, y=*(const double *)b;
+   return (x < y) ? -1 : (x > y);
+}
+
+static double matrix_median(const double *values, int count) {
+   double sorted[MATRIX_MAX_REPEAT];
+   if (count == 0) return 0.0;
+   memcpy(sorted, values, count*sizeof(double));
+   qsort(sorted, count, sizeof(double), compare_doubles);
+   return (count%2 == 1) ? sorted[count/2] : (sorted[count/2-1]+sorted[count/2])/2.0;
+}
+
+/* Two-sided p-value of the Mann-Whitney U test.  Ties count a half each way.  Up to MATRIX_MAX_REPEAT runs
+   a side the exact null distribution is counted out (as if there were no ties); the normal approximation,
+   with the tie correction, is only used if it can't be.
+*/
+static double mann_whitney(const double *a, int na, const double *b, int nb) {
+   double u=0.0, below=0.0, above=0.0, total=0.0, *counts, mean, variance, z, ties=0.0;
+   double all[2*MATRIX_MAX_REPEAT];
+   int i, j, n, k, umax=na*nb, run;
+   for (i=0; i<na; i++)
+      for (j=0; j<nb; j++) u+=(a[i] > b[j]) ? 1.0 : ((a[i] == b[j]) ? 0.5 : 0.0);
+/* counts[n][k]: the ways n of the first sample and k of the second can be arranged, by U */
+   counts=(double *)calloc((size_t)(na+1)*(nb+1)*(umax+1), sizeof(double));
+   if (counts != NULL) {
+#define COUNT(n, k, v) counts[((size_t)(n)*(nb+1)+(k))*(umax+1)+(v)]
+      for (n=0; n<=na; n++) {
+         for (k=0; k<=nb; k++) {
+            if ((n == 0) || (k == 0)) {
+               COUNT(n, k, 0)=1.0;
+               continue;
+            }
+            for (j=0; j<=n*k; j++) COUNT(n, k, j)=((j >= k) ? COUNT(n-1, k, j-k) : 0.0)+COUNT(n, k-1, j);
+         }
+      }
+      for (j=0; j<=umax; j++) {
+         total+=COUNT(na, nb, j);
+         if ((double)j <= u) below+=COUNT(na, nb, j);
+         if ((double)j >= u) above+=COUNT(na, nb, j);
       }
+#undef COUNT
+      free(counts);
+      return (2.0*((below < above) ? below : above)/total > 1.0) ? 1.0 : 2.0*((below < above) ? below : above)/total;
    }
-   this_core = get_my_cpu();
-/* sched_getcpu is not available on RHEL 5 variants
-   this_core = sched_getcpu();
-*/
-   if (this_core<0) {
-      perror("unable to determine current core\n");
-      options[SMI_OPTION]=0;
-      return -1;
+   memcpy(all, a, na*sizeof(double));
+   memcpy(all+na, b, nb*sizeof(double));
+   qsort(all, na+nb, sizeof(double), compare_doubles);
+   for (i=0; i<na+nb; i=j) {
+      for (j=i+1; (j < na+nb) && (all[j] == all[i]); j++) ;
+      run=j-i;
+      ties+=(double)run*run*run-run;
    }
-   if ((*msr_fd_ptr)[this_core] == 0) {
-      char msr_path[64];
-      sprintf(msr_path, "/dev/cpu/%u/msr", this_core);
-      (*msr_fd_ptr)[this_core]=open(msr_path, O_RDONLY);
-      if ((*msr_fd_ptr)[this_core]<0) {
-         perror("unable to access /dev/cpu/<this core>/msr; perhaps the module is not loaded (try insmod msr)");
-         options[SMI_OPTION]=0;
-         return -1;
+   mean=na*nb/2.0;
+   variance=na*nb/12.0*((na+nb+1)-ties/((double)(na+nb)*(na+nb-1)));
+   if (variance <= 0.0) return 1.0;
+   z=(fabs(u-mean)-0.5)/sqrt(variance);
+   return (z <= 0.0) ? 1.0 : erfc(z/sqrt(2.0));
+}
+
+static void print_matrix_host(const char *name, matrix_host_struct *h) {
+   if (format == CSV_FORMAT) printf("%s,%s,%s,%s,%s\n", name, h->host, h->kernel, h->bios, h->tuned);
+   else if (format == XML_FORMAT) printf("      <%s><host>%s</host><kernel>%s</kernel><bios>%s</bios><tuned>%s</tuned></%s>\n", name, h->host, h->kernel, h->bios, h->tuned, name);
+   else printf("%-9s host %s, kernel %s, BIOS %s, tuned profile %s\n", name, h->host, h->kernel, h->bios, h->tuned);
+}
+
+static int run_matrix(const char *path, int repeat, const char *baseline_path, const char *save_path) {
+   static matrix_config_struct configs[MATRIX_CONFIGS], all;
+   matrix_host_struct now, then;
+   char exe[PATH_MAX];
+   double results[MATRIX_METRICS], median, base, change, p;
+   int count, this, run, metric, regressions=0, compare=0;
+   ssize_t len;
+   count=read_matrix(path, configs, &all);
+   if (count <= 0) return 1;
+   if (repeat > MATRIX_MAX_REPEAT) repeat=MATRIX_MAX_REPEAT;
+   len=readlink("/proc/self/exe", exe, sizeof(exe)-1);
+   if (len <= 0) {
+      fprintf (stderr, "unable to find this program's executable: %s\n", strerror(errno));
+      return 1;
+   }
+   exe[len]='\0';
+   matrix_host_info(&now);
+   if (baseline_path != NULL) {
+      if (load_baseline(baseline_path, &then, &all, configs, count) != 0) return 1;
+      if (matrix_options_differ(&all, configs, count) != 0) return 1;
+      compare=1;
+   }
+   if (chatty >= 2) printf ("%s%d configurations, %d runs each%s\n", XML_head, count, repeat, XML_tail);
+   for (run=0; run<repeat; run++) {
+      for (this=0; this<count; this++) {
+         matrix_config_struct *c=&configs[this];
+         if (matrix_run(exe, &all, c, results) != 0) {
+            c->failures++;
+            if (chatty >= 1) printf ("%srun %d of \"%s\" failed or printed no histogram%s\n", XML_head, run+1, c->name, XML_tail);
+            continue;
+         }
+         for (metric=0; metric<MATRIX_METRICS; metric++) c->results[metric][c->runs]=results[metric];
+         c->runs++;
+         if (chatty >= 2) printf ("%srun %d of \"%s\": %.0f spikes, p99 %.0f, p99.99 %.0f, maximum %.0f %s%s\n", XML_head, run+1, c->name,
+                                  results[MATRIX_SPIKES], results[2], results[4], results[5], c->unit, XML_tail);
       }
    }
-   offset = lseek((*msr_fd_ptr)[this_core], MSR, SEEK_SET);
-   if (offset == -1) {
-      perror("unable to access /dev/cpu/<this core>/msr\n");
-      close((*msr_fd_ptr)[this_core]);
-      options[SMI_OPTION]=0;
-      return -1;
+
+   if (format == XML_FORMAT) printf("   <matrix>\n");
+   print_matrix_host("measured", &now);
+   if (compare) print_matrix_host("baseline", &then);
+   if (format == CSV_FORMAT) printf("configuration,metric,unit,runs,median,minimum,maximum%s\n", compare ? ",baseline runs,baseline median,change (%),p,verdict" : "");
+   else if (format == FREEFORM_FORMAT) printf("%-16s %-8s %-6s %4s %14s %14s%s\n", "configuration", "metric", "unit", "runs", "median", "range",
+                                             compare ? "       baseline   change        p  verdict" : "");
+   for (this=0; this<count; this++) {
+      matrix_config_struct *c=&configs[this];
+      if (c->runs == 0) {
+/* A configuration that no longer runs at all is the worst regression there is */
+         if (compare) regressions++;
+         if (format == CSV_FORMAT) printf("%s,,,0,,,%s\n", c->name, compare ? ",,,,,failed" : "");
+         else if (format == XML_FORMAT) printf("      <configuration><name>%s</name><runs>0</runs></configuration>\n", c->name);
+         else printf("%-16s every run failed\n", c->name);
+         continue;
+      }
+      if (format == XML_FORMAT) printf("      <configuration><name>%s</name><options>%s</options><runs>%d</runs>\n", c->name, c->options, c->runs);
+      for (metric=0; metric<MATRIX_METRICS; metric++) {
+         const char *unit=(metric == MATRIX_SPIKES) ? "" : c->unit, *verdict="";
+         double lowest=c->results[metric][0], highest=c->results[metric][0];
+         for (run=1; run<c->runs; run++) {
+            if (c->results[metric][run] < lowest) lowest=c->results[metric][run];
+            if (c->results[metric][run] > highest) highest=c->results[metric][run];
+         }
+         median=matrix_median(c->results[metric], c->runs);
+         base=change=0.0;
+         p=1.0;
+         if (compare) {
+            if (c->baseline_runs[metric] == 0) {
+               verdict="new";
+            } else {
+               base=matrix_median(c->baseline[metric], c->baseline_runs[metric]);
+               change=(base > 0.0) ? (median-base)/base : ((median > 0.0) ? 1.0 : 0.0);
+               p=mann_whitney(c->results[metric], c->runs, c->baseline[metric], c->baseline_runs[metric]);
+               if ((p < MATRIX_ALPHA) && (change > MATRIX_TOLERANCE)) {
+                  verdict="REGRESSION";
+                  regressions++;
+               } else if ((p < MATRIX_ALPHA) && (change < -MATRIX_TOLERANCE)) {
+                  verdict="improved";
+               } else {
+                  verdict="same";
+               }
+            }
+         }
+         if (format == CSV_FORMAT) {
+            printf("%s,%s,%s,%d,%.0f,%.0f,%.0f", c->name, matrix_metrics[metric], unit, c->runs, median, lowest, highest);
+            if (compare) printf(",%d,%.0f,%.1f,%.4f,%s", c->baseline_runs[metric], base, 100.0*change, p, verdict);
+            printf("\n");
+         } else if (format == XML_FORMAT) {
+            printf("         <metric><name>%s</name><unit>%s</unit><median>%.0f</median><minimum>%.0f</minimum><maximum>%.0f</maximum>", matrix_metrics[metric], unit, median, lowest, highest);
+            if (compare) printf("<baseline_runs>%d</baseline_runs><baseline>%.0f</baseline><change>%.3f</change><p>%.4f</p><verdict>%s</verdict>", c->baseline_runs[metric], base, change, p, verdict);
+            printf("</metric>\n");
+         } else {
+            char range[32];
+            snprintf(range, sizeof(range), "%.0f-%.0f", lowest, highest);
+            printf("%-16s %-8s %-6s %4d %14.0f %14s", (metric == 0) ? c->name : "", matrix_metrics[metric], unit, c->runs, median, range);
+            if (compare && (c->baseline_runs[metric] > 0)) printf(" %14.0f %+7.1f%% %8.4f  %s", base, 100.0*change, p, verdict);
+            else if (compare) printf(" %14s %8s %8s  %s", "", "", "", verdict);
+            printf("\n");
+         }
+      }
+      if (format == XML_FORMAT) printf("      </configuration>\n");
    }
-   count=read((*msr_fd_ptr)[this_core], value, 8);
-   if (count != 8) {
-      perror("unable to access /dev/cpu/<this core>/msr\n");
-      close((*msr_fd_ptr)[this_core]);
-      options[SMI_OPTION]=0;
-      return -1;
+   if (compare) {
+      if (format == CSV_FORMAT) printf("Regressions,%d\n", regressions);
+      else if (format == XML_FORMAT) printf("      <regressions>%d</regressions>\n", regressions);
+      else printf("%d regressions (median more than %.0f%% worse with p < %g)\n", regressions, 100.0*MATRIX_TOLERANCE, MATRIX_ALPHA);
    }
-   return count;
+   if (format == XML_FORMAT) printf("   </matrix>\n");
+   fflush(stdout);
+   if ((save_path != NULL) && (save_baseline(save_path, &now, &all, configs, count) != 0)) return 1;
+   return (regressions > 0) ? 2 : 0;
 }
 
 int main (const int argc, const char *const argv[])
@@ -620,11 +4344,6 @@ int main (const int argc, const char *const argv[])
    int priority_limit;
    int current_scheduler;
    unsigned long utempl;
-   unsigned long count, diff, min_spike=ULONG_MAX;
-   struct timeval t0_stamp;
-   struct timeval last_spike_time = {0,0};
-   struct timeval overhead_seconds={0L,0L};
-   unsigned long overhead_cycles=0;
 
    int method=method_default;
    unsigned long threshold=0;
@@ -632,12 +4351,30 @@ int main (const int argc, const char *const argv[])
    int use_threshold_default=1;
    int use_loopcount_default=1;
    int option_index=0;
-   unsigned int spike_ndx=0;
 
-   unsigned long save_loopcount=0L;
-   unsigned long save_threshold=0L;
-   unsigned int save_chatty=0;
-   int warm_up;
+   cpu_set_t sampler_cpus;
+   int use_cpus=0;
+   int pin_cpu=-1;
+   int sampler_count=1;
+   sampler_struct *samplers=&lone_sampler;
+   int use_writer=0;
+   const char *log_path=NULL;
+   pthread_barrier_t start_barrier;
+   int benchmark_kernels_flag=0;
+   int benchmark_clocks_flag=0;
+   int noise_kind=0;
+   cpu_set_t noise_cpus;
+   int noise_count=0;
+   unsigned long noise_mb=64;
+   noise_struct *noise=NULL;
+   run_stats_struct *quiet=NULL;
+   const char *json_path=NULL;
+   int daemon_flag=0;
+   const char *metrics_address=NULL;
+   const char *matrix_path=NULL, *baseline_path=NULL, *save_baseline_path=NULL;
+   int matrix_repeat=5;
+   int audit_flag=0;
+   cpu_set_t pingpong_cpus;
 
    struct option long_options[] = {
       {"method"   , required_argument, NULL, 'm'},
@@ -646,6 +4383,35 @@ int main (const int argc, const char *const argv[])
       {"format",    required_argument, NULL, 'f'},
       {"option",    required_argument, NULL, 'o'},
       {"priority",  required_argument, NULL, 'p'},
+      {"cpus",      required_argument, NULL, 'c'},
+      {"cpu",       required_argument, NULL, 'a'},
+      {"writer",    required_argument, NULL, 'w'},
+      {"clock",     required_argument, NULL, 'k'},
+      {"log",       required_argument, NULL, 'L'},
+      {"hog-isa",   required_argument, NULL, 'H'},
+      {"hog-intensity", required_argument, NULL, 'i'},
+      {"noise",     required_argument, NULL, 'n'},
+      {"noise-cpus", required_argument, NULL, 'N'},
+      {"noise-size", required_argument, NULL, 'z'},
+      {"period",    required_argument, NULL, 'P'},
+      {"chase-size", required_argument, NULL, 's'},
+      {"chase-node", required_argument, NULL, 'd'},
+      {"interval",  required_argument, NULL, 'I'},
+      {"json",      required_argument, NULL, 'J'},
+      {"daemon",    no_argument,       NULL, 'D'},
+      {"output",    required_argument, NULL, 'O'},
+      {"metrics",   required_argument, NULL, 'M'},
+      {"buffer",    required_argument, NULL, 'S'},
+      {"record-only", no_argument,     NULL, 'R'},
+      {"audit",     no_argument,       NULL, 'A'},
+      {"pm-qos",    required_argument, NULL, 'Q'},
+      {"pm-qos-ab", no_argument,       NULL, 'q'},
+      {"matrix",    required_argument, NULL, 'X'},
+      {"repeat",    required_argument, NULL, 'r'},
+      {"baseline",  required_argument, NULL, 'Y'},
+      {"save-baseline", required_argument, NULL, 'y'},
+      {"benchmark-kernels", no_argument, NULL, 'B'},
+      {"benchmark-clocks", no_argument, NULL, 'C'},
       {"Version",   no_argument,       NULL, 'V'},
       {"verbose",   optional_argument, NULL, 'v'},
       {"brief",     no_argument,       NULL, 'b'},
@@ -674,9 +4440,12 @@ int main (const int argc, const char *const argv[])
    -v2 3    is invalid because "3" is not a valid argument to this program
 */
       int opt_optarg=0;
-   while ( (rv=getopt_long (argc, (char *const *)argv, "+m:t:l:f:o:p:Vv::beh?", long_options, &option_index)) != -1 ) {
+   while ( (rv=getopt_long (argc, (char *const *)argv, "+m:t:l:f:o:p:c:a:w:k:L:H:i:n:N:z:P:s:d:I:J:O:M:S:Q:X:r:Y:y:qRADBCVv::beh?", long_options, &option_index)) != -1 ) {
       int rv_cycles;
       int rv_time;
+      int rv_pingpong;
+      int rv_wakeup;
+      int rv_memchase;
       int rv_csv, rv_xml, rv_freeform;
       int matches;
       last_rv=rv;
@@ -687,17 +4456,23 @@ int main (const int argc, const char *const argv[])
          case 'm':
             rv_cycles = compare_parameters(optarg, "cycles");
             rv_time = compare_parameters(optarg, "time");
-            if ( (rv_cycles>0) && (rv_time>0) ) {
+            rv_pingpong = compare_parameters(optarg, "pingpong");
+            rv_wakeup = compare_parameters(optarg, "wakeup");
+            rv_memchase = compare_parameters(optarg, "memchase");
+            if ( (rv_cycles>0) + (rv_time>0) + (rv_pingpong>0) + (rv_wakeup>0) + (rv_memchase>0) > 1 ) {
                fprintf (stderr, "ambiguous value for method\n");
                exit (0);
-            } else if ( (rv_cycles<0) && (rv_time<0) ) {
-               fprintf (stderr, "illegal value for method; use \"cycles\" or \"time\"\n");
+            } else if ( (rv_cycles<0) && (rv_time<0) && (rv_pingpong<0) && (rv_wakeup<0) && (rv_memchase<0) ) {
+               fprintf (stderr, "illegal value for method; use \"cycles\", \"time\", \"pingpong\", \"wakeup\" or \"memchase\"\n");
                exit (0);
             } else {
                if (rv_cycles>0) method=CYCLES_METHOD;
                else if (rv_time>0) method=TIME_METHOD;
+               else if (rv_pingpong>0) method=PINGPONG_METHOD;
+               else if (rv_wakeup>0) method=WAKEUP_METHOD;
+               else if (rv_memchase>0) method=MEMCHASE_METHOD;
                else {
-                  fprintf (stderr, "value for method required; use \"cycles\" or \"time\"\n");
+                  fprintf (stderr, "value for method required; use \"cycles\", \"time\", \"pingpong\", \"wakeup\" or \"memchase\"\n");
                   exit (0);
                }
             }
@@ -741,6 +4516,9 @@ int main (const int argc, const char *const argv[])
             if (compare_parameters(optarg, "smi_count") > 0) options[SMI_OPTION]=1;
             if (compare_parameters(optarg, "overhead") > 0) options[OVERHEAD_OPTION]=1;
             if (compare_parameters(optarg, "power_hog") > 0) options[POWER_HOG_OPTION]=1;
+            if (compare_parameters(optarg, "histogram") > 0) options[HISTOGRAM_OPTION]=1;
+            if (compare_parameters(optarg, "smi_spikes") > 0) options[SMI_SPIKES_OPTION]=1;
+            if (compare_parameters(optarg, "perf_counters") > 0) options[PERF_COUNTERS_OPTION]=1;
             break;
          case 'p':
             if ( strlen(optarg) == 0L ) {
@@ -801,6 +4579,209 @@ int main (const int argc, const char *const argv[])
                }
             }
             break;
+         case 'c':
+            rv = parse_cpu_list(optarg, &sampler_cpus);
+            if ( rv <= 0 ) {
+               fprintf (stderr, "illegal value for cpus; specify a list such as \"2-31,34\"\n");
+               exit (0);
+            }
+            use_cpus=1;
+            sampler_count=rv;
+            break;
+         case 'a':
+            {
+               char *endptr;
+               utempl = strtoul(optarg, &endptr, 10);
+               if ( (endptr == optarg) || (*endptr != '\0') || (utempl >= CPU_SETSIZE) ) {
+                  fprintf (stderr, "illegal value for cpu; specify the number of the CPU to pin the sampler to\n");
+                  exit (0);
+               }
+               pin_cpu=(int)utempl;
+            }
+            break;
+         case 'w':
+            {
+               char *endptr;
+               utempl = strtoul(optarg, &endptr, 10);
+               if ( (endptr == optarg) || (*endptr != '\0') || (utempl >= CPU_SETSIZE) ) {
+                  fprintf (stderr, "illegal value for writer; specify the number of a housekeeping CPU\n");
+                  exit (0);
+               }
+               use_writer=1;
+               writer.cpu=(int)utempl;
+            }
+            break;
+         case 'k':
+            if ( parse_timesource(optarg) == 0 ) {
+               fprintf (stderr, "illegal or ambiguous value for clock; use \"gettimeofday\", \"monotonic\", \"monotonic_raw\", \"realtime\", \"tai\" or \"boottime\"\n");
+               exit (0);
+            }
+            break;
+         case 'L':
+            log_path=optarg;
+            break;
+         case 'H':
+            if ( parse_hog_isa(optarg) == 0 ) {
+               fprintf (stderr, "illegal or ambiguous value for hog-isa; use \"auto\", \"sse\", \"avx2\" or \"avx512\"\n");
+               exit (0);
+            }
+            options[POWER_HOG_OPTION]=1;
+            break;
+         case 'i':
+            {
+               char *endptr;
+               utempl = strtoul(optarg, &endptr, 10);
+               if ( (endptr == optarg) || (*endptr != '\0') || (utempl == 0) || (utempl > 1000000) ) {
+                  fprintf (stderr, "illegal value for hog-intensity; specify the number of passes (1 to 1000000) over the kernel's %d FMA chains per iteration\n", HOG_CHAINS);
+                  exit (0);
+               }
+               hog_intensity=(unsigned int)utempl;
+            }
+            options[POWER_HOG_OPTION]=1;
+            break;
+         case 'n':
+            if (compare_parameters(optarg, "mem") > 0) noise_kind=NOISE_MEM;
+            else if (compare_parameters(optarg, "stream") > 0) noise_kind=NOISE_STREAM;
+            else if (compare_parameters(optarg, "chase") > 0) noise_kind=NOISE_CHASE;
+            else {
+               fprintf (stderr, "illegal value for noise; use \"mem\", \"stream\" or \"chase\"\n");
+               exit (0);
+            }
+            break;
+         case 'N':
+            rv = parse_cpu_list(optarg, &noise_cpus);
+            if ( rv <= 0 ) {
+               fprintf (stderr, "illegal value for noise-cpus; specify a list such as \"4-7\"\n");
+               exit (0);
+            }
+            noise_count=rv;
+            break;
+         case 'z':
+            {
+               char *endptr;
+               utempl = strtoul(optarg, &endptr, 10);
+               if ( (endptr == optarg) || (*endptr != '\0') || (utempl == 0) || (utempl > 65536) ) {
+                  fprintf (stderr, "illegal value for noise-size; specify the MB (1 to 65536) each noise thread works over\n");
+                  exit (0);
+               }
+               noise_mb=utempl;
+            }
+            break;
+         case 's':
+            {
+               char *endptr;
+               utempl = strtoul(optarg, &endptr, 10);
+               if ( (endptr == optarg) || (*endptr != '\0') || (utempl == 0) || (utempl > 65536) ) {
+                  fprintf (stderr, "illegal value for chase-size; specify the MB (1 to 65536) each memchase sampler chases through\n");
+                  exit (0);
+               }
+               chase_bytes=utempl<<20;
+            }
+            break;
+         case 'd':
+            {
+               char *endptr, path[64];
+               struct stat node_stat;
+               utempl = strtoul(optarg, &endptr, 10);
+               snprintf(path, sizeof(path), "/sys/devices/system/node/node%lu", utempl);
+               if ( (endptr == optarg) || (*endptr != '\0') || (utempl >= CHASE_MAX_NODES) || (stat(path, &node_stat) != 0) ) {
+                  fprintf (stderr, "illegal value for chase-node; there is no NUMA node %s\n", optarg);
+                  exit (0);
+               }
+               chase_node=(int)utempl;
+            }
+            break;
+         case 'P':
+            {
+               char *endptr;
+               utempl = strtoul(optarg, &endptr, 10);
+               if ( (endptr == optarg) || (*endptr != '\0') || (utempl == 0) || (utempl > 60000000) ) {
+                  fprintf (stderr, "illegal value for period; specify the wakeup period in usecs (1 to 60000000)\n");
+                  exit (0);
+               }
+               wakeup_period=utempl*1000L;
+            }
+            break;
+         case 'I':
+            {
+               char *endptr;
+               double seconds = strtod(optarg, &endptr);
+               if ( (endptr == optarg) || (*endptr != '\0') || (seconds < 0.001) || (seconds > 86400.0) ) {
+                  fprintf (stderr, "illegal value for interval; specify the window length in seconds (0.001 to 86400)\n");
+                  exit (0);
+               }
+               window_interval=(unsigned long)(seconds*1000000000.0);
+            }
+            break;
+         case 'J':
+            json_path=optarg;
+            break;
+         case 'D':
+            daemon_flag=1;
+            break;
+         case 'O':
+            output_path=optarg;
+            break;
+         case 'M':
+            metrics_address=optarg;
+            break;
+         case 'S':
+            {
+               char *endptr;
+               utempl = strtoul(optarg, &endptr, 10);
+               if ((*endptr == 'k') || (*endptr == 'K')) utempl<<=10, endptr++;
+               else if ((*endptr == 'm') || (*endptr == 'M')) utempl<<=20, endptr++;
+               else if ((*endptr == 'g') || (*endptr == 'G')) utempl<<=30, endptr++;
+               if ( (endptr == optarg) || (*endptr != '\0') || (utempl < MAX_SPIKES*sizeof(spike_data_struct)) || (utempl > (1UL<<40)) ) {
+                  fprintf (stderr, "illegal value for buffer; specify the bytes of spike buffer per sampler, with k, m or g (%luk to 1024g)\n", (unsigned long)((MAX_SPIKES*sizeof(spike_data_struct)+1023)>>10));
+                  exit (0);
+               }
+               buffer_bytes=utempl;
+            }
+            break;
+         case 'R':
+            record_only=1;
+            break;
+         case 'X':
+            matrix_path=optarg;
+            break;
+         case 'r':
+            matrix_repeat = strtol(optarg, NULL, 10);
+            if ( (matrix_repeat < 1) || (matrix_repeat > MATRIX_MAX_REPEAT) ) {
+               fprintf (stderr, "illegal value for repeat; specify 1 to %d runs of each configuration\n", MATRIX_MAX_REPEAT);
+               exit (0);
+            }
+            break;
+         case 'Y':
+            baseline_path=optarg;
+            break;
+         case 'y':
+            save_baseline_path=optarg;
+            break;
+         case 'A':
+            audit_flag=1;
+            break;
+         case 'Q':
+            {
+               char *endptr;
+               utempl = strtoul(optarg, &endptr, 10);
+               if ( (endptr == optarg) || (utempl > 1000000) || ((*endptr != '\0') && (compare_parameters(endptr, ",cpu") <= 0)) ) {
+                  fprintf (stderr, "illegal value for pm-qos; specify the exit latency limit in usecs (0 to 1000000), optionally followed by \",cpu\"\n");
+                  exit (0);
+               }
+               pm_qos.usecs=(long)utempl;
+               pm_qos.mode=(*endptr == '\0') ? PM_QOS_DMA : PM_QOS_RESUME;
+            }
+            break;
+         case 'q':
+            pm_qos.ab=1;
+            break;
+         case 'B':
+            benchmark_kernels_flag=1;
+            break;
+         case 'C':
+            benchmark_clocks_flag=1;
+            break;
          case 'V':
             fprintf (stderr, "HP-TimeTest version %d.%d (%s)\n", Version.major, Version.minor, date_time);
             exit (0);
@@ -839,6 +4820,10 @@ int main (const int argc, const char *const argv[])
                     "measured in cycles instead of microseconds.  This method is selected with the\n"
                     "\"--method=cycles\" option.\n"
                     "\n"
+                    "The \"--clock\" option replaces gettimeofday() with clock_gettime() on the named\n"
+                    "clock.  Spikes, thresholds and deltas are then in nanoseconds rather than\n"
+                    "microseconds, so sub-microsecond spikes can be seen.\n"
+                    "\n"
                     "You may want to specify values of time for arguments that take units of cycles.\n"
                     "For these cases you can convert based on the processor frequency.\n"
                     "E.g., if you want to use a threshold of 6 microseconds and run for 8 minutes\n"
@@ -848,6 +4833,164 @@ int main (const int argc, const char *const argv[])
                     "The division by 24 corresponds to the number of cycles to perform one iteration\n"
                     "of the inner loop; you can find the corresponding number for your machine by\n"
                     "running a quick job with -m cycles -l 100 -v2\n"
+                    "In cycle mode the TSC is checked for being invariant (CPUID) and calibrated\n"
+                    "against CLOCK_MONOTONIC_RAW at startup; if it is invariant every spike is also\n"
+                    "reported in nanoseconds, and the calibration error is printed.\n"
+                    "\n"
+                    "The \"pingpong\" method measures how long it takes to hand a cache line to\n"
+                    "another CPU and back.  Two threads pinned to a pair of CPUs take turns storing\n"
+                    "into one line, and each round trip is timed with rdtscp.  Every pair of the\n"
+                    "\"--cpus\" (default: all CPUs this process may use) is measured in turn for\n"
+                    "\"--loopcount\" round trips, and matrices of the minimum, median and p99 round\n"
+                    "trip in cycles are printed, followed by the round trips over the threshold for\n"
+                    "each pair.\n"
+                    "\n"
+                    "The time and cycles loops are compiled once for every timesource, with and\n"
+                    "without the histogram and for every power_hog kernel, so the loop that runs\n"
+                    "makes no decisions beyond comparing against the threshold.\n"
+                    "\"--benchmark-kernels\" runs the loop for the given options next to the old\n"
+                    "generic one (10000000 iterations unless \"--loopcount\" is given) and reports\n"
+                    "the minimum spike and time per iteration of each.\n"
+                    "\n"
+                    "\"--benchmark-clocks\" reads rdtsc, rdtscp, lfence+rdtsc, gettimeofday(),\n"
+                    "clock_gettime() on every clock, and the CPU number through get_my_cpu()'s\n"
+                    "vsyscall and sched_getcpu(), 10000000 times each (or \"--loopcount\") on one\n"
+                    "CPU, and reports the cost per read and the resolution, median, p99 and maximum\n"
+                    "step between readings.  It also shows the kernel's clocksource: with anything\n"
+                    "but tsc the time functions become system calls.\n"
+                    "\n"
+                    "The \"wakeup\" method measures how late a sleeping thread wakes up, as\n"
+                    "cyclictest does.  The sampler sleeps with clock_nanosleep() to absolute\n"
+                    "deadlines \"--period\" usecs apart, on the \"--clock\" (monotonic unless another\n"
+                    "clock_gettime() clock is named that clock_nanosleep() can sleep on, which\n"
+                    "monotonic_raw can't), and the lateness of each wakeup in nsecs is its spike.\n"
+                    "The default threshold of 0 reports every wakeup; all of them are counted in\n"
+                    "the histogram.  The policy, priority and nice value are set as for the other\n"
+                    "methods.\n"
+                    "\n"
+                    "The \"memchase\" method measures the memory side instead: TLB shootdowns, THP\n"
+                    "compaction, NUMA balancing and page migration, DRAM refresh.  Each sampler\n"
+                    "follows a random chain of dependent loads, one per cache line, through its own\n"
+                    "\"--chase-size\" MB buffer (256 by default; make it larger than the last-level\n"
+                    "cache), and times every block of 16 loads with rdtscp; a block that takes\n"
+                    "longer than the threshold in cycles is a spike, and a block that ends on\n"
+                    "another CPU is flagged as a migration as in the cycles method.  The buffer is\n"
+                    "bound to NUMA node \"--chase-node\", or else to the node of the sampler's CPU,\n"
+                    "faulted in before the run, and checked page by page to be on that node; a\n"
+                    "remote node shows the cost of the interconnect.\n"
+                    "\n"
+                    "With \"--cpus\" one sampler thread is started on each listed CPU, using the\n"
+                    "requested policy and priority.  The samplers measure the same window, and the\n"
+                    "spikes are reported with the CPU they hit, followed by a summary for each CPU.\n"
+                    "\"--cpu\" pins the usual lone sampler to one CPU instead.\n"
+                    "\n"
+                    "The cycles method reads the TSC with rdtscp, which also returns the CPU the\n"
+                    "reading was taken on.  When two readings come from different CPUs the thread\n"
+                    "was migrated in between; the difference is reported as a spike \"across a CPU\n"
+                    "migration\" but is left out of the spike counts, maximum and histogram, since\n"
+                    "it mixes two TSCs.  The number of migrations is printed at the end.\n"
+                    "\n"
+                    "With \"--writer\" the samplers never print.  Each spike is passed through a\n"
+                    "lock-free ring to a writer thread on the given CPU, which does the formatting.\n"
+                    "The \"overhead\" option then also reports the writer's cycles and any spikes\n"
+                    "dropped because the writer fell behind.\n"
+                    "\n"
+                    "Otherwise each sampler keeps its spikes in a buffer of 1021 records and prints\n"
+                    "them whenever it fills.  \"--buffer\" sizes that buffer instead, up to\n"
+                    "gigabytes, on hugetlb pages if any are reserved (vm.nr_hugepages) or else on\n"
+                    "transparent huge pages; it is faulted in and checked to be resident before the\n"
+                    "run, so storing a spike costs neither a page fault nor a TLB miss.  With\n"
+                    "\"--record-only\" nothing is printed until the run is over; spikes that find\n"
+                    "the buffer full are counted rather than printed, and the count is reported.\n"
+                    "At 72 bytes a spike, a 1g buffer holds nearly 15 million of them.\n"
+                    "\n"
+                    "The \"power_hog\" option (cycles method only) runs a block of vector FMAs on\n"
+                    "every iteration, so the spikes show what heavy SIMD code costs: the vector\n"
+                    "units' warm-up and frequency license changes.  The kernel is the widest the CPU\n"
+                    "supports unless \"--hog-isa\" names one; \"--hog-intensity\" repeats it.  The\n"
+                    "threshold has to allow for the kernel's own cycles, which are reported at the\n"
+                    "end.\n"
+                    "\n"
+                    "The \"histogram\" option counts every iteration, not just the spikes, in a\n"
+                    "log-linear histogram and reports its percentiles, maximum and buckets.\n"
+                    "\n"
+                    "With \"--interval\" the run is cut into windows of that many seconds, and each\n"
+                    "sampler's window is reported as soon as it closes: iterations, spikes, maximum\n"
+                    "spike, p50/p99/p99.9/p99.99 and overhead, so a long run shows when things\n"
+                    "changed.  Windows close between chunks of 65536 iterations (after any wakeup\n"
+                    "for the wakeup method).  A reporter thread prints them, in the \"--format\" or\n"
+                    "as JSON lines to the \"--json\" file, and the final summary covers the whole\n"
+                    "run.\n"
+                    "\n"
+                    "SIGINT or SIGTERM ends the measured pass early but cleanly: buffered spikes are\n"
+                    "printed and the summary and XML footer are written as for a full run (a second\n"
+                    "SIGINT kills it).  SIGUSR1 prints the buffered spikes and a snapshot of each\n"
+                    "sampler's totals so far, and SIGHUP reopens the \"--output\" file after it has\n"
+                    "been rotated.  With \"--daemon\" there is no loopcount: the samplers run until\n"
+                    "told to stop, e.g. as a permanent canary on a spare isolated CPU.  The signals\n"
+                    "are checked between chunks of 65536 iterations.\n"
+                    "\n"
+                    "\"--metrics\" starts an exporter thread, off the sampled CPUs, that answers\n"
+                    "HTTP requests on a UNIX socket (or on 127.0.0.1 if given a port number) with\n"
+                    "OpenMetrics text: iterations, spikes, maximum spike, overhead, the histogram\n"
+                    "buckets in use and, with the smi options, SMI counts.  The samplers publish\n"
+                    "seqlock snapshots between chunks, so scraping never slows the sampling loop.\n"
+                    "\n"
+                    "\"--audit\" reads procfs and sysfs before the run and gives a pass, warn or\n"
+                    "fail verdict for each sampled CPU's isolcpus, nohz_full and rcu_nocbs\n"
+                    "membership, the IRQs routed to it, its cpufreq governor, its deepest enabled\n"
+                    "C-state and its timer interrupt rate while busy (counted during a short spin\n"
+                    "on it), and for the host's irqbalance setup, transparent huge pages, RT\n"
+                    "throttling and clocksource.  RT throttling (sched_rt_runtime_us) stops a\n"
+                    "busy SCHED_FIFO sampler for 50 msecs of every second by default, which looks\n"
+                    "just like hardware noise.\n"
+                    "\n"
+                    "\"--pm-qos USECS\" keeps the CPUs out of C-states that take longer than USECS\n"
+                    "to leave, for the length of the run, by holding /dev/cpu_dma_latency open;\n"
+                    "\"--pm-qos USECS,cpu\" sets pm_qos_resume_latency_us of just the \"--cpus\" and\n"
+                    "puts it back afterwards.  The limit is recorded ahead of the spikes.  With\n"
+                    "\"--pm-qos-ab\" it is held in the even \"--interval\" windows (10 seconds by\n"
+                    "default) and released in the odd ones; each window says which it was, and the\n"
+                    "two settings' spikes, percentiles and, where RAPL is readable, package power\n"
+                    "are compared at the end.\n"
+                    "\n"
+                    "\"--matrix FILE\" benchmarks a set of configurations.  Each line of FILE is\n"
+                    "\"name: options\"; the options of a line named \"all\" go in front of every\n"
+                    "configuration's.  Every configuration is run \"--repeat\" times (5 by default),\n"
+                    "round-robin, each run a separate process with its own warm-up, and the spike\n"
+                    "count, p50, p99, p99.9, p99.99 and maximum of the runs are summarized.\n"
+                    "\"--save-baseline FILE\" stores the runs along with the host name, kernel, BIOS\n"
+                    "version and tuned profile.  \"--baseline FILE\" compares the runs with a stored\n"
+                    "baseline: a metric whose median is more than 10%% worse and differs with\n"
+                    "p < 0.05 by a Mann-Whitney U test is a REGRESSION, as is a configuration whose\n"
+                    "runs all failed, and the exit status is 2.  It takes at least 4 runs on each\n"
+                    "side for any difference to reach p < 0.05.\n"
+                    "For example, after a kernel update, with a FILE of\n"
+                    "    all: -p FIFO -l 100000000\n"
+                    "    time: -m time\n"
+                    "    cycles: -m cycles\n"
+                    "compare \"-X FILE -y before\" on the old kernel with \"-X FILE -Y before\".\n"
+                    "\n"
+                    "With \"--log FILE\" the spikes are not printed but stored as 64-bit binary\n"
+                    "records in FILE (FILE.<cpu> for each sampler with \"--cpus\"), written through a\n"
+                    "prefaulted memory mapping.  The record layout is in HP-TimeTest-log.h.\n"
+                    "\n"
+                    "The \"smi_spikes\" option reads MSR_SMI_COUNT each time a spike is seen and\n"
+                    "marks the spikes that had an SMI since the previous one, so firmware-caused\n"
+                    "spikes can be told apart from the others.  It needs the msr module.\n"
+                    "\n"
+                    "The \"perf_counters\" option gives every spike the number of context switches,\n"
+                    "migrations, minor and major page faults, and where the PMU allows instructions\n"
+                    "and cycles, counted by the sampler since the previous spike.  They tell a\n"
+                    "preemption or a fault from a stall of the core itself.\n"
+                    "\n"
+                    "With \"--noise\" the measurement is made twice, first quiet and then while\n"
+                    "noise threads run on the \"--noise-cpus\": \"stream\" threads stream through\n"
+                    "memory (the STREAM triad), \"chase\" threads follow a random chain of cache\n"
+                    "lines to thrash the last-level cache, and \"mem\" alternates the two.  Each\n"
+                    "works over \"--noise-size\" MB.  The spikes of both runs are compared side by\n"
+                    "side, which shows how well CAT/MBA and the choice of CPUs protect the sampled\n"
+                    "ones.  Only the loaded run is written to a \"--log\".\n"
                     "\n"
                     "It is presumed that these spikes are due to System Management Interrupts (SMIs).\n"
                     "Consider running this image on a selected core, but before doing so consider\n"
@@ -868,16 +5011,45 @@ int main (const int argc, const char *const argv[])
                     , argv[0]);
          case 'h':
          case '?':
-            printf ("usage:  [-m,  --method \"time\"|\"cycles\"(default=\"time\")]\n"
-                    "        [-t,  --threshold #(default=%lu usecs|%lu cycles)]\n"
-                    "        [-l,  --loopcount #(default=%lu (time)|%lu (cycles))]\n"
+            printf ("usage:  [-m,  --method \"time\"|\"cycles\"|\"pingpong\"|\"wakeup\"|\"memchase\"(default=\"time\")]\n"
+                    "        [-t,  --threshold #(default=%lu usecs (%lu nsecs with a --clock)|%lu cycles|%lu nsecs (wakeup)|%lu cycles (memchase))]\n"
+                    "        [-l,  --loopcount #(default=%lu (time)|%lu (cycles)|%lu per pair (pingpong)|%lu (wakeup)|%lu (memchase))]\n"
                     "        [-f,  --format \"csv\"|\"xml\"|\"freeform\"(default=freeform)]\n"
-                    "        [-o,  --option \"date\" \"smi_count\" \"power_hog\" \"overhead\"]\n"
+                    "        [-o,  --option \"date\" \"smi_count\" \"smi_spikes\" \"perf_counters\" \"power_hog\" \"overhead\" \"histogram\"]\n"
                     "        [-p,  --priority [\"FIFO\"|\"RR\"|\"OTHER\"(default policy=%s)][,#(default priority=sched_get_priority_max(=99 for FIFO,RR))][,#(default nice=%d)]\n"
+                    "        [-c,  --cpus list (e.g. \"2-31,34\"; one pinned sampler thread per CPU)]\n"
+                    "        [-a,  --cpu # (pin the lone sampler to this CPU)]\n"
+                    "        [-w,  --writer # (housekeeping CPU for a thread that prints the spikes)]\n"
+                    "        [-k,  --clock \"gettimeofday\"|\"monotonic\"|\"monotonic_raw\"|\"realtime\"|\"tai\"|\"boottime\"(default=gettimeofday)]\n"
+                    "        [-L,  --log FILE (binary spike log; FILE.<cpu> for each sampler with --cpus)]\n"
+                    "        [-H,  --hog-isa \"auto\"|\"sse\"|\"avx2\"|\"avx512\"(default=auto; implies -o power_hog)]\n"
+                    "        [-i,  --hog-intensity #(default=1; passes over the power_hog kernel per iteration)]\n"
+                    "        [-n,  --noise \"mem\"|\"stream\"|\"chase\" (memory noise on --noise-cpus; quiet and loaded runs)]\n"
+                    "        [-N,  --noise-cpus list (CPUs for the noise threads)]\n"
+                    "        [-z,  --noise-size #(default=64; MB each noise thread works over)]\n"
+                    "        [-P,  --period #(default=%lu usecs; timer period of the wakeup method)]\n"
+                    "        [-s,  --chase-size #(default=%lu; MB each memchase sampler chases through)]\n"
+                    "        [-d,  --chase-node # (NUMA node of the memchase buffers; default is each sampler's own)]\n"
+                    "        [-I,  --interval # (seconds; report every window of this length as it closes)]\n"
+                    "        [-J,  --json FILE (the --interval windows as JSON lines; \"-\" for stdout)]\n"
+                    "        [-D,  --daemon (sample until SIGTERM/SIGINT; SIGUSR1 prints a snapshot)]\n"
+                    "        [-O,  --output FILE (append the output to FILE; SIGHUP reopens it)]\n"
+                    "        [-M,  --metrics PATH|PORT (serve OpenMetrics on a UNIX socket or 127.0.0.1:PORT)]\n"
+                    "        [-S,  --buffer #[k|m|g] (bytes of huge-page spike buffer per sampler)]\n"
+                    "        [-R,  --record-only (print the spikes only when the run is over)]\n"
+                    "        [-A,  --audit (check the host's real-time tuning for the sampled CPUs before the run)]\n"
+                    "        [-Q,  --pm-qos #[,cpu] (usecs; hold /dev/cpu_dma_latency, or with \",cpu\" each --cpus CPU's resume latency)]\n"
+                    "        [-q,  --pm-qos-ab (hold the --pm-qos limit in even --interval windows only, and compare)]\n"
+                    "        [-X,  --matrix FILE (run each configuration in FILE --repeat times, then exit)]\n"
+                    "        [-r,  --repeat #(default=5; runs of each --matrix configuration)]\n"
+                    "        [-Y,  --baseline FILE (compare the --matrix runs with a saved baseline)]\n"
+                    "        [-y,  --save-baseline FILE (save the --matrix runs and the host they ran on)]\n"
+                    "        [-B,  --benchmark-kernels (compare the generic and the specialized sampling loop, then exit)]\n"
+                    "        [-C,  --benchmark-clocks (cost and resolution of every way of reading the time, then exit)]\n"
                     "        [-V,  --Version]\n"
                     "        [-v#, --verbose=[#(default=%u]] [-b, --brief]\n"
                     "        [-e,  --explain] [-? -h, --help]\n",
-               threshold_time_default, threshold_cycles_default, loopcount_time_default, loopcount_cycles_default, policy_string(default_policy), default_nice, chatty_default);
+               threshold_time_default, threshold_time_default*1000L, threshold_cycles_default, threshold_wakeup_default, threshold_memchase_default, loopcount_time_default, loopcount_cycles_default, loopcount_pingpong_default, loopcount_wakeup_default, loopcount_memchase_default, policy_string(default_policy), default_nice, period_wakeup_default, chase_size_default, chatty_default);
             exit (0);
             break;
          default:
@@ -908,6 +5080,12 @@ optopt
    }
    }
 
+/* Everything from here on goes to the "--output" file, which SIGHUP reopens */
+   if ((output_path != NULL) && (freopen(output_path, "a", stdout) == NULL)) {
+      fprintf (stderr, "unable to open %s: %s\n", output_path, strerror(errno));
+      exit (1);
+   }
+
    time_t now1=time(NULL);
    struct tm *now2=localtime(&now1);
    if (format==CSV_FORMAT) {
@@ -944,9 +5122,13 @@ optopt
       XML_head[0]='\0';
       XML_tail[0]='\0';
    }
+/* The matrix's runs are child processes; this one only starts them and reads their output */
+   if ( matrix_path != NULL ) exit (run_matrix(matrix_path, matrix_repeat, baseline_path, save_baseline_path));
+   if (((baseline_path != NULL) || (save_baseline_path != NULL)) && (chatty >= 1))
+      printf ("%s--baseline and --save-baseline only apply to --matrix; ignored%s\n", XML_head, XML_tail);
    if ( options[SMI_OPTION]==1) {
       unsigned long SMI_count;
-      status=msr_read(0x34L, &SMI_count, 0L);
+      status=msr_read(MSR_SMI_COUNT, &SMI_count, 0L);
       if (status >= 0) {
          if (format == CSV_FORMAT) printf("SMI count,%ld\n", SMI_count);
          else if (format == XML_FORMAT) printf("<SMIcount>%ld</SMIcount>\n", SMI_count);
@@ -955,17 +5137,82 @@ optopt
    }
 
    if ( use_threshold_default == 1 ) {
-      if (method == TIME_METHOD) threshold=threshold_time_default;
+      if (method == TIME_METHOD) threshold=threshold_time_default*1000L/timesource->scale;
       if (method == CYCLES_METHOD) threshold=threshold_cycles_default;
+      if (method == PINGPONG_METHOD) threshold=threshold_cycles_default;
+      if (method == WAKEUP_METHOD) threshold=threshold_wakeup_default;
+      if (method == MEMCHASE_METHOD) threshold=threshold_memchase_default;
    }
    if ( use_loopcount_default == 1 ) {
       if (method == TIME_METHOD) loopcount=loopcount_time_default;
       if (method == CYCLES_METHOD) loopcount=loopcount_cycles_default;
+      if (method == PINGPONG_METHOD) loopcount=loopcount_pingpong_default;
+      if (method == WAKEUP_METHOD) loopcount=loopcount_wakeup_default;
+      if (method == MEMCHASE_METHOD) loopcount=loopcount_memchase_default;
    }
-   if (method == TIME_METHOD)
-      spike_unit=second_string;
+/* A daemon samples until SIGTERM or SIGINT */
+   if ((daemon_flag == 1) && (method != PINGPONG_METHOD)) {
+      loopcount=ULONG_MAX;
+      if (noise_kind != 0) {
+         if (chatty >= 1) printf ("%s--noise needs a quiet run that ends; ignored with --daemon%s\n", XML_head, XML_tail);
+         noise_kind=0;
+      }
+   }
+/* clock_nanosleep() needs a clock_gettime() clock, and lateness is measured on the same one */
+   if ((method == WAKEUP_METHOD) && (timesource->clock_id < 0)) parse_timesource("monotonic");
+/* Not every clock_gettime() clock can be slept on (monotonic_raw can't); an absolute sleep to a time long past
+   returns at once and shows whether this one can
+*/
+   if (method == WAKEUP_METHOD) {
+      struct timespec past = { 0, 0 };
+      rv = clock_nanosleep(timesource->clock_id, TIMER_ABSTIME, &past, NULL);
+      if ((rv != 0) && (rv != EINTR)) {
+         if (chatty >= 1) printf ("%sclock_nanosleep() can't use the %s clock (%s); the wakeup method uses monotonic%s\n", XML_head, timesource->name, strerror(rv), XML_tail);
+         parse_timesource("monotonic");
+      }
+   }
+   if ((method == TIME_METHOD) || (method == WAKEUP_METHOD))
+      spike_unit=timesource->unit;
    else
       spike_unit=cycle_string;
+/* Every wakeup goes into the histogram, whatever the threshold */
+   if (method == WAKEUP_METHOD) options[HISTOGRAM_OPTION]=1;
+   if ((method != MEMCHASE_METHOD) && ((chase_node >= 0) || (chase_bytes != (chase_size_default<<20))) && (chatty >= 1))
+      printf ("%s--chase-size and --chase-node only apply to the memchase method; ignored%s\n", XML_head, XML_tail);
+   if ((pm_qos.ab == 1) && (pm_qos.mode == 0)) {
+      if (chatty >= 1) printf ("%s--pm-qos-ab without --pm-qos; ignored%s\n", XML_head, XML_tail);
+      pm_qos.ab=0;
+   }
+   if ((pin_cpu >= 0) && (use_cpus == 1)) {
+      fprintf (stderr, "--cpu pins the lone sampler; with --cpus every sampler is already pinned\n");
+      exit (0);
+   }
+   if (pin_cpu >= 0) {
+      cpu_set_t allowed;
+      if ((sched_getaffinity(0, sizeof(allowed), &allowed) == 0) && !CPU_ISSET(pin_cpu, &allowed)) {
+         fprintf (stderr, "CPU %d is not one this process may run on\n", pin_cpu);
+         exit (0);
+      }
+   }
+   if ((pm_qos.mode == PM_QOS_RESUME) && (use_cpus == 0) && (method != PINGPONG_METHOD)) {
+      fprintf (stderr, "--pm-qos with \",cpu\" needs --cpus to say which CPUs to limit\n");
+      exit (0);
+   }
+/* A/B comparisons are made window by window */
+   if ((pm_qos.ab == 1) && (window_interval == 0) && (method != PINGPONG_METHOD)) {
+      window_interval=10000000000L;
+      if (chatty >= 1) printf ("%s--pm-qos-ab alternates --interval windows; using 10 seconds%s\n", XML_head, XML_tail);
+   }
+/* The windows' percentiles come from per-window histograms, which are merged into the run's */
+   if ((window_interval != 0) && (method != PINGPONG_METHOD)) options[HISTOGRAM_OPTION]=1;
+   if ((record_only == 1) && ((use_writer == 1) || (log_path != NULL))) {
+      if (chatty >= 1) printf ("%s--record-only keeps the spikes in the buffer; with --writer or --log they never go there, so it is ignored%s\n", XML_head, XML_tail);
+      record_only=0;
+   }
+   if ((json_path != NULL) && (window_interval == 0)) {
+      if (chatty >= 1) printf ("%s--json without --interval; ignored%s\n", XML_head, XML_tail);
+      json_path=NULL;
+   }
 #ifdef FAKE
    if (method == TIME_METHOD)
       loopcount=FAKE_SAMPLE_COUNT-FAKE_SPIKE_COUNT;
@@ -973,14 +5220,223 @@ optopt
       loopcount=FAKE_SAMPLE_COUNT-FAKE_SPIKE_COUNT*2;
 #endif
    if (chatty >= 2) printf ("%sthreshold=%lu loopcount=%lu verbosity=%u%s\n", XML_head, threshold, loopcount, chatty, XML_tail);
+   if (chatty >= 2) printf ("%stimesource=%s%s\n", XML_head, timesource->name, XML_tail);
+
+/* The pingpong method measures pairs of CPUs instead of sampling, so the sampler-only settings don't apply */
+   if ( method == PINGPONG_METHOD ) {
+      if ((pin_cpu >= 0) && (chatty >= 1)) printf ("%s--cpu doesn't apply to pingpong; use --cpus to choose the pairs%s\n", XML_head, XML_tail);
+      pin_cpu=-1;
+      if ( use_cpus == 1 ) pingpong_cpus=sampler_cpus;
+      else sched_getaffinity(0, sizeof(pingpong_cpus), &pingpong_cpus);
+      if (CPU_COUNT(&pingpong_cpus) < 2) {
+         fprintf (stderr, "the pingpong method needs at least two CPUs\n");
+         exit (0);
+      }
+      if (((use_writer == 1) || (log_path != NULL) || (buffer_bytes != 0) || (record_only == 1) || (noise_kind != 0) || (window_interval != 0) || (metrics_address != NULL) || (pm_qos.mode != 0) || (options[OVERHEAD_OPTION] == 1) || (options[HISTOGRAM_OPTION] == 1) ||
+           (options[SMI_SPIKES_OPTION] == 1) || (options[PERF_COUNTERS_OPTION] == 1)) && (chatty >= 1))
+         printf ("%s--writer, --log, --buffer, --record-only, --noise, --interval, --metrics, --pm-qos and the overhead, histogram, smi_spikes and perf_counters options don't apply to pingpong; ignored%s\n", XML_head, XML_tail);
+      use_writer=0;
+      log_path=NULL;
+      buffer_bytes=0;
+      record_only=0;
+      noise_kind=0;
+      window_interval=0;
+      json_path=NULL;
+      metrics_address=NULL;
+      pm_qos.mode=pm_qos.ab=0;
+      options[OVERHEAD_OPTION]=options[HISTOGRAM_OPTION]=options[SMI_SPIKES_OPTION]=options[PERF_COUNTERS_OPTION]=0;
+      use_cpus=0;
+      sampler_count=1;
+   }
+
+/* The power_hog kernel is picked once, by CPUID, unless one was named */
+   if ( options[POWER_HOG_OPTION]==1 ) {
+      if (method != CYCLES_METHOD) {
+         if (chatty >= 1) printf ("%spower_hog only applies to the cycles method; ignored%s\n", XML_head, XML_tail);
+         options[POWER_HOG_OPTION]=0;
+      } else if (hog_isa == NULL) {
+         for (hog_isa=hog_isas; hog_isa->supported()==0; hog_isa++) ;
+      } else if (hog_isa->supported() == 0) {
+         fprintf (stderr, "this CPU does not support the %s power_hog kernel\n", hog_isa->name);
+         exit (1);
+      }
+      if ((options[POWER_HOG_OPTION]==1) && (chatty >= 2)) printf ("%spower_hog kernel=%s intensity=%u%s\n", XML_head, hog_isa->name, hog_intensity, XML_tail);
+   }
+/* The plain cycles kernel and the memchase kernel read the TSC with rdtscp, whose TSC_AUX says which CPU each reading came from */
+   if (((method == CYCLES_METHOD) && (options[POWER_HOG_OPTION]==0)) || (method == MEMCHASE_METHOD)) migration_column=1;
+
+   if ( use_cpus == 1 ) {
+      int cpu;
+      rv = posix_memalign((void **)&samplers, CACHE_LINE_SIZE, sampler_count*sizeof(sampler_struct));
+      if (rv != 0) {
+         fprintf (stderr, "unable to allocate memory for %d samplers: %s\n", sampler_count, strerror(rv));
+         exit (1);
+      }
+      memset(samplers, 0, sampler_count*sizeof(sampler_struct));
+      rv = pthread_barrier_init(&start_barrier, NULL, sampler_count+1);
+      if (rv != 0) {
+         fprintf (stderr, "unable to initialize the sampler start barrier: %s\n", strerror(rv));
+         exit (1);
+      }
+      for (cpu=0, ndx=0; ndx<sampler_count; cpu++) {
+         if (!CPU_ISSET(cpu, &sampler_cpus)) continue;
+         samplers[ndx].cpu=cpu;
+         samplers[ndx].start_barrier=&start_barrier;
+         ndx++;
+      }
+      if (chatty >= 2) printf ("%s%d samplers, one on each of the requested CPUs%s\n", XML_head, sampler_count, XML_tail);
+   } else {
+      samplers[0].cpu=pin_cpu;
+      samplers[0].start_barrier=NULL;
+   }
+/* The spike arenas and the chase buffers are mapped and faulted in before mlockall(), so they are locked along with the rest */
+   for (ndx=0; ndx<sampler_count; ndx++) {
+      if (spike_arena_map(&samplers[ndx], buffer_bytes) != 0) exit (1);
+      if ((method == MEMCHASE_METHOD) && (chase_map(&samplers[ndx], chase_bytes, chase_node) != 0)) exit (1);
+   }
+/* Find out which counters the PMU and perf_event_paranoid allow before any spike header is printed;
+   each sampler opens its own set of these once it is running.
+*/
+   if (options[PERF_COUNTERS_OPTION]==1) {
+      perf_counters_struct probe;
+      perf_available=perf_open(&probe, (1<<SPIKE_COUNTERS)-1);
+      perf_close(&probe);
+      if (perf_available == 0) {
+         fprintf (stderr, "unable to open any perf_event counters: %s\nspikes will not carry counters\n", strerror(errno));
+         options[PERF_COUNTERS_OPTION]=0;
+      } else if (chatty >= 2) {
+         printf ("%sperf_event counters:", XML_head);
+         for (ndx=0; ndx<SPIKE_COUNTERS; ndx++) if (perf_available & (1<<ndx)) printf (" %s", perf_events[ndx].name);
+         printf ("%s\n", XML_tail);
+      }
+   }
+   for (ndx=0; ndx<sampler_count; ndx++) {
+      samplers[ndx].method=method;
+/* TIME-method diffs are compared in nanoseconds */
+      samplers[ndx].threshold=(method == TIME_METHOD) ? threshold*timesource->scale : threshold;
+      samplers[ndx].loopcount=loopcount;
+      samplers[ndx].min_spike=ULONG_MAX;
+      samplers[ndx].hist=(options[HISTOGRAM_OPTION]==1) ? &samplers[ndx].histogram : NULL;
+/* power_hog runs its kernel only on the measured pass; the warm-up pass calls hog_idle() in its place */
+      samplers[ndx].sample_kernel[0]=select_sample_kernel(method, timesource->clock_id, (options[POWER_HOG_OPTION]==1) ? hog_idle : NULL, samplers[ndx].hist != NULL);
+      samplers[ndx].sample_kernel[1]=select_sample_kernel(method, timesource->clock_id, (options[POWER_HOG_OPTION]==1) ? hog_isa->kernel : NULL, samplers[ndx].hist != NULL);
+      if ((ndx == 0) && (chatty >= 2)) printf ("%ssampling kernel=%s%s\n", XML_head, samplers[ndx].sample_kernel[1]->name, XML_tail);
+/* The SMI count is read on every spike, so the descriptor is opened here rather than looked up each time.
+   SMIs are broadcast to every CPU, so an unpinned sampler can use the msr device of the CPU it starts on.
+*/
+      samplers[ndx].msr_fd=-1;
+      if (options[SMI_SPIKES_OPTION]==1) {
+         samplers[ndx].msr_fd=msr_open((samplers[ndx].cpu >= 0) ? samplers[ndx].cpu : get_my_cpu());
+         if (samplers[ndx].msr_fd < 0) {
+            fprintf (stderr, "spikes will not be checked for SMIs\n");
+            options[SMI_SPIKES_OPTION]=0;
+            for (rv=0; rv<ndx; rv++) {
+               close(samplers[rv].msr_fd);
+               samplers[rv].msr_fd=-1;
+            }
+         }
+      }
+      samplers[ndx].perf=NULL;
+      if (perf_available != 0) {
+         samplers[ndx].perf=(perf_counters_struct *)malloc(sizeof(perf_counters_struct));
+         if (samplers[ndx].perf == NULL) {
+            perror("unable to allocate memory for the perf_event counters");
+            exit (1);
+         }
+      }
+      if ( use_writer == 1 ) {
+         rv = posix_memalign((void **)&samplers[ndx].ring, CACHE_LINE_SIZE, sizeof(spike_ring_struct));
+         if (rv != 0) {
+            fprintf (stderr, "unable to allocate memory for the writer's spike ring: %s\n", strerror(rv));
+            exit (1);
+         }
+         memset(samplers[ndx].ring, 0, sizeof(spike_ring_struct));
+      }
+      samplers[ndx].metrics=NULL;
+      if ( metrics_address != NULL ) {
+         rv = posix_memalign((void **)&samplers[ndx].metrics, CACHE_LINE_SIZE, sizeof(sampler_metrics_struct));
+         if (rv != 0) {
+            fprintf (stderr, "unable to allocate memory for the metrics snapshots: %s\n", strerror(rv));
+            exit (1);
+         }
+         memset(samplers[ndx].metrics, 0, sizeof(sampler_metrics_struct));
+      }
+      samplers[ndx].windows=NULL;
+      if ( window_interval != 0 ) {
+         rv = posix_memalign((void **)&samplers[ndx].windows, CACHE_LINE_SIZE, sizeof(window_ring_struct));
+         if (rv != 0) {
+            fprintf (stderr, "unable to allocate memory for the interval windows: %s\n", strerror(rv));
+            exit (1);
+         }
+      }
+   }
+   if ( window_interval != 0 ) {
+      reporter.json=NULL;
+      if (json_path != NULL) {
+         reporter.json=(strcmp(json_path, "-") == 0) ? stdout : fopen(json_path, "w");
+         if (reporter.json == NULL) {
+            fprintf (stderr, "unable to open %s for the interval windows: %s\n", json_path, strerror(errno));
+            exit (1);
+         }
+/* One line per window, so a dashboard tailing the file sees each window as it closes */
+         setvbuf(reporter.json, NULL, _IOLBF, 0);
+      }
+      if (chatty >= 2) printf ("%sinterval windows of %lu nsecs%s\n", XML_head, window_interval, XML_tail);
+   }
+   if ( use_writer == 1 ) {
+      if ((use_cpus == 1) && CPU_ISSET(writer.cpu, &sampler_cpus) && (chatty >= 1))
+         printf ("%sthe writer shares CPU %d with a sampler%s\n", XML_head, writer.cpu, XML_tail);
+      writer.samplers=samplers;
+      writer.sampler_count=sampler_count;
+   }
+/* "mem" noise alternates bandwidth and pointer-chase threads over the noise CPUs */
+   if ( noise_kind != 0 ) {
+      int cpu;
+      if (noise_count == 0) {
+         fprintf (stderr, "--noise needs --noise-cpus to say where the noise threads run\n");
+         exit (0);
+      }
+      noise=(noise_struct *)calloc(noise_count, sizeof(noise_struct));
+      quiet=(run_stats_struct *)calloc(sampler_count, sizeof(run_stats_struct));
+      if ((noise == NULL) || (quiet == NULL)) {
+         perror("unable to allocate memory for the noise threads");
+         exit (1);
+      }
+      for (cpu=0, ndx=0; ndx<noise_count; cpu++) {
+         if (!CPU_ISSET(cpu, &noise_cpus)) continue;
+         noise[ndx].cpu=cpu;
+         noise[ndx].kind=(noise_kind == NOISE_MEM) ? ((ndx%2 == 0) ? NOISE_STREAM : NOISE_CHASE) : noise_kind;
+         noise[ndx].bytes=noise_mb<<20;
+         if ((use_cpus == 1) && CPU_ISSET(cpu, &sampler_cpus) && (chatty >= 1))
+            printf ("%sthe noise thread on CPU %d shares it with a sampler%s\n", XML_head, cpu, XML_tail);
+         if ((use_writer == 1) && (cpu == writer.cpu) && (chatty >= 1))
+            printf ("%sthe noise thread on CPU %d shares it with the writer%s\n", XML_head, cpu, XML_tail);
+         ndx++;
+      }
+      if (chatty >= 2) printf ("%s%d noise threads of %lu MB each%s\n", XML_head, noise_count, noise_mb, XML_tail);
+   } else if ((noise_count != 0) && (chatty >= 1)) {
+      printf ("%s--noise-cpus without --noise; ignored%s\n", XML_head, XML_tail);
+   }
+
+/* The audit spins on each CPU it checks, so it runs before this process turns real-time */
+   if ( audit_flag == 1 ) {
+      cpu_set_t audit_cpus;
+      if ( method == PINGPONG_METHOD ) audit_cpus=pingpong_cpus;
+      else if ( use_cpus == 1 ) audit_cpus=sampler_cpus;
+      else {
+         CPU_ZERO(&audit_cpus);
+         CPU_SET((pin_cpu >= 0) ? pin_cpu : sched_getcpu(), &audit_cpus);
+      }
+      audit_host_readiness(&audit_cpus, requested_policy);
+   }
 
 /* Touch a bunch of memory we'll be needing.  It's my expectation that "stack" below will come from stack and not from heap. */
    {
       volatile long stack[MAX_SPIKES+3];
-      unsigned int ndx=0;
+      unsigned int ndx=0, this;
       for (ndx=0;ndx<MAX_SPIKES;ndx++) {
          stack[ndx]=42L;
-         spikes[ndx].time=42;
+         for (this=0; this<(unsigned int)sampler_count; this++) samplers[this].spikes[ndx].time=42;
       }
       if ( stack[MAX_SPIKES+1] == 43 ) printf("We will never do this print\n");
    }
@@ -1019,6 +5475,57 @@ optopt
    if (chatty >= 1) printf ("%ssetpriority(): %d%s\n", XML_head, rv, XML_tail);
    if (chatty >= 2) printf ("%sgetpriority(): %d%s\n", XML_head, getpriority(PRIO_PROCESS, 0), XML_tail);
 
+/* In cycle mode, check the TSC and calibrate it (now that we run at the requested priority) so the spikes can
+   also be reported in nanoseconds.
+*/
+   if (CYCLE_METHOD(method) || (method == PINGPONG_METHOD)) {
+      double tsc_khz;
+      int invariant=tsc_is_invariant();
+      tsc_khz=calibrate_tsc(&tsc_error_ppm);
+      if (tsc_khz > 0.0) spike_nsec_per_unit=1000000.0/tsc_khz;
+      if (chatty >= 1) {
+         if (format == CSV_FORMAT) {
+            printf("TSC invariant,%d\n", invariant);
+            if (tsc_khz > 0.0) printf("TSC frequency (kHz),%.0f\nTSC calibration error (ppm),%.1f\n", tsc_khz, tsc_error_ppm);
+         } else if (format == XML_FORMAT) {
+            printf("<TSC>\n  <invariant>%d</invariant>\n", invariant);
+            if (tsc_khz > 0.0) printf("  <kHz>%.0f</kHz>\n  <error_ppm>%.1f</error_ppm>\n", tsc_khz, tsc_error_ppm);
+            printf("</TSC>\n");
+         } else {
+            if (tsc_khz > 0.0) printf("TSC is invariant; calibrated at %.3f MHz +/- %.1f ppm against CLOCK_MONOTONIC_RAW\n", tsc_khz/1000.0, tsc_error_ppm);
+            else printf("TSC is not reported as invariant; spikes are reported in cycles only\n");
+         }
+      }
+   }
+
+/* Pinned to the first of the --cpus, or else to wherever main() is running now */
+   if ( benchmark_clocks_flag == 1 ) {
+      int cpu=sched_getcpu();
+      if ( use_cpus == 1 ) for (cpu=0; !CPU_ISSET(cpu, &sampler_cpus); cpu++) ;
+      benchmark_clocks(cpu, (use_loopcount_default == 1) ? 10000000L : loopcount);
+      return 0;
+   }
+   if ( benchmark_kernels_flag == 1 ) {
+      if ((method != TIME_METHOD) && (method != CYCLES_METHOD)) {
+         fprintf (stderr, "--benchmark-kernels needs the time or cycles method\n");
+         exit (0);
+      }
+      benchmark_kernels(&samplers[0], (use_loopcount_default == 1) ? 10000000L : loopcount);
+      return 0;
+   }
+
+/* Each sampler gets its own log, FILE.<cpu> in a --cpus run, so no two threads ever store to the same mapping */
+   if ( log_path != NULL ) {
+      char path[PATH_MAX];
+      for (ndx=0; ndx<sampler_count; ndx++) {
+         if (use_cpus == 1) snprintf(path, sizeof(path), "%s.%d", log_path, samplers[ndx].cpu);
+         else snprintf(path, sizeof(path), "%s", log_path);
+         samplers[ndx].log=(spike_log_struct *)malloc(sizeof(spike_log_struct));
+         if ((samplers[ndx].log == NULL) || (spike_log_open(samplers[ndx].log, path, &samplers[ndx]) != 0)) exit (1);
+         if (chatty >= 2) printf ("%sspikes are logged to %s%s\n", XML_head, path, XML_tail);
+      }
+   }
+
    if (format==XML_FORMAT) {
       printf(
          "<spike_data>\n"
@@ -1099,220 +5606,164 @@ optopt
           "      </field_2>\n"
           "      <field_3>\n"
           "         <name>delta</name>\n"
-          "         <units>usec</units>\n"
-          "      </field_3>\n", spike_unit);
+          "         <units>%s</units>\n"
+          "      </field_3>\n", spike_unit, timesource->unit);
+   }
+
+   if ((format==XML_FORMAT) && (use_cpus == 1)) {
+      printf(
+          "      <field_4>\n"
+          "         <name>cpu</name>\n"
+          "         <units>cpu</units>\n"
+          "      </field_4>\n");
+   }
+   if ((format==XML_FORMAT) && (spike_nsec_per_unit > 0.0)) {
+      printf(
+          "      <field_5>\n"
+          "         <name>spike_nsec</name>\n"
+          "         <units>nsec</units>\n"
+          "      </field_5>\n");
    }
 
    fflush( stdout ); fflush( stderr );
 
-   warm_up=0;
-   while ( warm_up++ < 2 ) {
-      if ( warm_up == 1 ) {
-         save_loopcount=loopcount;
-         save_threshold=threshold;
-         save_chatty=chatty;
-         loopcount=MAX_SPIKES;
-         threshold=0L;
-         chatty=0L;
-      } else {
-         loopcount=save_loopcount;
-         threshold=save_threshold;
-         chatty=save_chatty;
-         spike_ndx=0L;
-         overhead_seconds.tv_sec=overhead_seconds.tv_usec=0L;
-         overhead_cycles=0L;
+/* With --noise the same measurement is made twice: quiet, then with the noise threads running.  Only
+   the loaded run is logged; the quiet run's results are kept for the comparison at the end.
+*/
+   if ( method != PINGPONG_METHOD ) install_signal_handlers();
+   if ( pm_qos.mode != 0 ) pm_qos_start(samplers, sampler_count);
+   if ( metrics_address != NULL ) {
+      cpu_set_t avoid;
+      if ( use_cpus == 1 ) avoid=sampler_cpus;
+      else {
+         CPU_ZERO(&avoid);
+         if (pin_cpu >= 0) CPU_SET(pin_cpu, &avoid);
       }
-      tt_gettime (&t0_stamp);
-      tt_time_diff(&t0_stamp,&t0_stamp);
-      last_spike_time = t0_stamp;
-      if (method==TIME_METHOD) {
-         struct timeval t_stamps[2], temp_stamp;
-         t_stamps[0]=t0_stamp;
-         for (count = 1; count <= loopcount; count++) {
-            tt_gettime (&t_stamps[count%2]);
-            diff = tt_time_diff(&t_stamps[count%2], &t_stamps[(count-1)%2]);
-            if (diff >= threshold) {
-               process_big_diff(&(t_stamps[count%2]), &last_spike_time, spikes, &spike_ndx, diff);
-               tt_gettime (&temp_stamp);
-               overhead_seconds.tv_sec +=temp_stamp.tv_sec;
-               overhead_seconds.tv_usec+=temp_stamp.tv_usec;
-               overhead_seconds.tv_sec -=t_stamps[count%2].tv_sec;
-/* Adjust for potential underflow and for overflow */
-               if ( t_stamps[count%2].tv_usec > overhead_seconds.tv_usec ) {
-                  overhead_seconds.tv_sec--;
-                  overhead_seconds.tv_usec+=1000000;
-               }
-               overhead_seconds.tv_usec-=t_stamps[count%2].tv_usec;
-               if (overhead_seconds.tv_usec >= 1000000) {
-                  overhead_seconds.tv_sec++;
-                  overhead_seconds.tv_usec-=1000000;
-               }
-               t_stamps[count%2]=temp_stamp;
-            } else
-               if (diff < min_spike) min_spike = diff;
-         }
+      if (start_exporter(metrics_address, samplers, sampler_count, &avoid) != 0) exit (1);
+      if (chatty >= 1) printf ("%sOpenMetrics served on %s%s\n", XML_head, metrics_address, XML_tail);
+   }
+   if ( method == PINGPONG_METHOD ) {
+      run_pingpong(&pingpong_cpus, loopcount, threshold, requested_policy, requested_priority);
+   } else if ( noise_kind != 0 ) {
+      spike_log_struct **logs=(spike_log_struct **)calloc(sampler_count, sizeof(spike_log_struct *));
+      if (logs == NULL) {
+         perror("unable to allocate memory for the noise threads");
+         exit (1);
+      }
+      for (ndx=0; ndx<sampler_count; ndx++) {
+         logs[ndx]=samplers[ndx].log;
+         samplers[ndx].log=NULL;
+      }
+      print_noise_phase("quiet", noise, 0);
+      run_samplers(samplers, sampler_count, use_cpus, use_writer, requested_policy, requested_priority);
+      save_run_stats(quiet, samplers, sampler_count);
+      for (ndx=0; ndx<sampler_count; ndx++) samplers[ndx].log=logs[ndx];
+      free(logs);
+/* Stopped during the quiet run: there is nothing to compare it with */
+      if ( stop_requested == 0 ) {
+         start_noise(noise, noise_count);
+         print_noise_phase("loaded", noise, noise_count);
+         fflush( stdout );
+         run_samplers(samplers, sampler_count, use_cpus, use_writer, requested_policy, requested_priority);
+         stop_noise(noise, noise_count);
       } else {
-         {
-/* Get an initial value for min_spike */
-            unsigned long cycle_stamp[2];
-            cycle_stamp[0]=get_cycles_p();
-            for (count = 1; count <= 1024; count++) {
-               cycle_stamp[count%2]=get_cycles_p();
-               diff = cycle_stamp[count%2] - cycle_stamp[(count-1)%2];
-               if (diff < min_spike) min_spike = diff;
-            }
-         }
-         if ( options[POWER_HOG_OPTION]==1) {
-            unsigned long cycle_stamp[2];
-//            double Array1[4*sizeof(__m256d)/sizeof(double)] __attribute__ ((aligned (__BIGGEST_ALIGNMENT__)))={2.2360679774997896D};
-//            double Array2[4*sizeof(__m256d)/sizeof(double)] __attribute__ ((aligned (__BIGGEST_ALIGNMENT__)))={1.0D/2.2360679774997896D};
-//            double Array3[16*sizeof(__m256d)/sizeof(double)] __attribute__ ((aligned (__BIGGEST_ALIGNMENT__)))={2.2360679774997896D};
-            volatile int never=0;
-//            __m256d AVXymmA1, AVXymmA2, AVXymmA3, AVXymmA4;
-//            __m256d AVXymmB1, AVXymmB2, AVXymmB3, AVXymmB4;
-//            __m256d AVXymmC11, AVXymmC21, AVXymmC31, AVXymmC41;
-//            __m256d AVXymmC12, AVXymmC22, AVXymmC32, AVXymmC42;
-//            __m256d AVXymmC13, AVXymmC23, AVXymmC33, AVXymmC43;
-//            __m256d AVXymmC14, AVXymmC24, AVXymmC34, AVXymmC44;
-//            __m256d AVXymmT11, AVXymmT21, AVXymmT31, AVXymmT41;
-//            __m256d AVXymmT12, AVXymmT22, AVXymmT32, AVXymmT42;
-//            __m256d AVXymmT13, AVXymmT23, AVXymmT33, AVXymmT43;
-//            __m256d AVXymmT14, AVXymmT24, AVXymmT34, AVXymmT44;
-            cycle_stamp[0]=get_cycles();
-//            AVXymmA1=_mm256_load_pd(&(Array1[0+never]));
-//            AVXymmA2=_mm256_load_pd(&(Array1[4+never]));
-//            AVXymmA3=_mm256_load_pd(&(Array1[8+never]));
-//            AVXymmA4=_mm256_load_pd(&(Array1[12+never]));
-//            AVXymmB1=_mm256_load_pd(&(Array2[0+never]));
-//            AVXymmB2=_mm256_load_pd(&(Array2[4+never]));
-//            AVXymmB3=_mm256_load_pd(&(Array2[8+never]));
-//            AVXymmB4=_mm256_load_pd(&(Array2[12+never]));
-//            AVXymmC11=_mm256_load_pd(&(Array3[0+never]));
-//            AVXymmC12=_mm256_load_pd(&(Array3[4+never]));
-//            AVXymmC13=_mm256_load_pd(&(Array3[8+never]));
-//            AVXymmC14=_mm256_load_pd(&(Array3[12+never]));
-//            AVXymmC21=_mm256_load_pd(&(Array3[16+never]));
-//            AVXymmC22=_mm256_load_pd(&(Array3[20+never]));
-//            AVXymmC23=_mm256_load_pd(&(Array3[24+never]));
-//            AVXymmC24=_mm256_load_pd(&(Array3[28+never]));
-//            AVXymmC31=_mm256_load_pd(&(Array3[32+never]));
-//            AVXymmC32=_mm256_load_pd(&(Array3[36+never]));
-//            AVXymmC33=_mm256_load_pd(&(Array3[40+never]));
-//            AVXymmC34=_mm256_load_pd(&(Array3[44+never]));
-//            AVXymmC41=_mm256_load_pd(&(Array3[48+never]));
-//            AVXymmC42=_mm256_load_pd(&(Array3[52+never]));
-//            AVXymmC43=_mm256_load_pd(&(Array3[56+never]));
-//            AVXymmC44=_mm256_load_pd(&(Array3[60+never]));
-            for (count = 1; count <= loopcount; count++) {
-//               AVXymmT11=_mm256_mul_pd(AVXymmA1, AVXymmB1);
-//               AVXymmT21=_mm256_mul_pd(AVXymmA2, AVXymmB1);
-//               AVXymmT31=_mm256_mul_pd(AVXymmA3, AVXymmB1);
-//               AVXymmT41=_mm256_mul_pd(AVXymmA4, AVXymmB1);
-//               AVXymmT12=_mm256_mul_pd(AVXymmA1, AVXymmB2);
-//               AVXymmT22=_mm256_mul_pd(AVXymmA2, AVXymmB2);
-//               AVXymmT32=_mm256_mul_pd(AVXymmA3, AVXymmB2);
-//               AVXymmT42=_mm256_mul_pd(AVXymmA4, AVXymmB2);
-//               AVXymmT13=_mm256_mul_pd(AVXymmA1, AVXymmB3);
-//               AVXymmT23=_mm256_mul_pd(AVXymmA2, AVXymmB3);
-//               AVXymmT33=_mm256_mul_pd(AVXymmA3, AVXymmB3);
-//               AVXymmT43=_mm256_mul_pd(AVXymmA4, AVXymmB3);
-//               AVXymmT14=_mm256_mul_pd(AVXymmA1, AVXymmB4);
-//               AVXymmT24=_mm256_mul_pd(AVXymmA2, AVXymmB4);
-//               AVXymmT34=_mm256_mul_pd(AVXymmA3, AVXymmB4);
-//               AVXymmT44=_mm256_mul_pd(AVXymmA4, AVXymmB4);
-//               AVXymmC11=_mm256_add_pd(AVXymmC11, AVXymmT11);
-//               AVXymmC21=_mm256_add_pd(AVXymmC21, AVXymmT21);
-//               AVXymmC31=_mm256_add_pd(AVXymmC31, AVXymmT31);
-//               AVXymmC41=_mm256_add_pd(AVXymmC41, AVXymmT41);
-//               AVXymmC12=_mm256_add_pd(AVXymmC12, AVXymmT12);
-//               AVXymmC22=_mm256_add_pd(AVXymmC22, AVXymmT22);
-//               AVXymmC32=_mm256_add_pd(AVXymmC32, AVXymmT32);
-//               AVXymmC42=_mm256_add_pd(AVXymmC42, AVXymmT42);
-//               AVXymmC13=_mm256_add_pd(AVXymmC13, AVXymmT13);
-//               AVXymmC23=_mm256_add_pd(AVXymmC23, AVXymmT23);
-//               AVXymmC33=_mm256_add_pd(AVXymmC33, AVXymmT33);
-//               AVXymmC43=_mm256_add_pd(AVXymmC43, AVXymmT43);
-//               AVXymmC14=_mm256_add_pd(AVXymmC14, AVXymmT14);
-//               AVXymmC24=_mm256_add_pd(AVXymmC24, AVXymmT24);
-//               AVXymmC34=_mm256_add_pd(AVXymmC34, AVXymmT34);
-//               AVXymmC44=_mm256_add_pd(AVXymmC44, AVXymmT44);
-               cycle_stamp[count%2]=get_cycles();
-               diff = cycle_stamp[count%2] - cycle_stamp[(count-1)%2];
-               if (diff >= threshold) {
-                  struct timeval spike_time;
-                  tt_gettime(&spike_time);
-                  process_big_diff(&spike_time, &last_spike_time, spikes, &spike_ndx, diff);
-                  cycle_stamp[count%2]=get_cycles();
-                  if ( never == 1 ) {
-//                     AVXymmA1=_mm256_load_pd(&(Array2[count+0+never]));
-//                     AVXymmA2=_mm256_load_pd(&(Array2[count+1+never]));
-//                     AVXymmA3=_mm256_load_pd(&(Array2[count+2+never]));
-//                     AVXymmA4=_mm256_load_pd(&(Array2[count+3+never]));
-                  }
-               } else
-                  if (diff < min_spike) min_spike = diff;
-            }
-            if ( never == 1 ) {
-//               _mm256_store_pd(&(Array3[0+never]), AVXymmC11);
-//               _mm256_store_pd(&(Array3[4+never]), AVXymmC12);
-//               _mm256_store_pd(&(Array3[8+never]), AVXymmC13);
-//               _mm256_store_pd(&(Array3[12+never]), AVXymmC14);
-//               _mm256_store_pd(&(Array3[16+never]), AVXymmC21);
-//               _mm256_store_pd(&(Array3[20+never]), AVXymmC22);
-//               _mm256_store_pd(&(Array3[24+never]), AVXymmC23);
-//               _mm256_store_pd(&(Array3[28+never]), AVXymmC24);
-//               _mm256_store_pd(&(Array3[32+never]), AVXymmC31);
-//               _mm256_store_pd(&(Array3[36+never]), AVXymmC32);
-//               _mm256_store_pd(&(Array3[40+never]), AVXymmC33);
-//               _mm256_store_pd(&(Array3[44+never]), AVXymmC34);
-//               _mm256_store_pd(&(Array3[48+never]), AVXymmC41);
-//               _mm256_store_pd(&(Array3[52+never]), AVXymmC42);
-//               _mm256_store_pd(&(Array3[56+never]), AVXymmC43);
-//               _mm256_store_pd(&(Array3[60+never]), AVXymmC44);
-//               printf("Never print the value %g\n", Array3[never]);
-            }
-         } else {
-            unsigned long cycle_stamp[2], temp_cycles;
-            struct timeval spike_time;
-            cycle_stamp[0]=get_cycles_p();
-            for (count = 1; count <= loopcount; count++) {
-               cycle_stamp[count%2]=get_cycles_p();
-               diff = cycle_stamp[count%2] - cycle_stamp[(count-1)%2];
-               if (diff >= threshold) {
-                  tt_gettime(&spike_time);
-                  process_big_diff(&spike_time, &last_spike_time, spikes, &spike_ndx, diff);
-                  temp_cycles=get_cycles_p();
-                  overhead_cycles+=(temp_cycles-cycle_stamp[count%2]);
-                  cycle_stamp[count%2]=temp_cycles;
-               } else
-                  if (diff < min_spike) min_spike = diff;
-            }
-         }
+         noise_kind=0;
       }
+   } else {
+      run_samplers(samplers, sampler_count, use_cpus, use_writer, requested_policy, requested_priority);
    }
-/* The full buffer has been dumped when it was filled;
-   now that the loop is done the buffer has probably accumulated more spikes, so dump it.
-*/
-   if (spike_ndx>0) print_big_diff(spikes, &spike_ndx);
+   if ((stop_requested != 0) && (chatty >= 1)) printf ("%sstopped by signal %d; the results cover the run up to then%s\n", XML_head, (int)stop_requested, XML_tail);
 
-   if (min_spike != ULONG_MAX) {
+   if ( use_cpus == 1 ) {
+      if (chatty >= 1) print_cpu_summary(samplers, sampler_count);
+   } else {
+      if (samplers[0].min_spike != ULONG_MAX) {
 // It is pretty much guaranteed that min_spike will be less than ULONG_MAX;
 // if it is equal to ULONG_MAX then that means that every single iteration was a spike.
-      if (chatty >= 2) {
-         if (format == CSV_FORMAT) printf("minimum spike,%ld\n", min_spike);
-         else if (format==XML_FORMAT) printf("      <minumum_spike>%lu</minumum_spike>\n", min_spike);
-         else printf ("minimum spike = %lu units\n", min_spike);
+         if (chatty >= 2) {
+            if (format == CSV_FORMAT) printf("minimum spike,%ld\n", spike_units(method, samplers[0].min_spike));
+            else if (format==XML_FORMAT) printf("      <minumum_spike>%lu</minumum_spike>\n", spike_units(method, samplers[0].min_spike));
+            else printf ("minimum spike = %lu units\n", spike_units(method, samplers[0].min_spike));
+         }
+      }
+      if (options[OVERHEAD_OPTION]==1) {
+         if (!CYCLE_METHOD(method)) {
+            if (format == CSV_FORMAT) print_seconds("Overhead seconds,", samplers[0].overhead_nsec, "\n");
+            else if (format == XML_FORMAT) print_seconds("<OverheadSeconds>", samplers[0].overhead_nsec, "</OverheadSeconds>\n");
+            else print_seconds("Overhead seconds:  ", samplers[0].overhead_nsec, "\n");
+         } else {
+            if (format == CSV_FORMAT) printf("Overhead cycles,%ld\n", samplers[0].overhead_cycles);
+            else if (format == XML_FORMAT) printf("      <OverheadCycles>%ld</OverheadCycles>\n", samplers[0].overhead_cycles);
+            else printf("Overhead cycles = %ld\n", samplers[0].overhead_cycles);
+         }
+      }
+      if (chatty >= 1) {
+         if (format == CSV_FORMAT) printf("Spikes,%lu\n", samplers[0].spike_count);
+         else if (format == XML_FORMAT) printf("      <Spikes>%lu</Spikes>\n", samplers[0].spike_count);
+         else printf("Spikes = %lu\n", samplers[0].spike_count);
+      }
+      if ((options[SMI_SPIKES_OPTION]==1) && (chatty >= 1)) {
+         if (format == CSV_FORMAT) printf("Spikes with an SMI,%lu\n", samplers[0].smi_spikes);
+         else if (format == XML_FORMAT) printf("      <SMISpikes>%lu</SMISpikes>\n", samplers[0].smi_spikes);
+         else printf("Spikes with an SMI = %lu\n", samplers[0].smi_spikes);
+      }
+      if ((migration_column==1) && (chatty >= 1)) {
+         if (format == CSV_FORMAT) printf("CPU migrations seen by rdtscp,%lu\n", samplers[0].migrations);
+         else if (format == XML_FORMAT) printf("      <Migrations>%lu</Migrations>\n", samplers[0].migrations);
+         else printf("CPU migrations seen by rdtscp = %lu\n", samplers[0].migrations);
       }
    }
-   if (options[OVERHEAD_OPTION]==1) {
-      if (method==TIME_METHOD) {
-         if (format == CSV_FORMAT) printf("Overhead seconds,%lu.%.6lu\n", overhead_seconds.tv_sec, overhead_seconds.tv_usec);
-         else if (format == XML_FORMAT) printf("<OverheadSeconds>%lu.%.6lu</OverheadSeconds>\n", overhead_seconds.tv_sec, overhead_seconds.tv_usec);
-         else printf("Overhead seconds:  %lu.%.6lu\n", overhead_seconds.tv_sec, overhead_seconds.tv_usec);
+   if ( pm_qos.mode != 0 ) {
+      pm_qos_stop(samplers, sampler_count);
+      if ((pm_qos.ab == 1) && (chatty >= 1)) print_pm_qos_ab(samplers, sampler_count);
+   }
+   if ( metrics_address != NULL ) {
+      stop_exporter();
+      if (chatty >= 2) printf ("%s%lu metrics scrapes%s\n", XML_head, exporter.scrapes, XML_tail);
+   }
+   if ((options[POWER_HOG_OPTION]==1) && (chatty >= 1)) print_hog_summary(samplers, sampler_count);
+   if ( noise_kind != 0 ) {
+      print_noise_comparison(quiet, samplers, sampler_count);
+      if (chatty >= 1) print_noise_summary(noise, noise_count);
+      free(noise);
+      free(quiet);
+   }
+   if (options[HISTOGRAM_OPTION]==1) {
+      for (ndx=0; ndx<sampler_count; ndx++) print_histogram(&samplers[ndx]);
+   }
+   if ( log_path != NULL ) {
+      for (ndx=0; ndx<sampler_count; ndx++) {
+         spike_log_struct *log=samplers[ndx].log;
+         spike_log_close(log);
+         if (chatty >= 1) {
+            if (format == CSV_FORMAT) printf("Spike log,%s,%lu,%lu\n", log->path, log->count, log->drops);
+            else if (format == XML_FORMAT) printf("      <SpikeLog>\n         <path>%s</path>\n         <spikes>%lu</spikes>\n         <dropped>%lu</dropped>\n      </SpikeLog>\n", log->path, log->count, log->drops);
+            else printf("%lu spikes logged to %s (%lu dropped)\n", log->count, log->path, log->drops);
+         }
+      }
+   }
+   if ((record_only == 1) && (chatty >= 1)) {
+      unsigned long spike_drops=0L;
+      for (ndx=0; ndx<sampler_count; ndx++) spike_drops+=samplers[ndx].spike_drops;
+      if (format == CSV_FORMAT) printf("Spikes not recorded (buffer full),%lu\n", spike_drops);
+      else if (format == XML_FORMAT) printf("      <UnrecordedSpikes>%lu</UnrecordedSpikes>\n", spike_drops);
+      else printf("Spikes not recorded (buffer full) = %lu\n", spike_drops);
+   }
+   if ((options[OVERHEAD_OPTION]==1) && (use_writer == 1)) {
+      unsigned long ring_drops=0L;
+      for (ndx=0; ndx<sampler_count; ndx++) ring_drops+=samplers[ndx].ring_drops;
+      if (format == CSV_FORMAT) {
+         printf("Writer spikes,%lu\n", writer.records);
+         printf("Writer overhead cycles,%lu\n", writer.overhead_cycles);
+         printf("Dropped spikes,%lu\n", ring_drops);
+      } else if (format == XML_FORMAT) {
+         printf("      <WriterSpikes>%lu</WriterSpikes>\n", writer.records);
+         printf("      <WriterOverheadCycles>%lu</WriterOverheadCycles>\n", writer.overhead_cycles);
+         printf("      <DroppedSpikes>%lu</DroppedSpikes>\n", ring_drops);
       } else {
-         if (format == CSV_FORMAT) printf("Overhead cycles,%ld\n", overhead_cycles);
-         else if (format == XML_FORMAT) printf("      <OverheadCycles>%ld</OverheadCycles>\n", overhead_cycles);
-         else printf("Overhead cycles = %ld\n", overhead_cycles);
+         printf("Writer spikes = %lu\n", writer.records);
+         printf("Writer overhead cycles = %lu\n", writer.overhead_cycles);
+         printf("Dropped spikes = %lu\n", ring_drops);
       }
    }
    if (format==XML_FORMAT) {
@@ -1320,7 +5771,7 @@ optopt
    }
    if ( options[SMI_OPTION]==1) {
       unsigned long SMI_count;
-      status=msr_read(0x34L, &SMI_count, 0L);
+      status=msr_read(MSR_SMI_COUNT, &SMI_count, 0L);
       if (status >= 0) {
          if (format == CSV_FORMAT) printf("SMI count,%ld\n", SMI_count);
          else if (format == XML_FORMAT) printf("<SMIcount>%ld</SMIcount>\n", SMI_count);